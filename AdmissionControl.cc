@@ -0,0 +1,143 @@
+#include "AdmissionControl.hh"
+
+#include "logging.hh"
+
+// Token bucket refill rates (tokens per second) and sizes per operation
+// class. A store costs a token per entry; callers may go into debt for a
+// large batch, which then delays their next stores.
+static const struct
+{
+	double rate, burst;
+} bucket_params[AdmissionControl::op_classes] = {
+	{   50,  100 },		// op_routing
+	{   50,  100 },		// op_read
+	{  200, 1000 }		// op_write
+};
+
+AdmissionControl::AdmissionControl( ) :
+	_max_calls(default_max_calls),
+	_calls(0),
+	_shed(0)
+{
+}
+
+void AdmissionControl::limit(
+	unsigned max_calls )
+{
+	omni_mutex_lock l(_mutex);
+	_max_calls = max_calls;
+}
+
+AdmissionControl::Caller &AdmissionControl::caller_unlocked(
+	const Id &id,
+	mstime_t t )
+{
+	callers_t::iterator i = _callers.find(id);
+	if(i != _callers.end())
+		return i->second;
+
+	if(_callers.size() >= max_callers)
+	{
+		for(callers_t::iterator j = _callers.begin(); j != _callers.end(); )
+			if(j->second.last_update + idle_time <= t)
+				_callers.erase(j++);
+			else
+				++j;
+		if(_callers.size() >= max_callers)
+			_callers.erase(_callers.begin());
+	}
+
+	Caller caller;
+	for(unsigned n = 0; n < op_classes; ++n)
+		caller.buckets[n].tokens = bucket_params[n].burst;
+	caller.last_update = t;
+	return _callers.insert(std::make_pair(id, caller)).first->second;
+}
+
+bool AdmissionControl::enter(
+	const Id &id,
+	op_class type,
+	unsigned cost )
+{
+	omni_mutex_lock l(_mutex);
+
+	// Shed reads and stores before the reserved capacity is touched.
+	unsigned max_calls = _max_calls;
+	if(max_calls && type != op_routing)
+		max_calls = max_calls > reserved_calls ? max_calls - reserved_calls : 1;
+	if(max_calls && _calls >= max_calls)
+	{
+		++_shed;
+		trace(25) << "AdmissionControl::enter(): shedding call; " << _calls <<
+			" calls executing" << endm;
+		return false;
+	}
+
+	// Refill the caller's buckets for the time passed since the last call.
+	mstime_t t = coarse_now();
+	Caller &caller = caller_unlocked(id, t);
+	double elapsed = (t - caller.last_update)/1000.0;
+	caller.last_update = t;
+	for(unsigned n = 0; n < op_classes; ++n)
+	{
+		caller.buckets[n].tokens += elapsed*bucket_params[n].rate;
+		if(caller.buckets[n].tokens > bucket_params[n].burst)
+			caller.buckets[n].tokens = bucket_params[n].burst;
+	}
+
+	Bucket &bucket = caller.buckets[type];
+	if(bucket.tokens <= 0)
+	{
+		++_shed;
+		trace(25) << "AdmissionControl::enter(): rate limit exceeded by node ID " << id << endm;
+		return false;
+	}
+	bucket.tokens -= cost;
+	++_calls;
+	return true;
+}
+
+void AdmissionControl::leave( )
+{
+	omni_mutex_lock l(_mutex);
+	--_calls;
+}
+
+unsigned long AdmissionControl::shed( )
+{
+	omni_mutex_lock l(_mutex);
+	return _shed;
+}
+
+bool AdmissionControl::is_shed(
+	const CORBA::Exception &e )
+{
+	const CORBA::TRANSIENT *transient = dynamic_cast<const CORBA::TRANSIENT*>(&e);
+	return transient && transient->minor() == shed_minor;
+}
+
+bool AdmissionControl::is_dead(
+	const CORBA::Exception &e )
+{
+	if(const CORBA::TRANSIENT *transient = dynamic_cast<const CORBA::TRANSIENT*>(&e))
+		return (transient->minor() & 0xffff0000UL) != (shed_minor & 0xffff0000UL);
+	return dynamic_cast<const CORBA::COMM_FAILURE*>(&e) ||
+		dynamic_cast<const CORBA::TIMEOUT*>(&e) ||
+		dynamic_cast<const CORBA::OBJECT_NOT_EXIST*>(&e);
+}
+
+AdmissionControl::Call::Call(
+	AdmissionControl &control,
+	const kademlia::id_t caller,
+	op_class type,
+	unsigned cost ) :
+	_control(control)
+{
+	if(!_control.enter(Id(caller), type, cost))
+		throw CORBA::TRANSIENT(shed_minor, CORBA::COMPLETED_NO);
+}
+
+AdmissionControl::Call::~Call( )
+{
+	_control.leave();
+}
@@ -0,0 +1,128 @@
+#ifndef ADMISSIONCONTROL_HH_INCLUDED
+#define ADMISSIONCONTROL_HH_INCLUDED
+
+#include "kademlia.hh"
+
+#include "Id.hh"
+#include "time.hh"
+
+#include <omnithread.h>
+#include <map>
+
+/*
+	Decides whether a node accepts an incoming call. Every caller gets a
+	token bucket per class of operation, and the number of calls executing
+	at once is capped. Part of the capacity is reserved for routing calls
+	(ping and find_nodes), which keep the overlay healthy, so these still get
+	through when reads and stores are being shed.
+
+	Rejected calls fail fast with a TRANSIENT exception carrying shed_minor,
+	so callers can tell an overloaded node from a dead one and keep it as a
+	contact. Nodes refusing a call for other reasons use minor codes of their
+	own; see is_dead(). Caller IDs are not authenticated; the limits protect against
+	overload rather than against malicious nodes.
+*/
+class AdmissionControl
+{
+public:
+
+	enum op_class { op_routing, op_read, op_write, op_classes };
+
+	// Minor code of the TRANSIENT exceptions raised for rejected calls.
+	static const CORBA::ULong shed_minor = 0x4B440001;	// "KD" 1
+
+	// Minor code of the TRANSIENT exceptions raised for stores that do not
+	// fit in the storage budget.
+	static const CORBA::ULong full_minor = 0x4B440002;	// "KD" 2
+
+	// Minor code of the TRANSIENT exceptions raised for stores sent to a
+	// node that is draining.
+	static const CORBA::ULong drain_minor = 0x4B440003;	// "KD" 3
+
+	static const unsigned default_max_calls = 64;
+
+	AdmissionControl( );
+
+	// Sets the maximum number of calls executing at once (zero means
+	// unlimited).
+	void limit(
+		unsigned max_calls );
+
+	// Returns whether a call of the given class and cost (in tokens) from the
+	// given caller may proceed; if so, leave() must be called when it ends.
+	bool enter(
+		const Id &caller,
+		op_class type,
+		unsigned cost = 1 );
+
+	void leave( );
+
+	// Returns the number of calls rejected so far.
+	unsigned long shed( );
+
+	/*
+		Admits a call for the lifetime of the object, or throws TRANSIENT if
+		it is rejected.
+	*/
+	class Call
+	{
+	public:
+		Call(
+			AdmissionControl &control,
+			const kademlia::id_t caller,
+			op_class type,
+			unsigned cost = 1 );
+
+		~Call( );
+
+	private:
+		AdmissionControl &_control;
+
+	}; // class AdmissionControl::Call
+
+	// Returns whether an exception was raised by a node rejecting a call.
+	static bool is_shed(
+		const CORBA::Exception &e );
+
+	// Returns whether an exception shows that a node could not be reached,
+	// so that it should be dropped as a contact. Other exceptions come from
+	// live nodes refusing a call. omniORB reports failed connections and
+	// call timeouts as TRANSIENT; ours are told apart by their minor codes.
+	static bool is_dead(
+		const CORBA::Exception &e );
+
+private:
+
+	struct Bucket
+	{
+		double tokens;
+	};
+
+	struct Caller
+	{
+		Bucket   buckets[op_classes];
+		mstime_t last_update;
+	};
+
+	typedef std::map<Id, Caller> callers_t;
+
+	// Number of callers tracked; callers idle for idle_time are forgotten
+	// first, since their buckets have been refilled anyway.
+	static const unsigned max_callers = 1024;
+	static const unsigned idle_time   = 60*1000;	// 1 minute
+
+	// Number of concurrent calls reserved for routing.
+	static const unsigned reserved_calls = 16;
+
+	Caller &caller_unlocked(
+		const Id &id,
+		mstime_t t );
+
+	omni_mutex    _mutex;
+	callers_t     _callers;
+	unsigned      _max_calls, _calls;
+	unsigned long _shed;
+
+}; // class AdmissionControl
+
+#endif //ndef ADMISSIONCONTROL_HH_INCLUDED
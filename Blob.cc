@@ -0,0 +1,272 @@
+#include "Blob.hh"
+
+#include <cstring>
+#include <new>
+
+#include <omnithread.h>
+
+#ifdef __WIN32__
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+static long atomic_increment(volatile long *value)
+{
+	return InterlockedIncrement(value);
+}
+
+static long atomic_decrement(volatile long *value)
+{
+	return InterlockedDecrement(value);
+}
+
+#else
+
+static long atomic_increment(volatile long *value)
+{
+	return __sync_add_and_fetch(value, 1);
+}
+
+static long atomic_decrement(volatile long *value)
+{
+	return __sync_sub_and_fetch(value, 1);
+}
+
+#endif
+
+
+/*
+	Slab allocator. Small allocations are rounded up to one of a fixed set of
+	chunk sizes; chunks of each size are carved from 64 KB slabs and recycled
+	through a free list. Slab memory is never returned to the system. Larger
+	allocations are passed on to operator new.
+*/
+
+static const size_t slab_size = 64*1024;
+
+static const size_t chunk_sizes[] = {
+	32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096 };
+
+static const unsigned num_chunk_sizes = sizeof(chunk_sizes)/sizeof(*chunk_sizes);
+
+struct FreeChunk
+{
+	FreeChunk *next;
+};
+
+static struct SizeClass
+{
+	omni_mutex mutex;
+	FreeChunk  *free;
+} size_classes[num_chunk_sizes];
+
+static unsigned size_class(size_t size)
+{
+	unsigned c = 0;
+	while(c < num_chunk_sizes && chunk_sizes[c] < size)
+		++c;
+	return c;
+}
+
+static size_t allocation_size(size_t size)
+{
+	unsigned c = size_class(size);
+	return c < num_chunk_sizes ? chunk_sizes[c] : size;
+}
+
+static void *slab_allocate(size_t size)
+{
+	unsigned c = size_class(size);
+	if(c == num_chunk_sizes)
+		return ::operator new(size);
+
+	SizeClass &sc = size_classes[c];
+	omni_mutex_lock l(sc.mutex);
+	if(!sc.free)
+	{
+		// Carve a new slab into chunks.
+		char *slab = static_cast<char*>(::operator new(slab_size));
+		for(size_t offset = 0; offset + chunk_sizes[c] <= slab_size; offset += chunk_sizes[c])
+		{
+			FreeChunk *chunk = reinterpret_cast<FreeChunk*>(slab + offset);
+			chunk->next = sc.free;
+			sc.free = chunk;
+		}
+	}
+	FreeChunk *chunk = sc.free;
+	sc.free = chunk->next;
+	return chunk;
+}
+
+static void slab_release(void *ptr, size_t size)
+{
+	unsigned c = size_class(size);
+	if(c == num_chunk_sizes)
+	{
+		::operator delete(ptr);
+		return;
+	}
+
+	SizeClass &sc = size_classes[c];
+	omni_mutex_lock l(sc.mutex);
+	FreeChunk *chunk = static_cast<FreeChunk*>(ptr);
+	chunk->next = sc.free;
+	sc.free = chunk;
+}
+
+
+/*
+	Blob implementation.
+*/
+
+struct Blob::Header
+{
+	volatile long refs;
+	size_t        size;
+	unsigned long hash;
+};
+
+// The encoded data follows the header, aligned to 8 bytes as CDR requires.
+const size_t Blob::header_size = (sizeof(Blob::Header) + 7) & ~size_t(7);
+
+static unsigned long fnv_hash(const unsigned char *data, size_t size)
+{
+	unsigned long hash = 2166136261UL;
+	for(size_t n = 0; n < size; ++n)
+		hash = (hash ^ data[n]) * 16777619UL;
+	return hash;
+}
+
+Blob::Blob( ) :
+	_header(0)
+{
+}
+
+Blob::Blob(
+	const CORBA::Any &any ) :
+	_header(0)
+{
+	CORBA::Any canonical(any);
+	CORBA::TypeCode_var type = any.type();
+	CORBA::TypeCode_var compact = type->get_compact_typecode();
+	canonical.type(compact);
+
+	cdrMemoryStream stream(0, true);
+	stream.setByteSwapFlag(false);
+	canonical >>= stream;
+	assign(stream.bufPtr(), stream.bufSize());
+}
+
+Blob::Blob(
+	const void *data,
+	size_t size ) :
+	_header(0)
+{
+	assign(data, size);
+}
+
+Blob::Blob(
+	const Blob &other ) :
+	_header(other._header)
+{
+	if(_header)
+		atomic_increment(&_header->refs);
+}
+
+Blob::~Blob( )
+{
+	if(_header && atomic_decrement(&_header->refs) == 0)
+		slab_release(_header, header_size + _header->size);
+}
+
+Blob &Blob::operator= (
+	const Blob &other )
+{
+	if(other._header)
+		atomic_increment(&other._header->refs);
+	if(_header && atomic_decrement(&_header->refs) == 0)
+		slab_release(_header, header_size + _header->size);
+	_header = other._header;
+	return *this;
+}
+
+void Blob::assign(
+	const void *data,
+	size_t size )
+{
+	_header = static_cast<Header*>(slab_allocate(header_size + size));
+	_header->refs = 1;
+	_header->size = size;
+	std::memcpy(reinterpret_cast<char*>(_header) + header_size, data, size);
+	_header->hash = fnv_hash(this->data(), size);
+}
+
+bool Blob::operator== (
+	const Blob &other ) const
+{
+	if(_header == other._header)
+		return true;
+	if(!_header || !other._header)
+		return false;
+	return _header->hash == other._header->hash &&
+	       _header->size == other._header->size &&
+	       std::memcmp(data(), other.data(), size()) == 0;
+}
+
+bool Blob::operator!= (
+	const Blob &other ) const
+{
+	return !(*this == other);
+}
+
+void Blob::to_any(
+	CORBA::Any &any ) const
+{
+	if(!_header)
+	{
+		any = CORBA::Any();
+		return;
+	}
+	cdrMemoryStream stream(const_cast<unsigned char*>(data()), size());
+	stream.setByteSwapFlag(false);
+	any <<= stream;
+}
+
+const unsigned char *Blob::data( ) const
+{
+	return _header ? reinterpret_cast<const unsigned char*>(_header) + header_size : 0;
+}
+
+size_t Blob::size( ) const
+{
+	return _header ? _header->size : 0;
+}
+
+size_t Blob::footprint( ) const
+{
+	return _header ? allocation_size(header_size + _header->size) : 0;
+}
+
+struct Fingerprint
+{
+	unsigned long long size, hash;
+};
+
+Blob Blob::fingerprint( ) const
+{
+	Fingerprint fp = { size(), _header ? _header->hash : 0 };
+	return Blob(&fp, sizeof(fp));
+}
+
+bool Blob::has_fingerprint(
+	const Blob &fingerprint ) const
+{
+	Fingerprint fp = { size(), _header ? _header->hash : 0 };
+	return fingerprint.size() == sizeof(fp) &&
+	       std::memcmp(fingerprint.data(), &fp, sizeof(fp)) == 0;
+}
+
+bool Blob::empty( ) const
+{
+	return _header == 0;
+}
@@ -0,0 +1,80 @@
+#ifndef BLOB_HH_INCLUDED
+#define BLOB_HH_INCLUDED
+
+#include "kademlia.hh"
+
+#include <cstddef>
+
+/*
+	An immutable, reference-counted CORBA::Any value, kept in marshalled
+	(CDR-encoded) form. Copying a blob only increments its reference count;
+	the value is only unmarshalled when it is converted back to an Any.
+	Memory for the encoded data is obtained from a slab allocator.
+
+	Values are encoded canonically: big-endian, with zeroed padding and the
+	compact form of their TypeCode (without names). Structurally equal
+	values of the same type therefore have identical encodings, and two
+	blobs compare equal if their encodings are identical.
+*/
+class Blob
+{
+public:
+	Blob( );
+
+	Blob(
+		const CORBA::Any &any );
+
+	Blob(
+		const void *data,
+		size_t size );
+
+	Blob(
+		const Blob &other );
+
+	~Blob( );
+
+	Blob &operator= (
+		const Blob &other );
+
+	bool operator== (
+		const Blob &other ) const;
+
+	bool operator!= (
+		const Blob &other ) const;
+
+	// Unmarshals the value into the given Any.
+	void to_any(
+		CORBA::Any &any ) const;
+
+	// Returns the encoded value and its size in bytes.
+	const unsigned char *data( ) const;
+
+	size_t size( ) const;
+
+	// Returns the number of bytes of memory allocated for this blob.
+	size_t footprint( ) const;
+
+	// Returns a small blob that identifies the value by its size and hash,
+	// to remember a value without keeping it.
+	Blob fingerprint( ) const;
+
+	// Returns whether the given blob is the fingerprint of this one.
+	bool has_fingerprint(
+		const Blob &fingerprint ) const;
+
+	bool empty( ) const;
+
+private:
+	struct Header;
+
+	static const size_t header_size;
+
+	void assign(
+		const void *data,
+		size_t size );
+
+	Header *_header;
+
+}; // class Blob
+
+#endif //ndef BLOB_HH_INCLUDED
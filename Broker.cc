@@ -1,12 +1,21 @@
 #include "Broker.hh"
+#include "Lookup.hh"
 #include "Node.hh"
 #include "compare_any.hh"
+#include "endpoint.hh"
 #include "logging.hh"
 
+#include <algorithm>
+#include <cstring>
+#include <list>
+
 using namespace kademlia;
 
+extern CORBA::ORB_var orb;
+
 Broker_impl::Broker_impl(Node_impl &node) :
-	_node(node)
+	_node(node),
+	_watched_hops(0)
 {
 }
 
@@ -19,6 +28,8 @@ void Broker_impl::store (
     const CORBA::Any &value, 
     CORBA::ULong lifetime )
 {
+	Metrics::Call timer(_node._metrics, Metrics::broker_store);
+	Dispatcher::Slot slot(_node._dispatcher, Dispatcher::client);
 	const node_ref_t& node_ref = _node.reference();
 	const value_t new_value = { value, lifetime };
 	Id index(index_arr);
@@ -26,21 +37,47 @@ void Broker_impl::store (
 		index << " and lifetime " << lifetime << endm;
 
 	seq_node_ref_t_var nodes = find_nodes(index);
+
+	// Send all stores before waiting for any of them to complete.
+	std::vector<CORBA::Request_var> requests(nodes->length());
+	for(unsigned n = 0; n < nodes->length(); ++n)
+	{
+		try
+		{
+			requests[n] = nodes[n].ref->_request("store");
+			requests[n]->add_in_arg() <<= node_ref;
+			requests[n]->add_in_arg() <<= kademlia::id_t_forany(index);
+			requests[n]->add_in_arg() <<= new_value;
+			requests[n]->set_return_type(CORBA::_tc_void);
+			requests[n]->send_deferred();
+		}
+		catch(const CORBA::Exception &e)
+		{
+			requests[n] = CORBA::Request::_nil();
+			failed(Id(nodes[n].id), e, "store value");
+		}
+	}
+
 	for(unsigned n = 0; n < nodes->length(); ++n)
 	{
+		if(CORBA::is_nil(requests[n]))
+			continue;
 		Id node_id(nodes[n].id);
 		try
 		{
-			nodes[n].ref->store(node_ref, index_arr, new_value);
+			requests[n]->get_response();
+			if(CORBA::Exception *e = requests[n]->env()->exception())
+			{
+				failed(node_id, *e, "store value");
+				continue;
+			}
 			_node._ct.insert(node_id, nodes[n].ref, true);
 			trace(25) << "Broker_impl::store(): succesfully stored value at node ID " <<
 				node_id << endm;
 		}
-		catch(const CORBA::Exception &)
+		catch(const CORBA::Exception &e)
 		{
-			_node._ct.erase(node_id);
-			trace(25) << "Broker_impl::store(): failed to store value at node ID " <<
-				node_id << "; erased from contact table." << endm;
+			failed(node_id, e, "store value");
 		}
 	}
 }
@@ -49,138 +86,466 @@ void Broker_impl::erase (
     const kademlia::id_t index,
     const CORBA::Any& value )
 {
+	// The store takes the worker slot.
+	Metrics::Call timer(_node._metrics, Metrics::broker_erase);
 	store(index, value, 0);
 }
 
 seq_any_t* Broker_impl::retrieve (
     const kademlia::id_t index_arr )
 {
-	const node_ref_t& node_ref = _node.reference();
+	Metrics::Call timer(_node._metrics, Metrics::broker_retrieve);
+	Dispatcher::Slot slot(_node._dispatcher, Dispatcher::client);
 	Id index(index_arr);
 	trace(20) << "Broker_impl::retrieve(): retrieving value for index:\n" <<
 		index << endm;
 
+	_node._ct.touch(index);
+	seq_node_ref_t_var contacts = _node._ct.retrieve(index);
+	Lookup lookup(index, contacts.in(), true);
+	run(std::vector<Lookup*>(1, &lookup));
+
+	const seq_value_t empty, &values = lookup.values() ? *lookup.values() : empty;
+	node_ref_t miss;
+	unsigned   closer;
+	if(values.length() > 0 && lookup.miss(miss, closer))
+		cache(index, miss, closer, values);
+
+	// Add all values to the result set
 	seq_any_t_var result = new seq_any_t();
-	seq_node_ref_t_var nodes = find_nodes(index);
-	for(unsigned n = 0; n < nodes->length() && n < replication_factor/5; ++n)
+	for(unsigned m = 0; m < values.length(); ++m)
 	{
-		Id node_id(nodes[n].id);
-		try
-		{
-			// Retrieve nodes at the given index
-			seq_value_t_var values = nodes[n].ref->retrieve(node_ref, index_arr);
-			_node._ct.insert(node_id, nodes[n].ref, true);
-			trace(29) << "Broker_impl::retrieve(): succesfully retrieved values at node ID " <<
-				node_id << endm;
-
-			// Add all values to the result set
-			for(unsigned m = 0; m < values->length(); ++m)
-			{
-				// Check wether the result value was already present
-				unsigned o, results = result->length();
-				for(o = 0; o < results; ++o)
-					if(values[m].contents == result[m])
-						break;
-				if(o == results)
-				{
-					// Add value to result set
-					result->length(results + 1);
-					result[results] = values[m].contents;
-				}
-			}
-		}
-		catch(const CORBA::Exception &)
+		// Check wether the result value was already present
+		unsigned o, results = result->length();
+		for(o = 0; o < results; ++o)
+			if(values[m].contents == result[o])
+				break;
+		if(o == results)
 		{
-			_node._ct.erase(node_id);
-			trace(29) << "Broker_impl::retrieve(): failed to retrieve values at node ID " <<
-				node_id << "; erased from contact table." << endm;
+			// Add value to result set
+			result->length(results + 1);
+			result[results] = values[m].contents;
 		}
 	}
 	return result._retn();
 }
 
+void Broker_impl::drain (
+    CORBA::ULong budget )
+{
+	Metrics::Call timer(_node._metrics, Metrics::broker_drain);
+	Dispatcher::Slot slot(_node._dispatcher, Dispatcher::client);
+	info() << "Broker_impl::drain(): drain requested with a budget of " <<
+		budget << " ms" << endm;
+	if(_node.drain(budget))
+		orb->shutdown(false);
+}
+
 
 seq_node_ref_t* Broker_impl::find_nodes (
 	const Id &target )
 {
 	trace(25) << "Broker_impl::find_nodes(): retrieving nodes for target:\n" << target << endm;
-	const node_ref_t& node_ref = _node.reference();
+	_node._ct.touch(target);
+	seq_compact_node_ref_t endpoints;
+	seq_node_ref_t_var contacts = _node._ct.retrieve(target, &endpoints);
+	trace(29) << contacts->length() << " nodes in local contact table" << endm;
+
+	Lookup lookup(target, contacts.in(), false, &endpoints);
+	run(std::vector<Lookup*>(1, &lookup));
+
+	seq_node_ref_t_var result = lookup.nodes();
+	if(result->length() < replication_factor)
+		error() << "Found only " << result->length() << " nodes near ID " << target <<
+			"; Kademlia node is not properly connected to the network!" << endm;
+	return result._retn();
+}
+
+void Broker_impl::find_nodes_parallel (
+	const std::vector<Id> &targets )
+{
+	std::vector<Lookup*> lookups;
+	for(size_t n = 0; n < targets.size(); ++n)
+	{
+		_node._ct.touch(targets[n]);
+		seq_compact_node_ref_t endpoints;
+		seq_node_ref_t_var contacts = _node._ct.retrieve(targets[n], &endpoints);
+		lookups.push_back(new Lookup(targets[n], contacts.in(), false, &endpoints));
+	}
+	run(lookups);
+	for(size_t n = 0; n < lookups.size(); ++n)
+		delete lookups[n];
+}
 
-	seq_node_ref_t_var result = _node._ct.retrieve(target);
-	bool               queried [replication_factor];
-	Id                 distance[replication_factor];
+// A call waiting for its lookups to finish.
+struct Broker_impl::Run
+{
+	Broker_impl          *broker;
+	std::vector<Lookup*>  lookups;
+	unsigned              outstanding;	// queries sent and not yet handled
+	bool                  done;
+};
 
-	trace(29) << result->length() << " nodes in local contact table" << endm;
-	for(unsigned n = 0; n < result->length(); ++n)
+// A query sent on behalf of a lookup, whose reply has not been handled yet.
+struct Broker_impl::Query
+{
+	Run                     *run;
+	Lookup                  *lookup;
+	node_ref_t               node;
+	bool                     compact;	// asks for compact node references
+	bool                     over_udp;
+	UdpTransport::request_t  udp;
+	CORBA::Request_var       request;
+	mstime_t                 deadline;	// for the reply to request
+};
+
+void Broker_impl::send_query (
+	const node_ref_t &caller,
+	Query &query )
+{
+	kademlia::id_t target;
+	memcpy(target, query.lookup->target(), sizeof(target));
+
+	const char *operation = query.lookup->find_value() ? "find_value" :
+	                        query.compact              ? "find_nodes_compact" : "find_nodes";
+	CORBA::Request_var request = query.node.ref->_request(operation);
+	request->add_in_arg() <<= caller;
+	request->add_in_arg() <<= kademlia::id_t_forany(target);
+	if(query.lookup->find_value())
 	{
-		queried [n] = false;
-		distance[n] = _node._id ^ Id(result[n].id);
+		request->add_out_arg() <<= seq_node_ref_t();
+		request->set_return_type(_tc_seq_value_t);
 	}
+	else
+	if(query.compact)
+		request->set_return_type(_tc_seq_compact_node_ref_t);
+	else
+		request->set_return_type(_tc_seq_node_ref_t);
+	request->send_deferred();
+	query.request  = request._retn();
+	query.deadline = now() + query_timeout;
+}
 
-	while(true)
+bool Broker_impl::resend_query (
+	const node_ref_t &caller,
+	Query &query )
+{
+	query.over_udp = false;
+	try
 	{
-		// Find an unqueried nearby contact
-		unsigned n;
-		for(n = 0; n < result->length(); ++n)
-			if(!queried[n])
-				break;
-		if(n == result->length())
-			break;	// No unqueried contacts left; we're done.
+		send_query(caller, query);
+		return true;
+	}
+	catch(const CORBA::Exception &)
+	{
+		return false;
+	}
+}
 
-		// Query a nearby contact, to find even closer ones.
-		Id node_id(result[n].id);
-		queried[n] = true;
-		try
+omni_mutex                 Broker_impl::_lookup_mutex;
+omni_condition             Broker_impl::_lookup_submitted(&Broker_impl::_lookup_mutex);
+omni_condition             Broker_impl::_lookup_done(&Broker_impl::_lookup_mutex);
+std::vector<Broker_impl::Run*> Broker_impl::_lookup_runs;
+omni_thread               *Broker_impl::_lookup_thread = 0;
+
+void Broker_impl::run (
+	const std::vector<Lookup*> &lookups )
+{
+	if(lookups.empty())
+		return;
+
+	Run run;
+	run.broker      = this;
+	run.lookups     = lookups;
+	run.outstanding = 0;
+	run.done        = false;
+	{
+		omni_mutex_lock l(_lookup_mutex);
+		if(!_lookup_thread)
 		{
-			// Retrieve nodes from remote contact table
-			seq_node_ref_t_var nodes = result[n].ref->find_nodes(node_ref, target);
-			_node._ct.insert(node_id, nodes[n].ref, true);
-			trace(29) << "Broker_impl::find_nodes(): found " << nodes->length() <<
-				" nodes at node ID " << node_id << endm;
+			_lookup_thread = new omni_thread(lookup_thread, 0);
+			_lookup_thread->start();
+		}
+		_lookup_runs.push_back(&run);
+		_lookup_submitted.signal();
+		while(!run.done)
+			_lookup_done.wait();
+	}
 
-			// Insert nodes into result set
-			for(unsigned n = 0; n < nodes->length(); ++n)
+	for(size_t n = 0; n < lookups.size(); ++n)
+		_node._metrics.lookup(lookups[n]->hops());
+
+	omni_mutex_lock l(_watch_mutex);
+	for(size_t n = 0; n < lookups.size(); ++n)
+		if(lookups[n]->target() == _watched)
+			_watched_hops = lookups[n]->hops();
+}
+
+void Broker_impl::watch (
+	const Id &target )
+{
+	omni_mutex_lock l(_watch_mutex);
+	_watched      = target;
+	_watched_hops = 0;
+}
+
+unsigned Broker_impl::watched_hops ( )
+{
+	omni_mutex_lock l(_watch_mutex);
+	return _watched_hops;
+}
+
+void *Broker_impl::lookup_thread (
+	void * )
+{
+	trace(10) << "Broker_impl::lookup_thread(): lookup thread started" << endm;
+	std::list<Query> queries;
+	std::vector< std::pair<Run*, Lookup*> > pending;
+	for(;;)
+	{
+		// Take the lookups of new calls; wait for them if there is nothing
+		// else to do, or while the replies to outstanding queries are due.
+		{
+			omni_mutex_lock l(_lookup_mutex);
+			if(pending.empty())
 			{
-				Id new_id(nodes[n].id), new_distance(new_id ^ _node._id);
-				unsigned p;
-				for(p = 0; p < result->length(); ++p)
-					if(distance[p] == new_distance)
-						goto skip_node;	// node was already present!
-					else
-					if(distance[p] > new_distance)
-						break;	// node p is farther away, insert here.
-
-				// Expand the list if it is not yet too large
-				if(result->length() < replication_factor)
-					result->length(result->length() + 1);
-
-                // Make room for the new entry...
-				for(unsigned m = p + 1; m < result->length(); ++m)
+				if(queries.empty())
+					while(_lookup_runs.empty())
+						_lookup_submitted.wait();
+				else
+				if(_lookup_runs.empty())
 				{
-					queried [m] = queried [m-1];
-					distance[m] = distance[m-1];
-					result  [m] = result  [m-1];
-        		}
+					// Replies are polled for in real time, whatever the clock.
+					unsigned long sec, nsec;
+					omni_thread::get_time(&sec, &nsec, 0, poll_interval*1000000);
+					_lookup_submitted.timedwait(sec, nsec);
+				}
+			}
+			for(size_t n = 0; n < _lookup_runs.size(); ++n)
+				for(size_t m = 0; m < _lookup_runs[n]->lookups.size(); ++m)
+					pending.push_back(std::make_pair(_lookup_runs[n], _lookup_runs[n]->lookups[m]));
+			_lookup_runs.clear();
+		}
 
-				// and insert it.
-				queried [p] = false;
-				distance[p] = new_distance;
-				result  [p] = nodes[n];
+		// Send queries for lookups that have room for more. A call is done
+		// when none of its lookups has queries outstanding or left to send.
+		std::vector<Run*> runs;
+		for(size_t n = 0; n < pending.size(); ++n)
+		{
+			Run &run = *pending[n].first;
+			run.broker->send_queries(run, *pending[n].second, queries);
+			if(std::find(runs.begin(), runs.end(), &run) == runs.end())
+				runs.push_back(&run);
+		}
+		pending.clear();
+		for(size_t n = 0; n < runs.size(); ++n)
+			if(runs[n]->outstanding == 0)
+			{
+				omni_mutex_lock l(_lookup_mutex);
+				runs[n]->done = true;
+				_lookup_done.broadcast();
+			}
 
-			skip_node: ;
+		// Handle the replies that have arrived.
+		for(std::list<Query>::iterator i = queries.begin(); i != queries.end(); )
+		{
+			Run &run = *i->run;
+			if(!run.broker->poll_query(*i))
+			{
+				++i;
+				continue;
 			}
+			--run.outstanding;
+			pending.push_back(std::make_pair(&run, i->lookup));
+			i = queries.erase(i);
+		}
+	}
+	return 0;
+}
+
+void Broker_impl::send_queries (
+	Run &run,
+	Lookup &lookup,
+	std::list<Query> &queries )
+{
+	const node_ref_t& node_ref = _node.reference();
+	UdpTransport      *udp = _node.udp();
+	Query query;
+	query.run    = &run;
+	query.lookup = &lookup;
+	while(lookup.next(query.node))
+	{
+		// Node lookups go over UDP to nodes with a known endpoint. The
+		// lookup knows most of them; parsing the reference is the fallback.
+		endpoint_t endpoint;
+		query.over_udp = udp && !lookup.find_value() &&
+			(lookup.endpoint(Id(query.node.id), endpoint) ||
+			 endpoint_of(query.node.ref, endpoint));
+		if(query.over_udp)
+		{
+			query.udp = udp->find_nodes(endpoint, lookup.target());
+			queries.push_back(query);
+			++run.outstanding;
+			continue;
+		}
+
+		query.compact = _node.compact_refs() && !lookup.find_value();
+		try
+		{
+			send_query(node_ref, query);
+			queries.push_back(query);
+			++run.outstanding;
 		}
-		catch(const CORBA::Exception &)
+		catch(const CORBA::Exception &e)
 		{
-			_node._ct.erase(node_id);
-			trace(29) << "Broker_impl::find_nodes(): failed to find nodes at node ID " <<
-				node_id << "; erased from contact table." << endm;
+			lookup.failed(Id(query.node.id));
+			failed(Id(query.node.id), e, "find nodes");
 		}
 	}
+}
 
-	if(result->length() < replication_factor)
-		error() << "Found only " << result->length() << " nodes near ID " << target <<
-			"; Kademlia node is not properly connected to the network!" << endm;
+bool Broker_impl::poll_query (
+	Query &query )
+{
+	const node_ref_t& node_ref = _node.reference();
+	Lookup &lookup = *query.lookup;
+	Id node_id(query.node.id);
 
-	return result._retn();
+	if(query.over_udp)
+	{
+		bool ok;
+		Id id;
+		seq_compact_node_ref_t_var nodes;
+		if(!_node.udp()->poll(query.udp, ok, id, nodes))
+			return false;
+		if(ok && id == node_id)
+		{
+			_node._ct.insert(node_id, query.node.ref, true);
+			trace(29) << "Broker_impl::poll_query(): found " << nodes->length() <<
+				" nodes at node ID " << node_id << " over UDP" << endm;
+			lookup.replied(node_id, nodes.in());
+		}
+		else
+		{
+			// The node may not listen for datagrams; ask it over CORBA.
+			trace(29) << "Broker_impl::poll_query(): no reply over UDP from node ID " <<
+				node_id << "; retrying over CORBA." << endm;
+			query.compact = _node.compact_refs();
+			if(resend_query(node_ref, query))
+				return false;
+			lookup.failed(node_id);
+		}
+		return true;
+	}
+
+	if(!query.request->poll_response())
+	{
+		if(now() < query.deadline)
+			return false;
+
+		// Give up on the node, as if the call had timed out; the request is
+		// left to complete on its own.
+		trace(29) << "Broker_impl::poll_query(): no reply from node ID " << node_id <<
+			" in time." << endm;
+		lookup.failed(node_id);
+		failed(node_id, CORBA::TIMEOUT(0, CORBA::COMPLETED_MAYBE), "find nodes");
+		return true;
+	}
+
+	try
+	{
+		query.request->get_response();
+		if(CORBA::Exception *e = query.request->env()->exception())
+			e->_raise();
+
+		const seq_node_ref_t         *nodes   = 0;
+		const seq_compact_node_ref_t *compact = 0;
+		const seq_value_t            *values  = 0;
+		const CORBA::Any &result = query.request->return_value();
+		bool ok = lookup.find_value()
+			? (result >>= values) &&
+			  (*query.request->arguments()->item(2)->value() >>= nodes)
+			: query.compact ? (result >>= compact) : (result >>= nodes);
+		if(!ok)
+			throw CORBA::MARSHAL(0, CORBA::COMPLETED_YES);
+
+		_node._ct.insert(node_id, query.node.ref, true);
+		trace(29) << "Broker_impl::poll_query(): found " <<
+			(compact ? compact->length() : nodes->length()) << " nodes and " <<
+			(values ? values->length() : 0) << " values at node ID " << node_id << endm;
+		if(compact)
+			lookup.replied(node_id, *compact);
+		else
+			lookup.replied(node_id, *nodes, values);
+	}
+	catch(const CORBA::Exception &e)
+	{
+		// Nodes without compact references are asked again in full.
+		if(query.compact && dynamic_cast<const CORBA::BAD_OPERATION*>(&e))
+		{
+			trace(29) << "Broker_impl::poll_query(): node ID " << node_id <<
+				" has no compact references; retrying." << endm;
+			query.compact = false;
+			if(resend_query(node_ref, query))
+				return false;
+		}
+		lookup.failed(node_id);
+		failed(node_id, e, "find nodes");
+	}
+	return true;
+}
+
+void Broker_impl::failed (
+	const Id &node_id,
+	const CORBA::Exception &e,
+	const char *what )
+{
+	_node._metrics.contact_failed(node_id, !AdmissionControl::is_dead(e));
+
+	// A node that refused the call, e.g. because it is overloaded or full,
+	// is skipped, but kept as a contact.
+	if(!AdmissionControl::is_dead(e))
+	{
+		trace(29) << "Broker_impl: node ID " << node_id <<
+			" refused; could not " << what << " there." << endm;
+		return;
+	}
+	_node._ct.erase(node_id);
+	trace(29) << "Broker_impl: failed to " << what << " at node ID " <<
+		node_id << "; erased from contact table." << endm;
+}
+
+void Broker_impl::cache (
+	const Id &target,
+	const node_ref_t &node,
+	unsigned closer,
+	const seq_value_t &values )
+{
+	// The cache lifetime halves for every node we know of that is closer to
+	// the target, so copies far from it expire before they go stale.
+	mstime_t lifetime = closer < 32 ? mstime_t(DataTable::max_cache_lifetime) >> closer : 0;
+	if(lifetime < min_cache_lifetime)
+		return;
+
+	seq_value_t cached(values.length());
+	cached.length(values.length());
+	for(unsigned n = 0; n < values.length(); ++n)
+	{
+		cached[n].contents = values[n].contents;
+		cached[n].lifetime = static_cast<lifetime_t>(std::min<mstime_t>(values[n].lifetime, lifetime));
+	}
+
+	trace(29) << "Broker_impl::cache(): caching " << values.length() << " values for " <<
+		lifetime << " ms at node ID " << Id(node.id) << endm;
+	try
+	{
+		kademlia::id_t index;
+		memcpy(index, target, sizeof(index));
+		node.ref->cache(_node.reference(), index, cached);
+	}
+	catch(const CORBA::Exception &)
+	{
+		trace(29) << "Broker_impl::cache(): failed to cache values at node ID " <<
+			Id(node.id) << endm;
+	}
 }
@@ -4,6 +4,12 @@
 #include "kademlia.hh"
 #include "Id.hh"
 
+#include <omnithread.h>
+
+#include <list>
+#include <vector>
+
+class Lookup;
 class Node_impl;
 
 class Broker_impl :
@@ -26,11 +32,101 @@ public:
     kademlia::seq_any_t *retrieve (
         const kademlia::id_t index );
 
+    void drain (
+        CORBA::ULong budget );
+
     kademlia::seq_node_ref_t *find_nodes (
         const Id &target );
 
+    // Looks up the given targets concurrently; the nodes found are added to
+    // the contact table along the way.
+    void find_nodes_parallel (
+        const std::vector<Id> &targets );
+
+    // Has the number of hops of lookups for the target recorded, until the
+    // next call; watched_hops() returns that of the latest one, or zero.
+    // The simulator uses this to measure the path length of an operation.
+    void watch (
+        const Id &target );
+
+    unsigned watched_hops ( );
+
 private:
+	// Cached copies shorter-lived than this are not worth a call.
+	static const unsigned min_cache_lifetime = 1000;	// 1 second
+
+	// Time to wait when polling finds no replies to outstanding queries.
+	static const unsigned poll_interval = 1;	// 1 millisecond
+
+	// Time after which a query without a reply counts as failed, so that a
+	// node that never replies does not hold up its lookup.
+	static const unsigned query_timeout = 5*1000;	// 5 seconds
+
+	struct Run;
+	struct Query;
+
+	// Drives the lookups until all have finished. The lookups of all calls
+	// are driven by a single lookup thread, which sends queries as deferred
+	// requests and handles their replies as they arrive; the calling thread
+	// waits for it, but does not poll. The thread polls every outstanding
+	// request once per poll_interval rather than using
+	// ORB::get_next_response(), which would also return the replies to
+	// deferred requests sent elsewhere, like those of store().
+	//
+	// Only queries sent over UDP cost no thread while outstanding: omniORB
+	// completes each deferred CORBA request on a thread of its own, so on
+	// the CORBA path a query still ties up a thread until its reply.
+	void run (
+		const std::vector<Lookup*> &lookups );
+
+	static void *lookup_thread (
+		void *arg );
+
+	// Sends queries for the lookup while it has room for more.
+	void send_queries (
+		Run &run,
+		Lookup &lookup,
+		std::list<Query> &queries );
+
+	// Handles the reply to the query if it has arrived. Returns false if the
+	// query is still outstanding, possibly sent again.
+	bool poll_query (
+		Query &query );
+
+	static void send_query (
+		const kademlia::node_ref_t &caller,
+		Query &query );
+
+	// Sends the query again, over CORBA; returns false if that failed.
+	static bool resend_query (
+		const kademlia::node_ref_t &caller,
+		Query &query );
+
+	// Erases the node from the contact table after a call to it failed,
+	// unless the node refused the call; see AdmissionControl::is_dead().
+	void failed (
+		const Id &node_id,
+		const CORBA::Exception &e,
+		const char *what );
+
+	void cache (
+		const Id &target,
+		const kademlia::node_ref_t &node,
+		unsigned closer,
+		const kademlia::seq_value_t &values );
+
 	Node_impl &_node;
+
+	omni_mutex _watch_mutex;
+	Id         _watched;
+	unsigned   _watched_hops;
+
+	// Calls whose lookups the lookup thread has not taken yet. The thread is
+	// started on first use and never stopped.
+	static omni_mutex          _lookup_mutex;
+	static omni_condition      _lookup_submitted, _lookup_done;
+	static std::vector<Run*>   _lookup_runs;
+	static omni_thread        *_lookup_thread;
         
 }; // class Broker
 
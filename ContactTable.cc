@@ -1,88 +1,218 @@
 #include "ContactTable.hh"
 
 #include <algorithm>
+#include <cstdio>
 #include <cstring>
+#include <fstream>
 #include <map>
+#include <sstream>
 
+#include "Metrics.hh"
 #include "Node.hh"
+#include "RefCache.hh"
+#include "endpoint.hh"
 #include "logging.hh"
+#include "parallel.hh"
 
 using namespace kademlia;
 using namespace std;
 
-void *contacttable_thread(void *ct_arg)
+extern CORBA::ORB_var orb;
+
+ContactTable::Contact::Contact(const kademlia::Node_ptr node) :
+	node(kademlia::Node::_duplicate(node)),
+	first_seen(0),
+	last_seen(0),
+	rtt(0)
+{
+	// Parsed once here, so compact replies need not look at references.
+	has_endpoint = endpoint_of(node, endpoint);
+}
+
+// Folds a new round trip time measurement into a smoothed estimate.
+static void update_rtt(mstime_t &rtt, mstime_t sample)
+{
+	if(sample == 0)
+		sample = 1;
+	rtt = rtt ? (7*rtt + sample)/8 : sample;
+}
+
+// Hands stored entries over to contacts inserted since the last run.
+mstime_t ContactTable::handoff_task(void *ct_arg)
 {
-	trace(10) << "contacttable_thread(): ContactTable maintenance thread started" << endm;
-	ContactTable &ct = *reinterpret_cast<ContactTable*>(ct_arg);
-	kademlia::node_ref_t node_ref = ct._node.reference();
-	for(int pass = 0; ; ++pass)
+	ContactTable &ct = *static_cast<ContactTable*>(ct_arg);
+	std::vector< std::pair<Id, kademlia::Node_var> > joined;
 	{
-		omni_thread::self()->sleep(1);
 		omni_mutex_lock l(ct._mutex);
-		if(ct._destructing)
-		{
-			trace(10) << "contacttable_thread(): ContactTable maintenance thread exiting" << endm;
-			return 0;
-		}
-		if(pass < 10)
-			continue;
-		pass = 0;
+		joined.swap(ct._joined);
+	}
+	if(!joined.empty())
+		ct._node.handoff(joined);
+	return Scheduler::never;
+}
+
+struct SweepWork
+{
+	enum outcome_t { responded, refused, dead };
+
+	kademlia::node_ref_t            caller;
+	CORBA::ULong                    timeout;
+	std::vector<Id>                 ids;
+	std::vector<kademlia::Node_var> nodes;
+	std::vector<outcome_t>          outcomes;
+	std::vector<Id>                 replies;	// IDs the nodes responded with
+	std::vector<mstime_t>           rtts;
+};
+
+static void sweep_ping(size_t n, void *arg)
+{
+	SweepWork &work = *static_cast<SweepWork*>(arg);
+	trace(29) << "ContactTable::sweep_task(): pinging contact with id\n" <<
+		work.ids[n] << endm;
+
+	// The timeout applies to calls made by this thread only, so the shared
+	// reference is left alone.
+	omniORB::setClientThreadCallTimeout(work.timeout);
+	try
+	{
+		mstime_t start = now();
+		ustime_t precise_start = precise_now();
+		kademlia::id_t_var raw_id = work.nodes[n]->ping(work.caller);
+		metrics().pinged(precise_now() - precise_start);
+		work.replies[n]  = Id(raw_id);
+		work.rtts[n]     = now() - start;
+		work.outcomes[n] = SweepWork::responded;
+	}
+	catch(const CORBA::Exception &e)
+	{
+		// A node refusing the call is alive; try again next sweep.
+		bool dead = AdmissionControl::is_dead(e);
+		metrics().contact_failed(work.ids[n], !dead);
+		work.outcomes[n] = dead ? SweepWork::dead : SweepWork::refused;
+	}
+	omniORB::setClientThreadCallTimeout(0);
+}
 
-		// Iterate over all known contacts.
-		mstime_t t = now();
+// Pings contacts that have not been seen for a while. The contacts due are
+// copied, so that they are pinged without the lock held, and the results are
+// applied afterwards to the contacts that are still the same.
+mstime_t ContactTable::sweep_task(void *ct_arg)
+{
+	ContactTable &ct = *static_cast<ContactTable*>(ct_arg);
+	SweepWork work;
+	mstime_t t = coarse_now();
+	{
+		omni_mutex_lock l(ct._mutex);
 		for(unsigned n = 0; n < ContactTable::buckets_size; ++n)
-		{
-			ContactTable::bucket_t &bucket = ct._buckets[n];
-			ContactTable::bucket_t::iterator i, j;
-			i = j = bucket.begin();
-			while(i != bucket.end())
-			{
-				++j;
+			for(bucket_t::const_iterator i = ct._buckets[n].begin(); i != ct._buckets[n].end(); ++i)
 				if( i->second.last_seen == 0 ||
-				    i->second.last_seen + ContactTable::ping_interval <= t)
+				    i->second.last_seen + ContactTable::ping_interval <= t )
 				{
-					trace(29) << "contacttable_thread(): pinging contact with id\n" <<
-						i->first << endm;
-					try
-					{
-						kademlia::id_t_var raw_id = i->second.node->ping(node_ref);
-						Id id(raw_id);
-						if(id != i->first)
-						{
-							trace(20) << "contacttable_thread(): invalid node reference for id\n" <<
-								i->first << "\nreassigning node in contact table" << endm;
-							kademlia::Node_var node = i->second.node;
-							bucket.erase(i);
-							ct.insert_unlocked(id, node, true);
-						}
-						else
-						{
-							t = now();
-							i->second.last_seen = t;
-							if(!i->second.first_seen)
-								i->second.first_seen = t;
-						}
-					}
-					catch(const CORBA::Exception &)
-					{
-						trace(20) << "contacttable_thread(): ping failed for node with id\n" <<
-							i->first << "\nremoving node from contact table" << endm;
-						bucket.erase(i);
-					}						
+					work.ids.push_back(i->first);
+					work.nodes.push_back(i->second.node);
 				}
-				i = j;
+	}
+	if(work.ids.empty())
+		return now() + ContactTable::sweep_interval;
+
+	work.caller  = ct._node.reference();
+	work.timeout = ContactTable::ping_timeout;
+	work.outcomes.assign(work.ids.size(), SweepWork::refused);
+	work.replies.resize(work.ids.size());
+	work.rtts.assign(work.ids.size(), 0);
+	run_parallel(work.ids.size(), sweep_ping, &work, ContactTable::max_parallel_pings);
+
+	omni_mutex_lock l(ct._mutex);
+	for(size_t n = 0; n < work.ids.size(); ++n)
+	{
+		if(work.outcomes[n] == SweepWork::refused)
+			continue;
+		bucket_t &bucket = ct.get_bucket(work.ids[n]);
+		bucket_t::iterator i = bucket.find(work.ids[n]);
+		bool same = (i != bucket.end() && i->second.node.in() == work.nodes[n].in());
+		if(work.outcomes[n] == SweepWork::dead)
+		{
+			// Keep contacts that were replaced or seen meanwhile.
+			if(same && i->second.last_seen <= t)
+			{
+				trace(20) << "ContactTable::sweep_task(): ping failed for node with id\n" <<
+					work.ids[n] << "\nremoving node from contact table" << endm;
+				bucket.erase(i);
 			}
 		}
+		else
+		if(work.replies[n] != work.ids[n])
+		{
+			trace(20) << "ContactTable::sweep_task(): invalid node reference for id\n" <<
+				work.ids[n] << "\nreassigning node in contact table" << endm;
+			if(same)
+				bucket.erase(i);
+			ct.insert_unlocked(work.replies[n], work.nodes[n], true);
+		}
+		else
+		if(i != bucket.end())
+		{
+			update_rtt(i->second.rtt, work.rtts[n]);
+			mstime_t seen = coarse_now();
+			i->second.last_seen = seen;
+			if(!i->second.first_seen)
+				i->second.first_seen = seen;
+		}
 	}
-	// should never get here.
+	return now() + ContactTable::sweep_interval;
+}
+
+// Refreshes idle buckets, starting with the ones closest to us. Buckets
+// closer than our nearest neighbour are expected to be empty.
+mstime_t ContactTable::refresh_task(void *ct_arg)
+{
+	ContactTable &ct = *static_cast<ContactTable*>(ct_arg);
+	std::vector<Id> targets;
+	{
+		omni_mutex_lock l(ct._mutex);
+		mstime_t t = coarse_now();
+		unsigned first = 1;
+		while(first < ContactTable::buckets_size && ct._buckets[first].empty())
+			++first;
+		for(unsigned b = first; b < ContactTable::buckets_size &&
+			targets.size() < ContactTable::max_refreshes; ++b)
+			if(ct._last_lookup[b] + ContactTable::refresh_interval <= t)
+			{
+				ct._last_lookup[b] = t;
+				targets.push_back(ct.random_id(b));
+			}
+	}
+	if(!targets.empty())
+	{
+		trace(20) << "ContactTable::refresh_task(): refreshing " << targets.size() <<
+			" idle buckets" << endm;
+		ct._node.refresh(targets);
+	}
+	return now() + ContactTable::refresh_check_interval;
+}
+
+// Saves the contacts, so a restarted node can reuse them.
+mstime_t ContactTable::save_task(void *ct_arg)
+{
+	ContactTable &ct = *static_cast<ContactTable*>(ct_arg);
+	std::string path;
+	{
+		omni_mutex_lock l(ct._mutex);
+		path = ct._path;
+	}
+	if(!path.empty())
+		ct.save(path);
+	return now() + ContactTable::save_interval;
 }
 
 static Node_impl *const nil_node = 0;
 ContactTable::ContactTable(
     const Id  &origin ) :
     _origin(origin),
-	_node(*nil_node)
+	_node(*nil_node),
+	_maintained(false)
 {
+	std::fill(_last_lookup, _last_lookup + buckets_size, coarse_now());
 }
 
 ContactTable::ContactTable(
@@ -90,50 +220,68 @@ ContactTable::ContactTable(
 	Node_impl &node) :
     _origin(origin),
 	_node(node),
-	_destructing(false),
-	_thread(new omni_thread(contacttable_thread, this))
+	_maintained(true)
 {
-	_thread->start();
+	std::fill(_last_lookup, _last_lookup + buckets_size, coarse_now());
+	mstime_t t = now();
+	_tasks[0] = scheduler().schedule(Scheduler::never, handoff_task, this);
+	_tasks[1] = scheduler().schedule(t + sweep_interval, sweep_task, this);
+	_tasks[2] = scheduler().schedule(t + refresh_check_interval, refresh_task, this);
+	_tasks[3] = scheduler().schedule(t + save_interval, save_task, this);
 }
 
 ContactTable::~ContactTable( )
 {
-	_mutex.lock();
-	_destructing = true;
-	_mutex.unlock();
-	_thread->join(0);
+	if(!_maintained)
+		return;
+	for(unsigned n = 0; n < 4; ++n)
+		scheduler().cancel(_tasks[n]);
 }
 
 void ContactTable::insert (
     const Id&                id,
     const kademlia::Node_ptr node,
-	bool                     seen )
+	bool                     seen,
+	mstime_t                 rtt )
 {
 	const omni_mutex_lock l(_mutex);
 	trace(25) << "ContactTable::insert()"
 		<< "\n\t  Id=" << id
 		<< "\n\tSeen=" << seen << endm;
-	insert_unlocked(id, node, seen);
+	insert_unlocked(id, node, seen, rtt);
 }
 
 void ContactTable::insert_unlocked(
     const Id&                id,
     const kademlia::Node_ptr node,
-	bool                     seen )
+	bool                     seen,
+	mstime_t                 rtt )
 {
 
 	bucket_t &bucket = get_bucket(id);
 	bucket_t::iterator i = bucket.find(id);
 	if(i == bucket.end() && bucket.size() < max_bucket_size)
 	{
-		// Insert new contact, only if bucket is not yet full.
-		i = bucket.insert(make_pair(id, Contact(node))).first;
+		// Insert new contact, only if bucket is not yet full. All contacts
+		// share the process-wide reference to the node; a node that was
+		// seen just now proves its reference.
+		kademlia::Node_var shared = ref_cache().intern(id, node, seen);
+		i = bucket.insert(make_pair(id, Contact(shared))).first;
+		if(_maintained)
+		{
+			_joined.push_back(std::make_pair(id, kademlia::Node::_duplicate(shared)));
+			scheduler().wake(_tasks[0], now());
+		}
 	}
+	if(i == bucket.end())
+		return;
 
+	if(rtt)
+		update_rtt(i->second.rtt, rtt);
 	if(seen)
 	{
 		// Update time last (and maybe first) seen
-		mstime_t t = now();
+		mstime_t t = coarse_now();
 		if(!i->second.first_seen)
 			i->second.first_seen = t;
 		i->second.last_seen = t;
@@ -149,16 +297,70 @@ void ContactTable::erase(
 
 	bucket_t &bucket = get_bucket(id);
 	bucket.erase(id);
+	ref_cache().erase(id);
 }
 
 seq_node_ref_t* ContactTable::retrieve (
-    const Id& id )
+    const Id& id,
+    seq_compact_node_ref_t *endpoints )
 {
 	const omni_mutex_lock l(_mutex);
 	trace(25) << "ContactTable::retrieve()"
 		<< "\n\t  Id=" << id << endm;
 
-	typedef map<Id, std::pair<Id, Contact> > nearby_map_t;
+	std::vector<bucket_t::const_iterator> nearby;
+	nearest(id, nearby);
+
+    seq_node_ref_t_var result = new seq_node_ref_t();
+	result->length(nearby.size());
+	for(unsigned n = 0; n < result->length(); ++n)
+    {
+        memcpy(result[n].id, nearby[n]->first, sizeof(result[n].id));
+        result[n].ref = nearby[n]->second.node;
+    }
+	if(endpoints)
+	{
+		endpoints->length(0);
+		for(unsigned n = 0; n < nearby.size(); ++n)
+			if(nearby[n]->second.has_endpoint)
+			{
+				unsigned length = endpoints->length();
+				endpoints->length(length + 1);
+				memcpy((*endpoints)[length].id, nearby[n]->first, sizeof((*endpoints)[length].id));
+				(*endpoints)[length].endpoint = nearby[n]->second.endpoint;
+			}
+	}
+    return result._retn();
+}
+
+seq_compact_node_ref_t* ContactTable::retrieve_compact (
+    const Id& id )
+{
+	const omni_mutex_lock l(_mutex);
+	trace(25) << "ContactTable::retrieve_compact()"
+		<< "\n\t  Id=" << id << endm;
+
+	std::vector<bucket_t::const_iterator> nearby;
+	nearest(id, nearby);
+
+    seq_compact_node_ref_t_var result = new seq_compact_node_ref_t();
+	unsigned length = 0;
+	for(unsigned n = 0; n < nearby.size(); ++n)
+		if(nearby[n]->second.has_endpoint)
+		{
+			result->length(length + 1);
+			memcpy(result[length].id, nearby[n]->first, sizeof(result[length].id));
+			result[length].endpoint = nearby[n]->second.endpoint;
+			++length;
+		}
+    return result._retn();
+}
+
+void ContactTable::nearest (
+	const Id &id,
+	std::vector<bucket_t::const_iterator> &contacts ) const
+{
+	typedef map<Id, bucket_t::const_iterator> nearby_map_t;
 	nearby_map_t nearby_contacts;
     for(unsigned n = 0; n < buckets_size; ++n)
         for(bucket_t::const_iterator i = _buckets[n].begin(); i != _buckets[n].end(); ++i)
@@ -172,19 +374,28 @@ seq_node_ref_t* ContactTable::retrieve (
                     continue;
                 nearby_contacts.erase(last_elem);
             }
-            nearby_contacts.insert(make_pair(difference, *i));
+            nearby_contacts.insert(make_pair(difference, i));
         }
 
-    seq_node_ref_t_var result = new seq_node_ref_t();
-	result->length(nearby_contacts.size());
-    nearby_map_t::const_iterator i = nearby_contacts.begin();
-	for(unsigned n = 0; n < result->length(); ++n)
-    {
-        memcpy(result[n].id, i->second.first, sizeof(result[n].id));
-        result[n].ref = i->second.second.node;
-        ++i;
-    }
-    return result._retn();
+	contacts.clear();
+	for(nearby_map_t::const_iterator i = nearby_contacts.begin(); i != nearby_contacts.end(); ++i)
+		contacts.push_back(i->second);
+}
+
+void ContactTable::touch(const Id &target)
+{
+	const omni_mutex_lock l(_mutex);
+	_last_lookup[(target ^ _origin).bitscan()] = coarse_now();
+}
+
+Id ContactTable::random_id(unsigned bucket) const
+{
+	Id distance = Id::random();
+	for(unsigned bit = bucket; bit < Id::bits; ++bit)
+		distance.set(bit, false);
+	if(bucket > 0)
+		distance.set(bucket - 1, true);
+	return _origin ^ distance;
 }
 
 ContactTable::bucket_t &ContactTable::get_bucket(const Id &id)
@@ -192,6 +403,15 @@ ContactTable::bucket_t &ContactTable::get_bucket(const Id &id)
 	return _buckets[ (id ^ _origin).bitscan() ];
 }
 
+size_t ContactTable::size( )
+{
+    const omni_mutex_lock l(_mutex);
+    size_t size = 0;
+    for(unsigned b = 0; b < buckets_size; ++b)
+        size += _buckets[b].size();
+    return size;
+}
+
 seq_node_ref_t* ContactTable::contents( )
 {
     seq_node_ref_t_var result = new seq_node_ref_t();
@@ -209,4 +429,145 @@ seq_node_ref_t* ContactTable::contents( )
             ++n;
         }
     return result._retn();
-}
\ No newline at end of file
+}
+
+seq_node_ref_t* ContactTable::page(
+    const Id &cursor,
+    size_t max,
+    Id &next,
+    bool &more )
+{
+	const omni_mutex_lock l(_mutex);
+
+	// Find the max + 1 lowest IDs of at least cursor; the last one, if any,
+	// starts the next page.
+	typedef map<Id, bucket_t::const_iterator> lowest_map_t;
+	lowest_map_t lowest;
+	for(unsigned b = 0; b < buckets_size; ++b)
+		for(bucket_t::const_iterator i = _buckets[b].lower_bound(cursor); i != _buckets[b].end(); ++i)
+		{
+			if(lowest.size() == max + 1)
+			{
+				lowest_map_t::iterator last_elem = lowest.end();
+				--last_elem;
+				if(i->first >= last_elem->first)
+					break;	// the rest of the bucket is higher still
+				lowest.erase(last_elem);
+			}
+			lowest.insert(make_pair(i->first, i));
+		}
+
+	more = lowest.size() > max;
+	if(more)
+	{
+		lowest_map_t::iterator last_elem = lowest.end();
+		--last_elem;
+		next = last_elem->first;
+		lowest.erase(last_elem);
+	}
+
+	seq_node_ref_t_var result = new seq_node_ref_t();
+	result->length(lowest.size());
+	unsigned n = 0;
+	for(lowest_map_t::const_iterator i = lowest.begin(); i != lowest.end(); ++i, ++n)
+	{
+		memcpy(result[n].id, i->first, sizeof(result[n].id));
+		result[n].ref = i->second->second.node;
+	}
+	return result._retn();
+}
+
+void ContactTable::persist(
+	const std::string &path )
+{
+	const omni_mutex_lock l(_mutex);
+	_path = path;
+}
+
+struct SaveEntry
+{
+	Id                 id;
+	mstime_t           rtt, last_seen;
+	kademlia::Node_var node;
+};
+
+bool ContactTable::save(
+	const std::string &path )
+{
+	// Copy the contacts, so references are stringified without the lock held.
+	std::vector<SaveEntry> entries;
+	{
+		const omni_mutex_lock l(_mutex);
+		for(unsigned b = 0; b < buckets_size; ++b)
+			for(bucket_t::const_iterator i = _buckets[b].begin(); i != _buckets[b].end(); ++i)
+				if(i->second.last_seen)
+				{
+					SaveEntry entry;
+					entry.id        = i->first;
+					entry.rtt       = i->second.rtt;
+					entry.last_seen = i->second.last_seen;
+					entry.node      = i->second.node;
+					entries.push_back(entry);
+				}
+	}
+
+	const std::string temp_path = path + ".tmp";
+	std::ofstream out(temp_path.c_str());
+	out << "# Kademlia contacts: ID, round trip time (ms), last seen (ms since epoch), IOR\n";
+	mstime_t offset = wall_now() - coarse_now();
+	for(size_t n = 0; n < entries.size(); ++n)
+	{
+		try
+		{
+			CORBA::String_var ior = orb->object_to_string(entries[n].node);
+			out << entries[n].id.str() << ' ' << entries[n].rtt << ' ' <<
+				(entries[n].last_seen + offset) << ' ' << (const char*)ior << '\n';
+		}
+		catch(const CORBA::Exception &)
+		{
+		}
+	}
+	out.close();
+
+#ifdef __WIN32__
+	std::remove(path.c_str());
+#endif
+	if(!out || std::rename(temp_path.c_str(), path.c_str()) != 0)
+	{
+		error() << "ContactTable: failed to write " << path << endm;
+		std::remove(temp_path.c_str());
+		return false;
+	}
+	trace(20) << "ContactTable::save(): saved " << entries.size() << " contacts to " << path << endm;
+	return true;
+}
+
+static bool seen_later(
+	const ContactTable::SavedContact &a,
+	const ContactTable::SavedContact &b )
+{
+	return a.last_seen > b.last_seen;
+}
+
+bool ContactTable::load(
+	const std::string &path,
+	std::vector<SavedContact> &contacts )
+{
+	std::ifstream in(path.c_str());
+	if(!in)
+		return false;
+
+	std::string line;
+	while(std::getline(in, line))
+	{
+		if(line.empty() || line[0] == '#')
+			continue;
+		std::istringstream fields(line);
+		std::string id;
+		SavedContact contact;
+		if(fields >> id >> contact.rtt >> contact.last_seen >> contact.ior && contact.id.str(id))
+			contacts.push_back(contact);
+	}
+	std::stable_sort(contacts.begin(), contacts.end(), seen_later);
+	return true;
+}
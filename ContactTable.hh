@@ -4,9 +4,12 @@
 #include "kademlia.hh"
 
 #include "Id.hh"
+#include "Scheduler.hh"
 #include "time.hh"
 
 #include <map>
+#include <string>
+#include <vector>
 
 class Node_impl;
 
@@ -22,61 +25,157 @@ public:
 	
 	~ContactTable( );
 
+	// Inserts a contact. If seen is set, the contact has just responded; a
+	// non-zero rtt is the round trip time it took, in milliseconds.
 	void insert (
         const Id&                id,
         const kademlia::Node_ptr node,
-		bool                     seen = false );
+		bool                     seen = false,
+		mstime_t                 rtt  = 0 );
 
 	void erase (
 		const Id& id );
 
+	// Returns the contacts closest to the ID. If endpoints is given, it is
+	// set to those of them with a known IPv4 endpoint, as compact references.
 	kademlia::seq_node_ref_t* ContactTable::retrieve (
+		const Id& id,
+		kademlia::seq_compact_node_ref_t *endpoints = 0 );
+
+	// Like retrieve(), but returns compact references; contacts without a
+	// known IPv4 endpoint are left out.
+	kademlia::seq_compact_node_ref_t* retrieve_compact (
 		const Id& id );
 		
     kademlia::seq_node_ref_t* contents( );
 
+	// Returns the number of contacts.
+	size_t size( );
+
+	// Returns the contacts with IDs of at least cursor, in order of ID, up to
+	// max of them. If more contacts follow, more is set and next to the ID of
+	// the first one, which is the cursor of the next page.
+	kademlia::seq_node_ref_t* page(
+		const Id &cursor,
+		size_t max,
+		Id &next,
+		bool &more );
+
+	// Records that a lookup for the given target was started, which keeps
+	// the bucket it falls in from being refreshed.
+	void touch(
+		const Id &target );
+
+	// Returns a random ID that falls in the given bucket, i.e. whose distance
+	// to the origin has its most significant bit at position bucket - 1.
+	Id random_id(
+		unsigned bucket ) const;
+
+    static const unsigned buckets_size = Id::bits+1;
+
+	// A contact as stored in a contacts file.
+	struct SavedContact
+	{
+		Id          id;
+		mstime_t    rtt,
+		            last_seen;	// wall clock time
+		std::string ior;
+	};
+
+	// Writes all contacts to a text file, one per line, and keeps doing so
+	// periodically if persist() has been called.
+	bool save(
+		const std::string &path );
+
+	void persist(
+		const std::string &path );
+
+	// Reads contacts from a file written by save(), most recently seen first.
+	static bool load(
+		const std::string &path,
+		std::vector<SavedContact> &contacts );
+
 private:
     struct Contact
     {
-		Contact(const kademlia::Node_ptr node) :
-			node(kademlia::Node::_duplicate(node))
-		{
-		}
-
-        kademlia::Node_var node;
-        mstime_t           first_seen,
-                           last_seen;
+		Contact(const kademlia::Node_ptr node);
+
+        kademlia::Node_var   node;
+        mstime_t             first_seen,
+                             last_seen,
+                             rtt;         // smoothed round trip time
+        kademlia::endpoint_t endpoint;
+        bool                 has_endpoint;
     };
     
     typedef std::map<Id, Contact> bucket_t;
 
+	// Returns the contacts closest to the given ID, closest first; at most
+	// replication_factor of them. The mutex must be held.
+	void nearest(
+		const Id &id,
+		std::vector<bucket_t::const_iterator> &contacts ) const;
+
 	static const unsigned ping_interval = 600*1000;	// 10 minutes
 
+	// Contacts are pinged in parallel, by at most max_parallel_pings threads,
+	// and a ping that takes longer than ping_timeout fails.
+	static const unsigned ping_timeout       = 5*1000;	// 5 seconds
+	static const unsigned max_parallel_pings = 16;
+
+	static const unsigned sweep_interval = 10*1000;	// 10 seconds
+
+	static const unsigned save_interval = 300*1000;	// 5 minutes
+
+	// Buckets without lookups for refresh_interval are refreshed by looking
+	// up a random ID in them; every refresh_check_interval, at most
+	// max_refreshes buckets are refreshed, in parallel.
+	static const unsigned refresh_interval       = 3600*1000;	// 1 hour
+	static const unsigned refresh_check_interval = 60*1000;		// 1 minute
+	static const unsigned max_refreshes          = 8;
+
 	static const unsigned max_bucket_size =
 		kademlia::replication_factor + 2;
 
-    static const unsigned buckets_size = Id::bits+1;
-
 	bucket_t &get_bucket(
 		const Id &id );
     
     void insert_unlocked (
         const Id&                id,
         const kademlia::Node_ptr node,
-		bool                     seen = false);
+		bool                     seen = false,
+		mstime_t                 rtt  = 0 );
+
+	// Maintenance tasks; see Scheduler.
+	static mstime_t handoff_task(
+		void *ct );
+
+	static mstime_t sweep_task(
+		void *ct );
+
+	static mstime_t refresh_task(
+		void *ct );
+
+	static mstime_t save_task(
+		void *ct );
 
 private:
-	omni_mutex _mutex;
+	omni_mutex     _mutex;
 	
 	const Id  _origin;
 	Node_impl &_node;    
 	
     bucket_t _buckets[buckets_size];
-	
-	bool _destructing;
+    mstime_t _last_lookup[buckets_size];
+
+	// Contacts inserted since entries were last handed over.
+	std::vector< std::pair<Id, kademlia::Node_var> > _joined;
+
+	std::string _path;
 
-	omni_thread *_thread;
-	friend void *contacttable_thread(void *dt);	
+	// Whether maintenance tasks are scheduled (i.e. the table has a node).
+	bool              _maintained;
+	Scheduler::task_t _tasks[4];
     
 }; // class ContactTable
 
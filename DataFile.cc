@@ -0,0 +1,391 @@
+#include "DataFile.hh"
+
+#include <cstring>
+
+#include "logging.hh"
+
+#ifdef __WIN32__
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Records are padded to a multiple of 8 bytes, so headers stay aligned.
+static size_t padded(size_t size)
+{
+	return (size + 7) & ~size_t(7);
+}
+
+static bool file_exists(const std::string &path)
+{
+	std::FILE *file = std::fopen(path.c_str(), "rb");
+	if(file)
+		std::fclose(file);
+	return file != 0;
+}
+
+// Passes buffered data to the operating system and, if durable is set,
+// waits until it has been written to stable storage.
+static bool flush_file(std::FILE *file, bool durable)
+{
+	return durable ? DataFile::sync_file(file) : std::fflush(file) == 0;
+}
+
+bool DataFile::sync_file(
+	std::FILE *file )
+{
+	if(std::fflush(file) != 0)
+		return false;
+#ifdef __WIN32__
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+void DataFile::sync_directory(
+	const std::string &path )
+{
+#ifndef __WIN32__
+	std::string::size_type slash = path.rfind('/');
+	std::string dir = (slash == std::string::npos) ? std::string(".") : path.substr(0, slash + 1);
+	int fd = ::open(dir.c_str(), O_RDONLY);
+	if(fd >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+#endif
+}
+
+// Appends the contents of one file to another and syncs the result.
+static bool append_file(const std::string &src_path, const std::string &dst_path)
+{
+	std::FILE *src = std::fopen(src_path.c_str(), "rb");
+	std::FILE *dst = std::fopen(dst_path.c_str(), "ab");
+	bool ok = src && dst;
+	char buffer[65536];
+	size_t read;
+	while(ok && (read = std::fread(buffer, 1, sizeof(buffer), src)) > 0)
+		ok = std::fwrite(buffer, 1, read, dst) == read;
+	if(dst)
+	{
+		ok = flush_file(dst, true) && ok;
+		std::fclose(dst);
+	}
+	if(src)
+		std::fclose(src);
+	return ok;
+}
+
+DataFile::DataFile(
+	const std::string &path ) :
+	_cond(&_mutex),
+	_path(path),
+	_log_path(path + ".log"),
+	_old_log_path(path + ".log.old"),
+	_log(0),
+	_log_records(0),
+	_needs_snapshot(false),
+	_appended(0),
+	_flushed(0),
+	_synced(0),
+	_committing(false)
+{
+}
+
+DataFile::~DataFile( )
+{
+	if(_log)
+	{
+		flush_file(_log, true);
+		std::fclose(_log);
+	}
+}
+
+const std::string &DataFile::path( ) const
+{
+	return _path;
+}
+
+unsigned long DataFile::log_records( )
+{
+	omni_mutex_lock l(_mutex);
+	return _log_records;
+}
+
+bool DataFile::needs_snapshot( )
+{
+	omni_mutex_lock l(_mutex);
+	return _needs_snapshot;
+}
+
+CORBA::ULong DataFile::checksum(
+	const RecordHeader &header,
+	const unsigned char *data )
+{
+	RecordHeader h = header;
+	h.checksum = 0;
+	const unsigned char *bytes = reinterpret_cast<const unsigned char*>(&h);
+	CORBA::ULong sum = 2166136261UL;
+	for(size_t n = 0; n < sizeof(h); ++n)
+		sum = (sum ^ bytes[n]) * 16777619UL;
+	for(size_t n = 0; n < header.size; ++n)
+		sum = (sum ^ data[n]) * 16777619UL;
+	return sum;
+}
+
+bool DataFile::write_record(
+	std::FILE *file,
+	const Record &record )
+{
+	static const char padding[8] = { 0 };
+
+	RecordHeader header;
+	std::memset(&header, 0, sizeof(header));
+	header.magic      = record_magic;
+	header.type       = record.type;
+	header.size       = record.value.size();
+	header.expiration = record.expiration;
+	std::memcpy(header.index, static_cast<const kademlia::id_t&>(record.index), sizeof(header.index));
+	header.checksum   = checksum(header, record.value.data());
+
+	size_t pad = padded(header.size) - header.size;
+	return std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+	       std::fwrite(record.value.data(), 1, header.size, file) == header.size &&
+	       std::fwrite(padding, 1, pad, file) == pad;
+}
+
+// Appends the valid records in the given file to the vector. Returns false if
+// the file ends with damaged or incomplete records.
+bool DataFile::read_file(
+	const std::string &path,
+	std::vector<Record> &records )
+{
+	const unsigned char *begin = 0;
+	size_t size = 0;
+
+#ifdef __WIN32__
+	std::vector<unsigned char> buffer;
+	if(std::FILE *in = std::fopen(path.c_str(), "rb"))
+	{
+		unsigned char chunk[65536];
+		size_t read;
+		while((read = std::fread(chunk, 1, sizeof(chunk), in)) > 0)
+			buffer.insert(buffer.end(), chunk, chunk + read);
+		std::fclose(in);
+	}
+	if(buffer.empty())
+		return true;
+	begin = &buffer[0];
+	size  = buffer.size();
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0)
+		return true;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return true;
+	}
+	void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		error() << "DataFile: could not map " << path << " into memory" << endm;
+		return false;
+	}
+	begin = static_cast<const unsigned char*>(map);
+	size  = st.st_size;
+#endif
+
+	size_t offset = 0;
+	while(offset + sizeof(RecordHeader) <= size)
+	{
+		RecordHeader header;
+		std::memcpy(&header, begin + offset, sizeof(header));
+		const unsigned char *data = begin + offset + sizeof(header);
+		if( header.magic != record_magic ||
+		    offset + sizeof(header) + header.size > size ||
+		    header.checksum != checksum(header, data) )
+			break;
+
+		Record record;
+		record.type       = header.type;
+		record.index      = header.index;
+		record.value      = Blob(data, header.size);
+		record.expiration = header.expiration;
+		records.push_back(record);
+		offset += sizeof(header) + padded(header.size);
+	}
+
+#ifndef __WIN32__
+	munmap(map, st.st_size);
+#endif
+
+	if(offset < size)
+	{
+		error() << "DataFile: ignoring " << (size - offset) << " bytes of damaged or "
+			"incomplete records at the end of " << path << endm;
+		return false;
+	}
+	return true;
+}
+
+bool DataFile::open(
+	std::vector<Record> &records )
+{
+	omni_mutex_lock l(_mutex);
+
+	if(!read_file(_path, records))
+		_needs_snapshot = true;
+	size_t snapshot_records = records.size();
+
+	// A rotated log only remains if writing a snapshot was interrupted.
+	if(file_exists(_old_log_path))
+	{
+		_needs_snapshot = true;
+		read_file(_old_log_path, records);
+	}
+
+	// New records must not be appended after a damaged tail; the snapshot
+	// written on behalf of needs_snapshot() rotates the damaged log away.
+	if(!read_file(_log_path, records))
+		_needs_snapshot = true;
+	_log_records = records.size() - snapshot_records;
+
+	_log = std::fopen(_log_path.c_str(), "ab");
+	if(!_log)
+	{
+		error() << "DataFile: could not open " << _log_path << " for writing" << endm;
+		return false;
+	}
+	return true;
+}
+
+unsigned long DataFile::append(
+	const Record &record )
+{
+	omni_mutex_lock l(_mutex);
+	if(!_log || !write_record(_log, record))
+	{
+		error() << "DataFile: failed to write to " << _log_path << endm;
+		return 0;
+	}
+	++_log_records;
+	return ++_appended;
+}
+
+bool DataFile::sync(
+	unsigned long seq,
+	bool durable )
+{
+	omni_mutex_lock l(_mutex);
+	while((durable ? _synced : _flushed) < seq)
+	{
+		if(_committing)
+		{
+			// Another thread is flushing, possibly including our record.
+			_cond.wait();
+			continue;
+		}
+
+		// Flush all records appended so far, on behalf of every waiting thread.
+		_committing = true;
+		unsigned long target = _appended;
+		std::FILE *log = _log;
+		_mutex.unlock();
+		bool ok = flush_file(log, durable);
+		_mutex.lock();
+		_committing = false;
+		_cond.broadcast();
+
+		if(!ok)
+		{
+			error() << "DataFile: failed to flush " << _log_path << endm;
+			return false;
+		}
+		if(_flushed < target)
+			_flushed = target;
+		if(durable && _synced < target)
+			_synced = target;
+	}
+	return true;
+}
+
+bool DataFile::rotate( )
+{
+	omni_mutex_lock l(_mutex);
+	while(_committing)
+		_cond.wait();
+	if(!_log)
+		return false;
+
+	bool ok = flush_file(_log, true);
+	std::fclose(_log);
+
+	if(file_exists(_old_log_path))
+	{
+		// The previous snapshot was not completed, so the rotated log is still
+		// needed; add the current log to it.
+		ok = append_file(_log_path, _old_log_path) && ok;
+		_log = std::fopen(_log_path.c_str(), ok ? "wb" : "ab");
+	}
+	else
+	{
+		ok = (std::rename(_log_path.c_str(), _old_log_path.c_str()) == 0) && ok;
+		sync_directory(_log_path);
+		_log = std::fopen(_log_path.c_str(), "ab");
+	}
+
+	if(ok)
+		_log_records = 0;
+	_flushed = _synced = _appended;
+	if(!_log)
+	{
+		error() << "DataFile: could not reopen " << _log_path << endm;
+		return false;
+	}
+	return ok;
+}
+
+bool DataFile::write_snapshot(
+	const std::vector<Record> &records )
+{
+	const std::string temp_path = _path + ".tmp";
+	std::FILE *out = std::fopen(temp_path.c_str(), "wb");
+	bool ok = (out != 0);
+	for(size_t n = 0; ok && n < records.size(); ++n)
+		ok = write_record(out, records[n]);
+	if(out)
+	{
+		ok = flush_file(out, true) && ok;
+		ok = (std::fclose(out) == 0) && ok;
+	}
+
+	if(ok)
+	{
+#ifdef __WIN32__
+		std::remove(_path.c_str());
+#endif
+		ok = (std::rename(temp_path.c_str(), _path.c_str()) == 0);
+		sync_directory(_path);
+	}
+	if(!ok)
+	{
+		error() << "DataFile: failed to write snapshot " << _path << endm;
+		std::remove(temp_path.c_str());
+		return false;
+	}
+
+	// The rotated log is now covered by the snapshot.
+	std::remove(_old_log_path.c_str());
+
+	omni_mutex_lock l(_mutex);
+	_needs_snapshot = false;
+	return true;
+}
@@ -0,0 +1,137 @@
+#ifndef DATAFILE_HH_INCLUDED
+#define DATAFILE_HH_INCLUDED
+
+#include "Blob.hh"
+#include "Id.hh"
+#include "time.hh"
+
+#include <omnithread.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/*
+	Durable storage for data table entries, consisting of a snapshot file and
+	a write-ahead log. Changes are appended to the log as self-contained,
+	checksummed records holding the entry's index, its marshalled value and
+	its absolute expiration time (wall clock milliseconds since the epoch).
+	Every record fully describes the new state of one (index, value) pair, so
+	replaying a record more than once is harmless. Snapshots keep erased
+	entries that still hide copies on disk as tombstone records, which hold
+	the fingerprint of the value (see Blob::fingerprint()) instead of it.
+
+	Appended records are flushed and, if requested, synced to stable storage
+	in groups: all threads waiting in sync() share a single flush or fsync.
+
+	Periodically, the log is rotated and a snapshot of the live entries is
+	written; the rotated log is deleted once the snapshot is complete.
+	Recovery maps the snapshot and logs into memory and replays them in
+	order: the snapshot (<path>), the rotated log (<path>.log.old) if a
+	snapshot was interrupted, and the current log (<path>.log).
+
+	Records are stored in the host's byte order; data files are not meant to
+	be moved between machines of different architecture.
+*/
+class DataFile
+{
+public:
+
+	enum record_type { store_record = 1, erase_record = 2, tombstone_record = 3 };
+
+	struct Record
+	{
+		CORBA::ULong type;
+		Id           index;
+		Blob         value;
+		mstime_t     expiration;
+	};
+
+	DataFile(
+		const std::string &path );
+
+	~DataFile( );
+
+	// Reads all valid records from the snapshot and logs, in order, and opens
+	// the log for appending. Returns false if the files could not be opened.
+	bool open(
+		std::vector<Record> &records );
+
+	// Appends a record to the log and returns its sequence number (or 0 on
+	// failure). The record may be buffered until sync() is called.
+	unsigned long append(
+		const Record &record );
+
+	// Waits until all records up to the given sequence number have been
+	// written to the operating system or, if durable is set, to stable
+	// storage. Returns false if writing failed.
+	bool sync(
+		unsigned long seq,
+		bool durable );
+
+	// Starts a new log. The snapshot written next must contain the state
+	// resulting from all records appended before this call.
+	bool rotate( );
+
+	// Replaces the snapshot with the given records and deletes the rotated log.
+	bool write_snapshot(
+		const std::vector<Record> &records );
+
+	// Returns the number of records in the logs.
+	unsigned long log_records( );
+
+	// Returns whether the files need a new snapshot (i.e. a rotated log or
+	// damaged records were found by open()).
+	bool needs_snapshot( );
+
+	const std::string &path( ) const;
+
+	// Writes a file's buffered data to stable storage.
+	static bool sync_file(
+		std::FILE *file );
+
+	// Makes renames within the directory containing the given file durable.
+	static void sync_directory(
+		const std::string &path );
+
+private:
+
+	struct RecordHeader
+	{
+		CORBA::ULong   magic;
+		CORBA::ULong   type;
+		CORBA::ULong   size;
+		CORBA::ULong   checksum;
+		mstime_t       expiration;
+		kademlia::id_t index;
+	};
+
+	static const CORBA::ULong record_magic = 0x4B445232;	// "KDR2"
+
+	static bool write_record(
+		std::FILE *file,
+		const Record &record );
+
+	static CORBA::ULong checksum(
+		const RecordHeader &header,
+		const unsigned char *data );
+
+	bool read_file(
+		const std::string &path,
+		std::vector<Record> &records );
+
+	omni_mutex        _mutex;
+	omni_condition    _cond;
+
+	const std::string _path, _log_path, _old_log_path;
+	std::FILE        *_log;
+	unsigned long     _log_records;
+	bool              _needs_snapshot;
+
+	// Group commit state: sequence numbers of the last appended, flushed and
+	// synced records, and whether a thread is currently flushing the log.
+	unsigned long     _appended, _flushed, _synced;
+	bool              _committing;
+
+}; // class DataFile
+
+#endif //ndef DATAFILE_HH_INCLUDED
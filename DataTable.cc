@@ -1,111 +1,731 @@
 #include "DataTable.hh"
+#include "DataFile.hh"
+#include "Metrics.hh"
+#include "Scheduler.hh"
+#include "Segment.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
 #include "random.hh"
 #include "logging.hh"
-#include "compare_any.hh"
 using namespace kademlia;
 
-void *datatable_thread(void *dt_arg)
+// Runs all maintenance work in order, so that snapshots, spills and merges
+// never overlap.
+mstime_t DataTable::maintenance_task(void *dt_arg)
 {
-	trace(10) << "datatable_thread(): DataTable maintenance thread started" << endm;
-	DataTable *dt = reinterpret_cast<DataTable*>(dt_arg);
-	for(int pass = 0; ; ++pass)
+	DataTable *dt = static_cast<DataTable*>(dt_arg);
+	omni_mutex_lock l(dt->_mutex);
+
+	// Purge old data entries.
+	unsigned count = dt->purge_unlocked();
+	if(count)
+		trace(29) << "DataTable::maintenance_task(): " << count << " data entries purged" << endm;
+
+	// Write a snapshot when the log has outgrown the table, or periodically
+	// to bound recovery time.
+	if(dt->_file)
 	{
-		omni_thread::self()->sleep(1);
-		omni_mutex_lock l(dt->_mutex);
-		if(dt->_destructing)
+		unsigned long records = dt->_file->log_records();
+		if( records >= DataTable::min_snapshot_records &&
+		    (records > dt->_contents.size() || now() >= dt->_next_snapshot) )
 		{
-			trace(10) << "datatable_thread(): DataTable maintenance thread exiting" << endm;
-			return 0;
+			dt->snapshot();
+			dt->_next_snapshot = now() + DataTable::snapshot_interval;
 		}
-		if(pass < 10)
-			continue;
-		pass =0;
-
-		// Purge old data entries.
-		unsigned count = dt->purge_unlocked();
-		if(count)
-			trace(29) << "datatable_thread(): " << count << " data entries purged" << endm;
+	}
 
-		// TODO: Republish entries that are due for republishing.
+	// Move cold entries to disk, and merge segments when there are many.
+	if(dt->_file && now() >= dt->_next_spill)
+	{
+		dt->spill();
+		if(dt->_segments.size() > DataTable::max_segments)
+			dt->merge_segments();
+		dt->_next_spill = now() + DataTable::spill_interval;
 	}
-	// should never get here.
+
+	// TODO: Republish entries that are due for republishing.
+	return now() + DataTable::purge_interval;
 }
 
-DataTable::DataTable() :
-	_destructing(false),
-	_thread(new omni_thread(datatable_thread, this))
+DataTable::DataTable(
+	const Id &origin ) :
+	_origin(origin),
+	_capacity(0),
+	_bytes(0),
+	_policy(evict_nearest_expiration),
+	_evicted(0),
+	_hot(hot_key_counters),
+	_file(0),
+	_next_segment(1),
+	_segments_version(0),
+	_next_snapshot(now() + snapshot_interval),
+	_next_spill(now() + spill_interval)
 {
-	_thread->start();
+	_task = scheduler().schedule(now() + purge_interval, maintenance_task, this);
 }
 
 DataTable::~DataTable()
 {
-	_mutex.lock();
-	_destructing = true;
+	scheduler().cancel(_task);
+	for(size_t n = 0; n < _segments.size(); ++n)
+		delete _segments[n];
+	for(size_t n = 0; n < _retired.size(); ++n)
+		close_segment(_retired[n]);
+	delete _file;
+}
+
+void DataTable::limit(
+	size_t capacity,
+	eviction_policy policy )
+{
+	omni_mutex_lock l(_mutex);
+	_capacity = capacity;
+	_policy   = policy;
+	_expiry.clear();
+	if(_capacity && _policy == evict_nearest_expiration)
+		for(contents_t::const_iterator i = _contents.begin(); i != _contents.end(); ++i)
+			if(!i->second.erased)
+				_expiry.insert(std::make_pair(i->second.expiration_time, i->first));
+}
+
+size_t DataTable::bytes( )
+{
+	omni_mutex_lock l(_mutex);
+	return _bytes;
+}
+
+unsigned long DataTable::evicted( )
+{
+	omni_mutex_lock l(_mutex);
+	return _evicted;
+}
+
+size_t DataTable::size( )
+{
+	omni_mutex_lock l(_mutex);
+	return _contents.size();
+}
+
+// Returns the offset between wall clock time and now().
+static mstime_t wall_offset()
+{
+	return wall_now() - now();
+}
+
+bool DataTable::open(
+	const std::string &path )
+{
+	DataFile *file = new DataFile(path);
+	std::vector<DataFile::Record> records;
+	if(!file->open(records))
+	{
+		delete file;
+		return false;
+	}
+
+	// Replay all records in order; stores whose lifetime has passed still
+	// replace earlier versions of the entry, and are purged afterwards.
+	// Segments are loaded first, so erased entries can be hidden.
+	omni_mutex_lock l(_mutex);
+	delete _file;
+	_file = file;
+	load_segments_unlocked();
+	mstime_t offset = wall_offset();
+	for(size_t n = 0; n < records.size(); ++n)
+	{
+		const DataFile::Record &record = records[n];
+		if(record.type == DataFile::erase_record)
+			erase_unlocked(record.index, record.value);
+		else if(record.type == DataFile::tombstone_record)
+		{
+			if(record.expiration > offset)
+				bury_unlocked(record.index, record.value, record.expiration - offset);
+		}
+		else if(record.expiration > offset)
+			insert_unlocked(record.index, record.value, record.expiration - offset, true);
+		else
+			erase_unlocked(record.index, record.value);
+	}
+	purge_unlocked();
+	info() << "Loaded " << _contents.size() << " data entries from " << path <<
+		" (" << records.size() << " records replayed, " << _segments.size() <<
+		" segments)" << endm;
+
+	if(_file->needs_snapshot())
+		snapshot();
+	return true;
+}
+
+// Starts a new log and writes the live entries to a snapshot. Must be called
+// with the lock held; the lock is released while the snapshot is written.
+void DataTable::snapshot( )
+{
+	if(!_file->rotate())
+		return;
+
+	std::vector<DataFile::Record> records;
+	records.reserve(_contents.size());
+	mstime_t offset = wall_offset();
+	for(contents_t::const_iterator i = _contents.begin(); i != _contents.end(); ++i)
+	{
+		DataFile::Record record;
+		record.type       = i->second.erased ? DataFile::tombstone_record : DataFile::store_record;
+		record.index      = i->first;
+		record.value      = i->second.value;
+		record.expiration = i->second.expiration_time + offset;
+		records.push_back(record);
+	}
+
 	_mutex.unlock();
-	_thread->join(0);
+	trace(20) << "DataTable::snapshot(): writing " << records.size() <<
+		" records to " << _file->path() << endm;
+	_file->write_snapshot(records);
+	_mutex.lock();
+}
+
+// Appends a record to the data file, if any; returns its sequence number.
+unsigned long DataTable::log_unlocked(
+	CORBA::ULong type,
+	const Id &index,
+	const Blob &value,
+	mstime_t expiration_time )
+{
+	if(!_file)
+		return 0;
+	DataFile::Record record;
+	record.type       = type;
+	record.index      = index;
+	record.value      = value;
+	record.expiration = expiration_time + wall_offset();
+	return _file->append(record);
 }
 
-void DataTable::store(
+bool DataTable::store(
     const Id &index,
     const CORBA::Any &value,
-    mstime_t lifetime )
+    mstime_t lifetime,
+    bool durable )
 {
-	omni_mutex_lock l(_mutex);
-	std::ostream &log = trace(25);
-	log << "DataTable::store(): storing value at index:\n" << index;
+	// Marshal the value before acquiring the lock.
+	const Blob blob(value);
+
+	unsigned long seq;
+	{
+		omni_mutex_lock l(_mutex);
+		trace(25) << "DataTable::store(): storing value at index:\n" << index << endm;
+
+		mstime_t expiration_time = coarse_now() + lifetime;
+		if(lifetime == 0)
+		{
+			if(erase_unlocked(index, blob))
+				durable = true;
+			seq = log_unlocked(DataFile::erase_record, index, blob, expiration_time);
+		}
+		else
+		{
+			if(!make_room_unlocked(index, blob, expiration_time))
+			{
+				trace(20) << "DataTable::store(): no room for value at index:\n" << index << endm;
+				return false;
+			}
+			insert_unlocked(index, blob, expiration_time, durable);
+			seq = log_unlocked(DataFile::store_record, index, blob, expiration_time);
+		}
+	}
+
+	// Wait for the record to be written outside the lock, so concurrent
+	// stores can share a single flush.
+	if(seq)
+		_file->sync(seq, durable);
+	return true;
+}
 
+void DataTable::insert_unlocked(
+    const Id &index,
+    const Blob &value,
+    mstime_t expiration_time,
+    bool durable )
+{
 	// Create a new storage entry
     DataEntry entry;
-	mstime_t t = now();
     entry.value           = value;
-    entry.expiration_time = t + lifetime;
-    entry.republish_time  = t + kademlia::republish_interval + randInt(kademlia::republish_interval / 10); 
+    entry.expiration_time = expiration_time;
+    entry.republish_time  = coarse_now() + kademlia::republish_interval + randInt(kademlia::republish_interval / 10); 
+    entry.access_time     = coarse_now();
+    entry.erased          = false;
+    entry.durable         = durable;
 	
 	// See if an existing entry is available
-	for(contents_t::iterator i = _contents.find(index);
-		i != _contents.end() && i->first == index; ++i)
+	contents_t::iterator i = find_unlocked(index, value);
+	if(i != _contents.end())
 	{
-		if(i->second.value == value)
+		// Update existing entry. A value stored durably stays durable, so
+		// that its erase is synced too.
+		entry.durable = durable || i->second.durable;
+		if(i->second.erased)
 		{
-			// Update existing entry.
-			i->second = entry;
+			// A tombstone holds no value and is not accounted for.
+			remove_unlocked(i);
+			add_unlocked(index, entry);
 			return;
 		}
+		i->second = entry;
+		if(_capacity && _policy == evict_nearest_expiration)
+			_expiry.insert(std::make_pair(expiration_time, index));
+		return;
 	}
     
 	// Add new entry
+	add_unlocked(index, entry);
+}
+
+// Returns the number of bytes accounted for an entry holding the given value:
+// the memory allocated for the value plus that of a tree node.
+static size_t footprint(const Blob &value)
+{
+	return value.footprint() + sizeof(std::pair<Id, Blob>) + sizeof(mstime_t)*3 + sizeof(void*)*4;
+}
+
+bool DataTable::erase_unlocked(
+    const Id &index,
+    const Blob &value )
+{
+	// Look for copies on disk first, as that releases the lock.
+	mstime_t expiration_time = segment_expiration_unlocked(index, value);
+
+	bool durable = false;
+	contents_t::iterator i = find_unlocked(index, value);
+	if(i != _contents.end())
+	{
+		durable = i->second.durable && !i->second.erased;
+		remove_unlocked(i);
+	}
+
+	// Don't let retrieve() fall back to a cached copy of the erased value.
+	for(cache_t::iterator c = _cache.lower_bound(index), next = c;
+		c != _cache.end() && c->first == index; c = next)
+	{
+		++next;
+		if(c->second.value == value)
+		{
+			_bytes -= footprint(c->second.value);
+			_cache.erase(c);
+		}
+	}
+
+	// Hide copies of the entry that were moved to disk earlier.
+	if(expiration_time > coarse_now())
+	{
+		bury_unlocked(index, value.fingerprint(), expiration_time);
+		durable = true;
+	}
+	return durable;
+}
+
+// Removes an entry from memory to make room for another. Reading segments
+// would release the lock in the middle of a store, so a copy that may have
+// been moved to disk is hidden for as long as the evicted entry would have
+// lived; the tombstone takes no room.
+void DataTable::evict_unlocked(
+    contents_t::iterator victim )
+{
+	const Id index = victim->first;
+	const Blob fingerprint = victim->second.value.fingerprint();
+	const mstime_t expiration_time = victim->second.expiration_time;
+	remove_unlocked(victim);
+
+	std::vector<Segment*> segments;
+	candidate_segments_unlocked(index, segments);
+	if(!segments.empty())
+		bury_unlocked(index, fingerprint, expiration_time);
+}
+
+DataTable::contents_t::iterator DataTable::find_unlocked(
+    const Id &index,
+    const Blob &value )
+{
+	for(contents_t::iterator i = _contents.lower_bound(index);
+		i != _contents.end() && i->first == index; ++i)
+		if(i->second.erased ? value.has_fingerprint(i->second.value) : i->second.value == value)
+			return i;
+	return _contents.end();
+}
+
+void DataTable::add_unlocked(
+    const Id &index,
+    const DataEntry &entry )
+{
 	_contents.insert( std::pair<const Id, DataEntry>(index, entry) );
+	if(entry.erased)
+		return;
+	_bytes += footprint(entry.value);
+	if(_capacity && _policy == evict_nearest_expiration)
+		_expiry.insert(std::make_pair(entry.expiration_time, index));
+}
+
+void DataTable::remove_unlocked(
+    contents_t::iterator i )
+{
+	if(!i->second.erased)
+		_bytes -= footprint(i->second.value);
+	_contents.erase(i);
+}
+
+void DataTable::bury_unlocked(
+    const Id &index,
+    const Blob &fingerprint,
+    mstime_t expiration_time )
+{
+	DataEntry entry;
+	entry.value           = fingerprint;
+	entry.expiration_time = expiration_time;
+	entry.republish_time  = expiration_time;
+	entry.access_time     = coarse_now();
+	entry.erased          = true;
+	entry.durable         = true;
+	add_unlocked(index, entry);
+}
+
+// Returns the entry to evict first according to the eviction policy, or the
+// end of the table if there is none. Erased entries are never evicted, since
+// they hide older copies on disk.
+DataTable::contents_t::iterator DataTable::victim_unlocked( )
+{
+	if(_policy == evict_nearest_expiration)
+	{
+		// The queue may hold outdated items for entries that have since been
+		// updated or removed; these are discarded here.
+		while(!_expiry.empty())
+		{
+			expiry_t::iterator e = _expiry.begin();
+			for(contents_t::iterator i = _contents.lower_bound(e->second);
+				i != _contents.end() && i->first == e->second; ++i)
+				if(!i->second.erased && i->second.expiration_time == e->first)
+					return i;
+			_expiry.erase(e);
+		}
+		return _contents.end();
+	}
+
+	// Descend bit by bit from the most significant one, preferring indices
+	// that differ from ours, to find the index farthest from our own.
+	if(_contents.empty())
+		return _contents.end();
+	Id prefix = _origin ^ _origin;
+	for(unsigned bit = Id::bits; bit-- > 0; )
+	{
+		prefix.set(bit, !_origin[bit]);
+		contents_t::iterator i = _contents.lower_bound(prefix);
+		if(i == _contents.end() || (i->first ^ prefix).bitscan() > bit)
+			prefix.set(bit, _origin[bit]);
+	}
+	for(contents_t::iterator i = _contents.lower_bound(prefix); i != _contents.end(); ++i)
+		if(!i->second.erased)
+			return i;
+	for(contents_t::iterator i = _contents.begin(); i != _contents.end(); ++i)
+		if(!i->second.erased)
+			return i;
+	return _contents.end();
+}
+
+// Evicts entries until a new entry with the given properties fits in the
+// table. Returns false if it does not fit, or if the new entry would be
+// evicted before any of the existing ones.
+bool DataTable::make_room_unlocked(
+    const Id &index,
+    const Blob &value,
+    mstime_t expiration_time )
+{
+	if(!_capacity)
+		return true;
+
+	size_t needed = footprint(value);
+	if(needed > _capacity)
+		return false;
+	contents_t::iterator existing = find_unlocked(index, value);
+	size_t reused = existing != _contents.end() && !existing->second.erased
+		? footprint(existing->second.value) : 0;
+
+	while(_bytes - reused + needed > _capacity)
+	{
+		// Cached values are dropped before any stored value is evicted.
+		if(!_cache.empty())
+		{
+			_bytes -= footprint(_cache.begin()->second.value);
+			_cache.erase(_cache.begin());
+			continue;
+		}
+
+		contents_t::iterator victim = victim_unlocked();
+		if(victim == _contents.end() || victim == existing)
+			return false;
+		if(_policy == evict_nearest_expiration
+		    ? expiration_time <= victim->second.expiration_time
+		    : (victim->first ^ _origin) <= (index ^ _origin))
+			return false;
+
+		trace(25) << "DataTable::make_room_unlocked(): evicting value at index:\n" <<
+			victim->first << endm;
+		const Id victim_index = victim->first;
+		const Blob victim_value = victim->second.value;
+		log_unlocked(DataFile::erase_record, victim_index, victim_value, coarse_now());
+		evict_unlocked(victim);
+		++_evicted;
+	}
+	return true;
+}
+
+mstime_t DataTable::segment_expiration_unlocked(
+    const Id &index,
+    const Blob &value )
+{
+	std::vector< std::pair<Id, Blob> > entries(1, std::make_pair(index, value));
+	std::vector<mstime_t> expirations;
+	segment_expirations_unlocked(entries, expirations);
+	return expirations[0];
+}
+
+void DataTable::segment_expirations_unlocked(
+    const std::vector< std::pair<Id, Blob> > &entries,
+    std::vector<mstime_t> &expirations )
+{
+	unsigned long version;
+	do
+	{
+		version = _segments_version;
+		expirations.assign(entries.size(), 0);
+
+		// Most entries were never moved to disk; the Bloom filters tell.
+		std::vector<Segment*> segments;
+		std::vector<bool> candidate(entries.size(), false);
+		bool any = false;
+		for(size_t n = 0; n < entries.size(); ++n)
+		{
+			segments.clear();
+			candidate_segments_unlocked(entries[n].first, segments);
+			candidate[n] = !segments.empty();
+			any = any || candidate[n];
+		}
+		if(!any)
+			return;
+
+		segments = _segments;
+		SegmentReader reader(*this, segments);
+		mstime_t offset = wall_offset();
+		for(size_t n = 0; n < entries.size(); ++n)
+		{
+			if(!candidate[n])
+				continue;
+			std::vector<Segment::Entry> found;
+			for(size_t m = 0; m < segments.size(); ++m)
+				segments[m]->find(entries[n].first, found);
+			for(size_t m = 0; m < found.size(); ++m)
+				if( found[m].expiration > offset &&
+				    found[m].expiration - offset > expirations[n] &&
+				    found[m].value == entries[n].second )
+					expirations[n] = found[m].expiration - offset;
+		}
+	}
+	// A spill may have moved a copy to a new segment meanwhile.
+	while(version != _segments_version);
+}
+
+void DataTable::candidate_segments_unlocked(
+    const Id &index,
+    std::vector<Segment*> &segments )
+{
+	for(size_t n = 0; n < _segments.size(); ++n)
+		if(_segments[n]->may_contain(index))
+			segments.push_back(_segments[n]);
+}
+
+void DataTable::acquire_segments_unlocked(
+    const std::vector<Segment*> &segments )
+{
+	for(size_t n = 0; n < segments.size(); ++n)
+		++_segment_users[segments[n]];
+}
+
+void DataTable::release_segments_unlocked(
+    const std::vector<Segment*> &segments )
+{
+	for(size_t n = 0; n < segments.size(); ++n)
+	{
+		std::map<Segment*, unsigned>::iterator i = _segment_users.find(segments[n]);
+		if(--i->second > 0)
+			continue;
+		_segment_users.erase(i);
+		std::vector<Segment*>::iterator r = std::find(_retired.begin(), _retired.end(), segments[n]);
+		if(r != _retired.end())
+		{
+			_retired.erase(r);
+			close_segment(segments[n]);
+		}
+	}
+}
+
+DataTable::SegmentReader::SegmentReader(
+    DataTable &table,
+    const std::vector<Segment*> &segments ) :
+	_table(table),
+	_segments(segments)
+{
+	_table.acquire_segments_unlocked(_segments);
+	_table._mutex.unlock();
+}
+
+DataTable::SegmentReader::~SegmentReader( )
+{
+	_table._mutex.lock();
+	_table.release_segments_unlocked(_segments);
+}
+
+void DataTable::retire_segment_unlocked(
+    Segment *segment )
+{
+	if(_segment_users.count(segment))
+		_retired.push_back(segment);
+	else
+		close_segment(segment);
+}
+
+void DataTable::close_segment(
+    Segment *segment )
+{
+	const std::string path = segment->path();
+	delete segment;
+	std::remove(path.c_str());
+}
+
+bool DataTable::cache(
+    const Id &index,
+    const CORBA::Any &value,
+    mstime_t lifetime )
+{
+	const Blob blob(value);
+
+	omni_mutex_lock l(_mutex);
+	mstime_t expiration_time = coarse_now() + std::min<mstime_t>(lifetime, max_cache_lifetime);
+	for(cache_t::iterator i = _cache.lower_bound(index);
+		i != _cache.end() && i->first == index; ++i)
+		if(i->second.value == blob)
+		{
+			i->second.expiration_time = std::max(i->second.expiration_time, expiration_time);
+			return true;
+		}
+
+	if( _cache.size() >= max_cache_entries ||
+	    (_capacity && _bytes + footprint(blob) > _capacity) )
+		return false;
+	CacheEntry entry;
+	entry.value           = blob;
+	entry.expiration_time = expiration_time;
+	_cache.insert(std::make_pair(index, entry));
+	_bytes += footprint(blob);
+	return true;
 }
 
 kademlia::seq_value_t *DataTable::retrieve(
     const Id &index )
 {
-	omni_mutex_lock l(_mutex);
+	// Collect live entries; values are unmarshalled after releasing the lock.
+	std::vector<DataEntry> found;
+	mstime_t t;
+	{
+		omni_mutex_lock l(_mutex);
+		t = coarse_now();
+		_hot.hit(index);
+		for(contents_t::iterator i = _contents.lower_bound(index);
+			i != _contents.end() && i->first == index; ++i)
+		{
+			if(!i->second.erased && i->second.expiration_time > t)
+			{
+				i->second.access_time = t;
+				found.push_back(i->second);
+			}
+		}
 
-	mstime_t t = now();
-    
-    contents_t::const_iterator i = _contents.find(index), j = i;
-    unsigned count = 0;
-    while(j != _contents.end() && j->first == i->first)
+		// Look for cold entries, newest segment first. Segments are immutable,
+		// so they are read with the lock released.
+		std::vector<Segment*> segments;
+		candidate_segments_unlocked(index, segments);
+		if(!segments.empty())
+		{
+			std::vector<Segment::Entry> unseen;
+			{
+				SegmentReader reader(*this, segments);
+				std::vector<Segment::Entry> entries;
+				for(size_t n = segments.size(); n-- > 0; )
+					segments[n]->find(index, entries);
+				std::vector<Blob> seen;
+				for(size_t n = 0; n < entries.size(); ++n)
+					if(std::find(seen.begin(), seen.end(), entries[n].value) == seen.end())
+					{
+						seen.push_back(entries[n].value);
+						unseen.push_back(entries[n]);
+					}
+			}
+
+			// Bring the ones not hidden by entries in memory back into memory.
+			// Lifetimes are relative to t, which the entries in memory were
+			// checked against too.
+			mstime_t offset = wall_offset();
+			for(size_t n = 0; n < unseen.size(); ++n)
+			{
+				if( unseen[n].expiration <= offset + t ||
+				    find_unlocked(index, unseen[n].value) != _contents.end() )
+					continue;
+				DataEntry entry;
+				entry.value           = unseen[n].value;
+				entry.expiration_time = unseen[n].expiration - offset;
+				found.push_back(entry);
+				if(!_capacity || _bytes + footprint(entry.value) <= _capacity)
+					insert_unlocked(index, entry.value, entry.expiration_time, true);
+			}
+		}
+
+		// Fall back to cached copies of values stored elsewhere.
+		if(found.empty())
+			for(cache_t::const_iterator i = _cache.lower_bound(index);
+				i != _cache.end() && i->first == index; ++i)
+				if(i->second.expiration_time > t)
+				{
+					DataEntry entry;
+					entry.value           = i->second.value;
+					entry.expiration_time = i->second.expiration_time;
+					found.push_back(entry);
+				}
+	}
+
+	trace(25) << "DataTable::retrieve(): retrieving values at index:\n" << index <<
+			"\n" << found.size() << " entries found." << endm;
+
+    kademlia::seq_value_t_var values = new kademlia::seq_value_t(found.size());
+    values->length(found.size());
+    for(unsigned n = 0; n < found.size(); ++n)
     {
-        if(j->second.expiration_time > t)
-            ++count;
-        ++j;
-    };
+        found[n].value.to_any(values[n].contents);
+        values[n].lifetime = static_cast<lifetime_t>( found[n].expiration_time - t );
+    }
+    return values._retn();
+}
 
-	trace(25) << "DataTable::store(): retrieving values at index:\n" << index <<
-			"\n" << count << " entries found." << endm;
+void DataTable::hot_keys(
+    size_t k,
+    std::vector<HotKeys::Item> &items )
+{
+	omni_mutex_lock l(_mutex);
+	_hot.top(k, items);
+}
 
-    kademlia::seq_value_t *values = new kademlia::seq_value_t(count);
-    values->length(count);
-    for(int n = 0; i != j; ++i, ++n)
-        if(i->second.expiration_time > t)
-        {
-            (*values)[n].contents = i->second.value;
-            (*values)[n].lifetime = static_cast<lifetime_t>( i->second.expiration_time - t );
-        }
-    return values;
+void DataTable::decay_reads( )
+{
+	omni_mutex_lock l(_mutex);
+	_hot.decay();
 }
 
 unsigned DataTable::purge( )
@@ -118,8 +738,14 @@ unsigned DataTable::purge( )
 
 unsigned DataTable::purge_unlocked( )
 {
+	ustime_t start = precise_now();
 	unsigned purged = 0;
-    mstime_t t = now();
+    mstime_t t = coarse_now();
+
+    // Expired entries that may still hide an older copy on disk are looked up
+    // in the segments together, after the others are removed.
+    std::vector< std::pair<Id, Blob> > hiding;
+    std::vector<Segment*> segments;
     contents_t::iterator i, j;
     i = j = _contents.begin();
     while(i != _contents.end())
@@ -127,30 +753,447 @@ unsigned DataTable::purge_unlocked( )
         ++j;
         if(i->second.expiration_time <= t)
         {
+            segments.clear();
+            if(!i->second.erased)
+                candidate_segments_unlocked(i->first, segments);
+            if(!segments.empty())
+                hiding.push_back(std::make_pair(i->first, i->second.value));
+            else
+                remove_unlocked(i);
             ++purged;
-            _contents.erase(i);
         }
         i = j;
     }
+
+    if(!hiding.empty())
+    {
+        std::vector<mstime_t> expirations;
+        segment_expirations_unlocked(hiding, expirations);
+        for(size_t n = 0; n < hiding.size(); ++n)
+        {
+            // Skip entries that were removed or stored again meanwhile.
+            i = find_unlocked(hiding[n].first, hiding[n].second);
+            if(i == _contents.end() || i->second.erased || i->second.expiration_time > t)
+                continue;
+            remove_unlocked(i);
+            if(expirations[n] > t)
+                bury_unlocked(hiding[n].first, hiding[n].second.fingerprint(), expirations[n]);
+        }
+    }
+
+    for(cache_t::iterator c = _cache.begin(), next = c; c != _cache.end(); c = next)
+    {
+        ++next;
+        if(c->second.expiration_time <= t)
+        {
+            _bytes -= footprint(c->second.value);
+            _cache.erase(c);
+            ++purged;
+        }
+    }
+
+    // Drop outdated items from the expiration queue.
+    if(_expiry.size() > 2*_contents.size() + 64)
+    {
+        _expiry.clear();
+        for(i = _contents.begin(); i != _contents.end(); ++i)
+            if(!i->second.erased)
+                _expiry.insert(std::make_pair(i->second.expiration_time, i->first));
+    }
+    metrics().purged(precise_now() - start, purged);
     return purged;
 }
 
+// Returns an ID with all bits set to the given value.
+static Id filled_id(bool value)
+{
+	kademlia::id_t id;
+	memset(id, value ? 0xff : 0, sizeof(id));
+	return Id(id);
+}
+
 seq_entry_t* DataTable::contents( )
 {
-    seq_entry_t_var result = new seq_entry_t();
+	return range(filled_id(false), filled_id(true));
+}
+
+seq_entry_t* DataTable::range(
+    const Id &low,
+    const Id &high )
+{
+	// Collect live entries; values are unmarshalled after releasing the lock.
+	std::vector< std::pair<Id, DataEntry> > found;
+	mstime_t t;
+	{
+		omni_mutex_lock l(_mutex);
+		t = coarse_now();
+		Id last = high;
+		collect_unlocked(low, last, t, found);
+	}
+	return entries(found, t);
+}
 
-	omni_mutex_lock l(_mutex);
-	mstime_t t = now();
-	result->length(_contents.size());
-	unsigned n = 0;
-    for(contents_t::const_iterator i = _contents.begin(); i != _contents.end(); ++i)
-        if(i->second.expiration_time > t)
-        {
-            memcpy(result[n].index, i->first, sizeof(result[n].index));
-            result[n].value.lifetime = static_cast<lifetime_t>( i->second.expiration_time - t );
-            result[n].value.contents = i->second.value;
-            ++n;
-        }
-    result->length(n);
+template<class Entry>
+static bool index_less(
+    const Entry &a,
+    const Entry &b )
+{
+	return a.first < b.first;
+}
+
+// Returns the ID following the given one; the highest ID has none.
+static bool successor(Id &id)
+{
+	for(unsigned bit = 0; bit < Id::bits; ++bit)
+	{
+		id.set(bit, !id[bit]);
+		if(id[bit])
+			return true;
+	}
+	return false;
+}
+
+seq_entry_t* DataTable::page(
+    const Id &cursor,
+    size_t max,
+    Id &next,
+    bool &more )
+{
+	std::vector< std::pair<Id, DataEntry> > found;
+	Id high = filled_id(true);
+	mstime_t t;
+	{
+		omni_mutex_lock l(_mutex);
+		t = coarse_now();
+
+		// Bound the page by the index of the max-th live entry in memory,
+		// and by that of the max-th entry in each segment. Entries from
+		// either may add to it; the page is cut back below.
+		size_t count = 0;
+		for(contents_t::const_iterator i = _contents.lower_bound(cursor); i != _contents.end(); ++i)
+			if(!i->second.erased && i->second.expiration_time > t && ++count == max)
+			{
+				high = i->first;
+				break;
+			}
+		collect_unlocked(cursor, high, t, found, max);
+	}
+
+	// Cut the page at the first index boundary after max entries.
+	std::stable_sort(found.begin(), found.end(), index_less< std::pair<Id, DataEntry> >);
+	size_t length = found.size();
+	if(length > max)
+	{
+		length = max;
+		while(length > 0 && length < found.size() && found[length].first == found[length - 1].first)
+			++length;
+	}
+	if(length < found.size())
+	{
+		next = found[length].first;
+		more = true;
+		found.resize(length);
+	}
+	else
+	{
+		next = high;
+		more = successor(next);
+	}
+	return entries(found, t);
+}
+
+void DataTable::collect_unlocked(
+    const Id &low,
+    Id &high,
+    mstime_t t,
+    std::vector< std::pair<Id, DataEntry> > &found,
+    size_t max )
+{
+	// Collect cold entries that are not hidden by entries in newer segments.
+	// Segments are immutable, so they are scanned with the lock released;
+	// if a spill or merge replaced them meanwhile, they are scanned again.
+	std::vector< std::pair<Id, DataEntry> > cold;
+	const Id bound = high;
+	unsigned long version;
+	do
+	{
+		version = _segments_version;
+		high    = bound;
+		cold.clear();
+		if(_segments.empty())
+			break;
+
+		std::vector<Segment*> segments = _segments;
+		SegmentReader reader(*this, segments);
+		std::multimap<Id, Blob> seen;
+		mstime_t offset = wall_offset();
+		for(size_t n = segments.size(); n-- > 0; )
+		{
+			std::vector<Segment::Entry> entries;
+			segments[n]->scan(low, high, entries, max);
+			if(max > 0 && entries.size() >= max && entries.back().index < high)
+				high = entries.back().index;
+			for(size_t m = 0; m < entries.size(); ++m)
+			{
+				const Segment::Entry &entry = entries[m];
+				bool hidden = false;
+				for(std::multimap<Id, Blob>::const_iterator i = seen.lower_bound(entry.index);
+					i != seen.end() && i->first == entry.index && !hidden; ++i)
+					hidden = (i->second == entry.value);
+				if(hidden)
+					continue;
+				seen.insert(std::make_pair(entry.index, entry.value));
+				if(entry.expiration > offset + t)
+				{
+					DataEntry data;
+					data.value           = entry.value;
+					data.expiration_time = entry.expiration - offset;
+					cold.push_back(std::make_pair(entry.index, data));
+				}
+			}
+		}
+	}
+	while(version != _segments_version);
+
+	// Memory is only read now that the lock is held again, so that all
+	// entries are as the table has them at this point.
+	contents_t::const_iterator end = _contents.upper_bound(high);
+    for(contents_t::const_iterator i = _contents.lower_bound(low); i != end; ++i)
+        if(!i->second.erased && i->second.expiration_time > t)
+			found.push_back(*i);
+
+	// Entries in memory, including tombstones, hide their copies on disk.
+	// Segments scanned before high was lowered may have added entries past
+	// it.
+	for(size_t n = 0; n < cold.size(); ++n)
+		if( !(high < cold[n].first) &&
+			find_unlocked(cold[n].first, cold[n].second.value) == _contents.end() )
+			found.push_back(cold[n]);
+}
+
+seq_entry_t* DataTable::entries(
+    const std::vector< std::pair<Id, DataEntry> > &found,
+    mstime_t t )
+{
+    seq_entry_t_var result = new seq_entry_t(found.size());
+	result->length(found.size());
+    for(unsigned n = 0; n < found.size(); ++n)
+    {
+        memcpy(result[n].index, found[n].first, sizeof(result[n].index));
+        result[n].value.lifetime = static_cast<lifetime_t>( found[n].second.expiration_time - t );
+        found[n].second.value.to_any(result[n].value.contents);
+    }
     return result._retn();
-}
\ No newline at end of file
+}
+
+std::string DataTable::segment_path(
+    unsigned long number ) const
+{
+	char suffix[32];
+	std::sprintf(suffix, ".seg.%lu", number);
+	return _file->path() + suffix;
+}
+
+// Opens the segments listed in the manifest of the data file.
+void DataTable::load_segments_unlocked( )
+{
+	const std::string manifest = _file->path() + ".segments";
+	std::FILE *in = std::fopen(manifest.c_str(), "r");
+	if(!in)
+		return;
+	unsigned long number;
+	while(std::fscanf(in, "%lu", &number) == 1)
+	{
+		if(number >= _next_segment)
+			_next_segment = number + 1;
+		if(Segment *segment = Segment::open(segment_path(number)))
+		{
+			_segments.push_back(segment);
+			++_segments_version;
+		}
+	}
+	std::fclose(in);
+}
+
+// Replaces the manifest with the current list of segments.
+bool DataTable::save_manifest_unlocked( )
+{
+	const std::string manifest = _file->path() + ".segments",
+	                  temp     = manifest + ".tmp";
+	std::FILE *out = std::fopen(temp.c_str(), "w");
+	bool ok = (out != 0);
+	for(size_t n = 0; ok && n < _segments.size(); ++n)
+	{
+		const std::string &path = _segments[n]->path();
+		ok = std::fprintf(out, "%s\n", path.substr(path.rfind('.') + 1).c_str()) > 0;
+	}
+	if(out)
+	{
+		ok = DataFile::sync_file(out) && ok;
+		ok = (std::fclose(out) == 0) && ok;
+	}
+	if(ok)
+	{
+#ifdef __WIN32__
+		std::remove(manifest.c_str());
+#endif
+		ok = (std::rename(temp.c_str(), manifest.c_str()) == 0);
+		DataFile::sync_directory(manifest);
+	}
+	if(!ok)
+		error() << "DataTable: failed to write " << manifest << endm;
+	return ok;
+}
+
+// Moves entries that have not been used recently to a new segment. Must be
+// called with the lock held; the lock is released while the segment is
+// written.
+void DataTable::spill( )
+{
+	mstime_t t = coarse_now(), offset = wall_offset();
+	std::vector<Segment::Entry> cold;
+	for(contents_t::const_iterator i = _contents.begin(); i != _contents.end(); ++i)
+		if( !i->second.erased && i->second.expiration_time > t &&
+		    i->second.access_time + cold_age <= t )
+		{
+			Segment::Entry entry;
+			entry.index      = i->first;
+			entry.value      = i->second.value;
+			entry.expiration = i->second.expiration_time + offset;
+			cold.push_back(entry);
+		}
+	if(cold.size() < min_spill_entries)
+		return;
+
+	const std::string path = segment_path(_next_segment++);
+	_mutex.unlock();
+	trace(20) << "DataTable::spill(): moving " << cold.size() << " entries to " << path << endm;
+	Segment *segment = 0;
+	{
+		Segment::Writer writer(path, cold.size());
+		for(size_t n = 0; n < cold.size(); ++n)
+			writer.add(cold[n]);
+		if(writer.finish())
+			segment = Segment::open(path);
+	}
+	_mutex.lock();
+
+	if(!segment)
+		return;
+	_segments.push_back(segment);
+	++_segments_version;
+	if(!save_manifest_unlocked())
+	{
+		_segments.pop_back();
+		++_segments_version;
+		retire_segment_unlocked(segment);
+		return;
+	}
+
+	// Drop the spilled entries from memory, unless they were used or changed
+	// in the mean time.
+	for(size_t n = 0; n < cold.size(); ++n)
+	{
+		mstime_t expiration_time = cold[n].expiration - offset;
+		contents_t::iterator i = find_unlocked(cold[n].index, cold[n].value);
+		if(i == _contents.end())
+		{
+			// Erased while the segment was written; hide the spilled copy.
+			bury_unlocked(cold[n].index, cold[n].value.fingerprint(), expiration_time);
+		}
+		else
+		if(i->second.erased)
+		{
+			if(i->second.expiration_time < expiration_time)
+				i->second.expiration_time = expiration_time;
+		}
+		else
+		if( i->second.expiration_time == expiration_time &&
+		    i->second.access_time + cold_age <= t )
+			remove_unlocked(i);
+	}
+}
+
+// Writes the newest copy of each live entry in the given segments, which must
+// be ordered oldest first, to a new segment.
+static bool merge(
+	const std::vector<Segment*> &inputs,
+	const std::string &path,
+	size_t capacity,
+	mstime_t wall_time )
+{
+	Segment::Writer writer(path, capacity);
+	size_t count = inputs.size();
+	std::vector<Segment::offset_t> positions(count, 0);
+	std::vector<Segment::Entry> heads(count);
+	std::vector<bool> valid(count);
+	for(size_t n = 0; n < count; ++n)
+		valid[n] = inputs[n]->read(positions[n], heads[n]);
+
+	for(;;)
+	{
+		// Find the smallest index among the current entries of all segments.
+		size_t first = count;
+		for(size_t n = 0; n < count; ++n)
+			if(valid[n] && (first == count || heads[n].index < heads[first].index))
+				first = n;
+		if(first == count)
+			break;
+		const Id index = heads[first].index;
+
+		// Collect the entries at this index, newest segment first, keeping
+		// only the newest copy of each value.
+		std::vector<Segment::Entry> group;
+		for(size_t n = count; n-- > 0; )
+			while(valid[n] && heads[n].index == index)
+			{
+				bool hidden = false;
+				for(size_t m = 0; m < group.size() && !hidden; ++m)
+					hidden = (group[m].value == heads[n].value);
+				if(!hidden)
+					group.push_back(heads[n]);
+				valid[n] = inputs[n]->read(positions[n], heads[n]);
+			}
+
+		for(size_t m = 0; m < group.size(); ++m)
+			if(group[m].expiration > wall_time && !writer.add(group[m]))
+				return false;
+	}
+	return writer.finish();
+}
+
+// Merges all segments into one. Must be called with the lock held; the lock
+// is released while the new segment is written.
+void DataTable::merge_segments( )
+{
+	std::vector<Segment*> inputs = _segments;
+	size_t capacity = 0;
+	for(size_t n = 0; n < inputs.size(); ++n)
+		capacity += inputs[n]->count();
+	const std::string path = segment_path(_next_segment++);
+
+	// Segments are only added and removed by the maintenance task, so the
+	// list does not change while the lock is released.
+	_mutex.unlock();
+	trace(20) << "DataTable::merge_segments(): merging " << inputs.size() <<
+		" segments into " << path << endm;
+	Segment *segment = 0;
+	if(merge(inputs, path, capacity, wall_now()))
+		segment = Segment::open(path);
+	_mutex.lock();
+
+	if(!segment)
+		return;
+	_segments.assign(1, segment);
+	++_segments_version;
+	if(!save_manifest_unlocked())
+	{
+		_segments = inputs;
+		retire_segment_unlocked(segment);
+		return;
+	}
+
+	// Readers may still be using the old segments with the lock released.
+	for(size_t n = 0; n < inputs.size(); ++n)
+		retire_segment_unlocked(inputs[n]);
+}
@@ -4,53 +4,327 @@
 #include "kademlia.hh"
 
 #include "time.hh"
+#include "Blob.hh"
+#include "HotKeys.hh"
 #include "Id.hh"
+#include "Scheduler.hh"
 
 #include <omnithread.h>
 #include <map>
+#include <string>
+#include <vector>
+
+class DataFile;
+class Segment;
 
 class DataTable
 {
 public:
 
-    DataTable();
+    enum eviction_policy
+    {
+        evict_nearest_expiration,   // entries that expire first
+        evict_farthest              // entries farthest from the origin
+    };
+
+    // The origin is the ID of the owning node; entries far away from it are
+    // the least likely to be our responsibility.
+    DataTable(
+        const Id &origin = Id::random() );
 	~DataTable();
+
+    // Limits the memory used by entries to the given number of bytes (zero
+    // means unlimited), evicting entries according to the policy when full.
+    void limit(
+        size_t capacity,
+        eviction_policy policy );
+
+    // Returns the number of bytes of memory accounted to entries, and the
+    // number of entries evicted so far.
+    size_t bytes( );
+
+    unsigned long evicted( );
+
+    // Returns the number of entries held in memory, including erased ones
+    // that have not been purged yet.
+    size_t size( );
     
-    void store(
+    // Stores a value; a lifetime of zero erases it. If durable is set, this
+    // waits until the change has been synced to the data file; erasing a
+    // value that was stored durably or moved to disk is always synced.
+    // Returns false if there is no room for the value.
+    bool store(
         const Id &index,
         const CORBA::Any &value,
-        mstime_t lifetime );
+        mstime_t lifetime,
+        bool durable = false );
     
+    // Caches a copy of a value stored at other nodes, for lookups that pass
+    // by. Cached values are only returned by retrieve() when no value is
+    // stored at the index, are never persisted or handed over, and are the
+    // first to go when memory runs short. Returns false if the cache is full.
+    bool cache(
+        const Id &index,
+        const CORBA::Any &value,
+        mstime_t lifetime );
+
     kademlia::seq_value_t *retrieve(
         const Id &index );
 
+    // Returns the (at most) k most read indices; see HotKeys. Read counts
+    // are halved by every call to decay_reads().
+    void hot_keys(
+        size_t k,
+        std::vector<HotKeys::Item> &items );
+
+    void decay_reads( );
+
     unsigned purge( );
     
     kademlia::seq_entry_t* contents( );
 
+    // Returns the live entries with indices between low and high (inclusive).
+    kademlia::seq_entry_t* range(
+        const Id &low,
+        const Id &high );
 
-private:
-	unsigned purge_unlocked( );
+    // Returns the live entries with indices of at least cursor, in order of
+    // index, up to max of them; all values at an index go in the same page,
+    // so a page may hold more. If more entries may follow, more is set and
+    // next to the cursor of the next page. Each page is taken from the table
+    // at one point in time.
+    kademlia::seq_entry_t* page(
+        const Id &cursor,
+        size_t max,
+        Id &next,
+        bool &more );
+
+	// Loads entries from the given data file and stores all subsequent
+	// changes in it. Returns false if the file could not be opened.
+	bool open(
+		const std::string &path );
+
+	// Maximum lifetime of cached values. Erasing a value only drops the
+	// copies cached here, so copies cached elsewhere must not live long.
+	static const unsigned max_cache_lifetime = 60*1000;	// 1 minute
 
 
 private:
+
+	static const unsigned purge_interval = 10*1000;	// 10 seconds
+
+	// Minimum number of log records before a snapshot is written, and the
+	// interval at which snapshots are written if the log keeps growing.
+	static const unsigned min_snapshot_records = 1000;
+	static const unsigned snapshot_interval    = 10*60*1000;	// 10 minutes
+
+	// Entries that have not been read or written for cold_age are moved to an
+	// on-disk segment, once at least min_spill_entries of them have piled up.
+	// Segments are merged when there are more than max_segments of them.
+	static const unsigned cold_age          = 10*60*1000;	// 10 minutes
+	static const unsigned spill_interval    = 60*1000;		// 1 minute
+	static const unsigned min_spill_entries = 100;
+	static const unsigned max_segments      = 8;
 	
+	// Erased entries (tombstones) are kept in memory as long as an older copy
+	// of the entry may still be found in a segment, to hide it. They hold
+	// the fingerprint of the value instead of the value, and are not charged
+	// against the capacity.
 	struct DataEntry
 	{
-		CORBA::Any value;
+		Blob       value;
 		mstime_t   expiration_time;
 		mstime_t   republish_time;
+		mstime_t   access_time;
+		bool       erased;
+		bool       durable;	// synced or loaded from disk
 	};
 	
-	omni_mutex _mutex;
-
     typedef std::multimap<Id, DataEntry> contents_t;
+    typedef std::multimap<mstime_t, Id> expiry_t;
+
+	// Cached copies of values stored at other nodes.
+	struct CacheEntry
+	{
+		Blob       value;
+		mstime_t   expiration_time;
+	};
+
+	typedef std::multimap<Id, CacheEntry> cache_t;
+
+	static const unsigned max_cache_entries = 4096;
+
+	// Number of indices whose read counts are tracked.
+	static const unsigned hot_key_counters = 64;
+
+	unsigned purge_unlocked( );
+
+	void insert_unlocked(
+		const Id &index,
+		const Blob &value,
+		mstime_t expiration_time,
+		bool durable );
+
+	// Returns true if the erased value may have been on disk, in which case
+	// the erase must be synced too, lest the value come back after a crash.
+	// The lock is released while segments are read.
+	bool erase_unlocked(
+		const Id &index,
+		const Blob &value );
+
+	unsigned long log_unlocked(
+		CORBA::ULong type,
+		const Id &index,
+		const Blob &value,
+		mstime_t expiration_time );
+
+	void add_unlocked(
+		const Id &index,
+		const DataEntry &entry );
+
+	void remove_unlocked(
+		contents_t::iterator i );
+
+	// Adds a tombstone that hides copies of a value on disk until the given
+	// time; fingerprint is that of the value.
+	void bury_unlocked(
+		const Id &index,
+		const Blob &fingerprint,
+		mstime_t expiration_time );
+
+	contents_t::iterator victim_unlocked( );
+
+	// Removes an entry to make room, without releasing the lock.
+	void evict_unlocked(
+		contents_t::iterator victim );
+
+	bool make_room_unlocked(
+		const Id &index,
+		const Blob &value,
+		mstime_t expiration_time );
+
+	// Adds the live entries with indices between low and high (inclusive),
+	// both in memory and in segments, to found. If max is nonzero, each
+	// segment is scanned for at most max entries past low, and high is
+	// lowered to the smallest index a segment stopped at. The lock is
+	// released while segments are scanned; the entries are those of the
+	// table once it is relocked.
+	void collect_unlocked(
+		const Id &low,
+		Id &high,
+		mstime_t t,
+		std::vector< std::pair<Id, DataEntry> > &found,
+		size_t max = 0 );
+
+	// Converts collected entries to their CORBA form.
+	static kademlia::seq_entry_t *entries(
+		const std::vector< std::pair<Id, DataEntry> > &found,
+		mstime_t t );
+
+	contents_t::iterator find_unlocked(
+		const Id &index,
+		const Blob &value );
+
+	// Returns the latest expiration time of the given entry in any segment,
+	// or 0 if there is none. The lock is released while segments are read.
+	mstime_t segment_expiration_unlocked(
+		const Id &index,
+		const Blob &value );
+
+	// Like segment_expiration_unlocked, for several entries at once.
+	void segment_expirations_unlocked(
+		const std::vector< std::pair<Id, Blob> > &entries,
+		std::vector<mstime_t> &expirations );
+
+	// Adds the segments whose Bloom filter may contain the index.
+	void candidate_segments_unlocked(
+		const Id &index,
+		std::vector<Segment*> &segments );
+
+	// Segments in use by readers that released the lock are not closed
+	// until they are released.
+	void acquire_segments_unlocked(
+		const std::vector<Segment*> &segments );
+
+	void release_segments_unlocked(
+		const std::vector<Segment*> &segments );
+
+	// Acquires the segments and releases the lock for its lifetime; takes
+	// the lock again and releases the segments when destroyed, also when an
+	// exception is thrown.
+	class SegmentReader
+	{
+	public:
+		SegmentReader(
+			DataTable &table,
+			const std::vector<Segment*> &segments );
+
+		~SegmentReader( );
+
+	private:
+		DataTable                   &_table;
+		const std::vector<Segment*> &_segments;
+	};
+
+	friend class SegmentReader;
+
+	// Closes a segment that is no longer listed, once it is unused.
+	void retire_segment_unlocked(
+		Segment *segment );
+
+	// Closes a segment and removes its file.
+	static void close_segment(
+		Segment *segment );
+
+	void snapshot( );
+
+	void spill( );
+
+	void merge_segments( );
+
+	void load_segments_unlocked( );
+
+	bool save_manifest_unlocked( );
+
+	std::string segment_path(
+		unsigned long number ) const;
+
+
+	omni_mutex     _mutex;
+
     contents_t _contents;
+    cache_t    _cache;
+
+	const Id        _origin;
+	size_t          _capacity, _bytes;
+	eviction_policy _policy;
+	unsigned long   _evicted;
+	HotKeys         _hot;
+
+	// Expiration times of entries, used by the nearest-expiration policy.
+	// Items are not removed when entries change, but skipped when outdated.
+	expiry_t        _expiry;
+
+	DataFile *_file;
+
+	// Segments holding cold entries, oldest first. Entries in memory take
+	// precedence over those in segments, and newer segments over older ones.
+	std::vector<Segment*> _segments;
+	unsigned long         _next_segment;
+
+	// Incremented whenever the list of segments changes.
+	unsigned long         _segments_version;
+
+	// Readers per segment, and unlisted segments waiting for their readers.
+	std::map<Segment*, unsigned> _segment_users;
+	std::vector<Segment*>        _retired;
 
-	bool _destructing;
+	// Maintenance task; see Scheduler.
+	static mstime_t maintenance_task(
+		void *dt );
 
-	omni_thread *_thread;
-	friend void *datatable_thread(void *dt);
+	mstime_t          _next_snapshot, _next_spill;
+	Scheduler::task_t _task;
 
 }; // class DataEntry
 
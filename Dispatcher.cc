@@ -0,0 +1,102 @@
+#include "Dispatcher.hh"
+#include "AdmissionControl.hh"
+
+#include "logging.hh"
+
+// Default numbers of workers and queue lengths per class.
+static const unsigned default_limits[Dispatcher::queues][2] = {
+	{  4,  64 },	// maintenance
+	{  8, 128 },	// routing
+	{  8,  64 },	// data
+	{ 16,  64 }		// client
+};
+
+Dispatcher::Dispatcher( )
+{
+	for(unsigned n = 0; n < queues; ++n)
+	{
+		_queues[n].cond       = new omni_condition(&_mutex);
+		_queues[n].workers    = default_limits[n][0];
+		_queues[n].max_queued = default_limits[n][1];
+		_queues[n].running    = 0;
+		_queues[n].queued     = 0;
+	}
+}
+
+Dispatcher::~Dispatcher( )
+{
+	for(unsigned n = 0; n < queues; ++n)
+		delete _queues[n].cond;
+}
+
+void Dispatcher::limit(
+	queue_t queue,
+	unsigned workers,
+	unsigned max_queued )
+{
+	omni_mutex_lock l(_mutex);
+	_queues[queue].workers    = workers > 0 ? workers : 1;
+	_queues[queue].max_queued = max_queued;
+	_queues[queue].cond->broadcast();
+}
+
+unsigned Dispatcher::capacity( )
+{
+	omni_mutex_lock l(_mutex);
+	unsigned total = 0;
+	for(unsigned n = 0; n < queues; ++n)
+		total += _queues[n].workers + _queues[n].max_queued;
+	return total;
+}
+
+bool Dispatcher::acquire(
+	queue_t queue,
+	bool wait )
+{
+	omni_mutex_lock l(_mutex);
+	Queue &q = _queues[queue];
+	if(q.running < q.workers)
+	{
+		++q.running;
+		return true;
+	}
+	if(!wait || q.queued >= q.max_queued)
+		return false;
+
+	++q.queued;
+	mstime_t deadline = now() + max_wait;
+	while(q.running >= q.workers && now() < deadline)
+		wait_until(*q.cond, deadline);
+	--q.queued;
+	if(q.running >= q.workers)
+		return false;
+	++q.running;
+	return true;
+}
+
+void Dispatcher::release(
+	queue_t queue )
+{
+	omni_mutex_lock l(_mutex);
+	--_queues[queue].running;
+	_queues[queue].cond->signal();
+}
+
+Dispatcher::Slot::Slot(
+	Dispatcher &dispatcher,
+	queue_t queue,
+	bool wait ) :
+	_dispatcher(dispatcher),
+	_queue(queue)
+{
+	if(!_dispatcher.acquire(_queue, wait))
+	{
+		trace(25) << "Dispatcher::Slot::Slot(): queue " << _queue << " is full" << endm;
+		throw CORBA::TRANSIENT(AdmissionControl::shed_minor, CORBA::COMPLETED_NO);
+	}
+}
+
+Dispatcher::Slot::~Slot( )
+{
+	_dispatcher.release(_queue);
+}
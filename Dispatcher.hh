@@ -0,0 +1,99 @@
+#ifndef DISPATCHER_HH_INCLUDED
+#define DISPATCHER_HH_INCLUDED
+
+#include "kademlia.hh"
+
+#include "time.hh"
+
+#include <omnithread.h>
+
+/*
+	Bounds the number of incoming calls that execute at once, per class of
+	operation. Calls in excess of a class's number of workers wait in its
+	queue, up to a maximum queue length and waiting time, and are rejected
+	with a TRANSIENT exception (see AdmissionControl::shed_minor) beyond
+	that. Keeping the classes apart means a flood of stores cannot delay the
+	pings and lookups that keep the overlay connected, and keeps the number
+	of threads contending for the contact and data table locks small no
+	matter how many threads the ORB dispatches calls on.
+
+	Broker operations come from local clients and hold their worker for as
+	long as their lookups take, so they get a class of their own; they are
+	not subject to AdmissionControl, whose buckets are kept per node ID.
+*/
+class Dispatcher
+{
+public:
+
+	enum queue_t
+	{
+		maintenance,	// ping and the node attributes
+		routing,		// find_nodes and find_value
+		data,			// store, store_batch, retrieve and cache
+		client,			// Broker operations
+		queues
+	};
+
+	Dispatcher( );
+
+	~Dispatcher( );
+
+	// Sets the number of calls of the given class that execute at once and
+	// the number of calls that may wait for them.
+	void limit(
+		queue_t queue,
+		unsigned workers,
+		unsigned max_queued );
+
+	// Returns the number of calls that may be admitted at once, executing
+	// or queued. A queued call holds its ORB thread while it waits, so the
+	// ORB's thread pool must be larger than this, or it runs out of threads
+	// before full queues reject any calls.
+	unsigned capacity( );
+
+	/*
+		Holds a worker slot in the given queue for the lifetime of the
+		object; throws TRANSIENT if none becomes available in time, or at
+		once if wait is false and all workers are busy.
+	*/
+	class Slot
+	{
+	public:
+		Slot(
+			Dispatcher &dispatcher,
+			queue_t queue,
+			bool wait = true );
+
+		~Slot( );
+
+	private:
+		Dispatcher &_dispatcher;
+		queue_t     _queue;
+
+	}; // class Dispatcher::Slot
+
+private:
+
+	// Maximum time a call waits in a queue.
+	static const unsigned max_wait = 1000;	// 1 second
+
+	struct Queue
+	{
+		omni_condition *cond;
+		unsigned        workers, max_queued;
+		unsigned        running, queued;
+	};
+
+	bool acquire(
+		queue_t queue,
+		bool wait );
+
+	void release(
+		queue_t queue );
+
+	omni_mutex _mutex;
+	Queue      _queues[queues];
+
+}; // class Dispatcher
+
+#endif //ndef DISPATCHER_HH_INCLUDED
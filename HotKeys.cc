@@ -0,0 +1,70 @@
+#include "HotKeys.hh"
+
+#include <algorithm>
+
+static bool more_frequent(const HotKeys::Item &a, const HotKeys::Item &b)
+{
+	return a.count > b.count;
+}
+
+HotKeys::HotKeys(
+	size_t capacity ) :
+	_capacity(capacity)
+{
+}
+
+void HotKeys::hit(
+	const Id &index )
+{
+	counters_t::iterator i = _counters.find(index);
+	if(i != _counters.end())
+	{
+		++i->second.count;
+		return;
+	}
+
+	Counter counter = { 1, 0 };
+	if(_counters.size() >= _capacity)
+	{
+		// Replace the smallest counter, inheriting its count as the error.
+		counters_t::iterator min = _counters.begin();
+		for(i = _counters.begin(); i != _counters.end(); ++i)
+			if(i->second.count < min->second.count)
+				min = i;
+		counter.count += min->second.count;
+		counter.error  = min->second.count;
+		_counters.erase(min);
+	}
+	_counters.insert(std::make_pair(index, counter));
+}
+
+void HotKeys::top(
+	size_t k,
+	std::vector<Item> &items ) const
+{
+	items.clear();
+	for(counters_t::const_iterator i = _counters.begin(); i != _counters.end(); ++i)
+	{
+		Item item;
+		item.index = i->first;
+		item.count = i->second.count;
+		item.error = i->second.error;
+		items.push_back(item);
+	}
+	std::sort(items.begin(), items.end(), more_frequent);
+	if(items.size() > k)
+		items.resize(k);
+}
+
+void HotKeys::decay( )
+{
+	counters_t::iterator i = _counters.begin();
+	while(i != _counters.end())
+	{
+		counters_t::iterator j = i++;
+		j->second.count /= 2;
+		j->second.error /= 2;
+		if(j->second.count == 0)
+			_counters.erase(j);
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef HOTKEYS_HH_INCLUDED
+#define HOTKEYS_HH_INCLUDED
+
+#include "Id.hh"
+
+#include <map>
+#include <vector>
+
+/*
+	Tracks the most frequently read indices in bounded memory, using the
+	space-saving algorithm: a fixed number of counters is kept, and an index
+	without a counter takes over the smallest one. Counts of frequent indices
+	are overestimated by at most their error, which is the count of the index
+	they replaced. Counts are halved by decay(), so that they follow the
+	recent read rate rather than the total number of reads.
+
+	Not synchronized; the owner must serialize calls.
+*/
+class HotKeys
+{
+public:
+
+	struct Item
+	{
+		Id            index;
+		unsigned long count, error;
+	};
+
+	HotKeys(
+		size_t capacity );
+
+	void hit(
+		const Id &index );
+
+	// Replaces the contents of the vector with (at most) the k indices with
+	// the highest counts, in decreasing order of count.
+	void top(
+		size_t k,
+		std::vector<Item> &items ) const;
+
+	void decay( );
+
+private:
+
+	struct Counter
+	{
+		unsigned long count, error;
+	};
+
+	typedef std::map<Id, Counter> counters_t;
+
+	size_t     _capacity;
+	counters_t _counters;
+
+}; // class HotKeys
+
+#endif //ndef HOTKEYS_HH_INCLUDED
@@ -18,7 +18,7 @@ Id Id::random( )
 
 Id Id::hash(
     const void *buffer,
-    unsigned length )
+    size_t length )
 {
     Id result;
     sha1_state_s state;
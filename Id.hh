@@ -76,6 +76,10 @@ public:
     
     bool operator [] (
         unsigned bit ) const;
+
+    void set(
+        unsigned bit,
+        bool value );
         
     unsigned bitscan( ) const;
     
@@ -102,6 +106,15 @@ inline bool Id::operator[](unsigned bit) const
     return ( _id[sizeof(_id) - 1 - (bit/8)] & (1 << (bit%8)) ) != 0;
 }
 
+inline void Id::set(unsigned bit, bool value)
+{
+    unsigned char &byte = _id[sizeof(_id) - 1 - (bit/8)];
+    if(value)
+        byte |= (1 << (bit%8));
+    else
+        byte &= ~(1 << (bit%8));
+}
+
 std::ostream &operator<<(std::ostream &os, const Id &id);
 
 #endif //ndef ID_HH_INCLUDED
@@ -0,0 +1,284 @@
+#include "Lookup.hh"
+#include "RefCache.hh"
+#include "endpoint.hh"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace kademlia;
+
+Lookup::Lookup (
+	const Id &target,
+	const seq_node_ref_t &initial,
+	bool find_value,
+	const seq_compact_node_ref_t *endpoints ) :
+	_target(target), _find_value(find_value), _length(0), _in_flight(0),
+	_hops(0), _values(0), _holders(0), _missed(false)
+{
+	insert(initial, 1);
+	for(unsigned n = 0; endpoints && n < endpoints->length(); ++n)
+	{
+		unsigned p = find(Id((*endpoints)[n].id));
+		if(p < _length)
+		{
+			_endpoint    [p] = (*endpoints)[n].endpoint;
+			_has_endpoint[p] = true;
+		}
+	}
+}
+
+Lookup::~Lookup( )
+{
+	delete _values;
+}
+
+bool Lookup::next (
+	node_ref_t &node )
+{
+	if(_holders >= value_nodes || _in_flight >= concurrency_factor)
+		return false;
+
+	for(unsigned n = 0; n < _length; ++n)
+		if(_state[n] == unqueried)
+		{
+			_state[n] = in_flight;
+			++_in_flight;
+			resolve(n);
+			node = _nodes[n];
+			return true;
+		}
+	return false;
+}
+
+bool Lookup::endpoint (
+	const Id &node,
+	endpoint_t &endpoint ) const
+{
+	unsigned p = find(node);
+	if(p == _length || !_has_endpoint[p])
+		return false;
+	endpoint = _endpoint[p];
+	return true;
+}
+
+void Lookup::replied (
+	const Id &node,
+	const seq_node_ref_t &nodes,
+	const seq_value_t *values )
+{
+	unsigned p = complete(node, answered);
+	if(values && values->length() > 0)
+	{
+		// Merge the values, keeping the longest lifetime of each.
+		if(!_values)
+			_values = new seq_value_t();
+		for(unsigned n = 0; n < values->length(); ++n)
+		{
+			Blob blob((*values)[n].contents);
+			unsigned m, length = _values->length();
+			for(m = 0; m < length; ++m)
+				if(_blobs[m] == blob)
+					break;
+			if(m == length)
+			{
+				_values->length(length + 1);
+				(*_values)[m] = (*values)[n];
+				_blobs.push_back(blob);
+			}
+			else
+			if((*_values)[m].lifetime < (*values)[n].lifetime)
+				(*_values)[m].lifetime = (*values)[n].lifetime;
+		}
+		++_holders;
+	}
+	else
+	if(values && p < _length && (!_missed || _distance[p] < _miss_distance))
+	{
+		_miss          = _nodes[p];
+		_miss_distance = _distance[p];
+		_missed        = true;
+	}
+	insert(nodes, next_hop(p));
+}
+
+void Lookup::replied (
+	const Id &node,
+	const seq_compact_node_ref_t &nodes )
+{
+	insert(nodes, next_hop(complete(node, answered)));
+}
+
+void Lookup::insert (
+	const seq_node_ref_t &nodes,
+	unsigned hop )
+{
+	for(unsigned n = 0; n < nodes.length(); ++n)
+	{
+		Id id(nodes[n].id);
+		unsigned p = place(id);
+		if(p < replication_factor)
+		{
+			memcpy(_nodes[p].id, nodes[n].id, sizeof(_nodes[p].id));
+			// References in replies are only claims; they do not replace
+			// the one cached for the node.
+			_nodes[p].ref = ref_cache().intern(id, nodes[n].ref);
+			_has_endpoint[p] = false;
+			_hop[p]       = hop;
+		}
+	}
+}
+
+void Lookup::insert (
+	const seq_compact_node_ref_t &nodes,
+	unsigned hop )
+{
+	for(unsigned n = 0; n < nodes.length(); ++n)
+	{
+		unsigned p = place(Id(nodes[n].id));
+		if(p < replication_factor)
+		{
+			memcpy(_nodes[p].id, nodes[n].id, sizeof(_nodes[p].id));
+			_nodes[p].ref = Node::_nil();
+			_endpoint[p]  = nodes[n].endpoint;
+			_has_endpoint[p] = true;
+			_hop[p]       = hop;
+		}
+	}
+}
+
+unsigned Lookup::place (
+	const Id &node )
+{
+	// The shortlist is ordered by distance.
+	Id new_distance(node ^ _target);
+	unsigned p;
+	for(p = 0; p < _length; ++p)
+		if(_distance[p] == new_distance)
+			return replication_factor;	// node was already present!
+		else
+		if(_distance[p] > new_distance)
+			break;	// node p is farther away, insert here.
+	if(p == replication_factor)
+		return p;	// all nodes in the list are closer.
+
+	// Expand the list if it is not yet too large
+	if(_length < replication_factor)
+		++_length;
+
+	// Make room for the new entry...
+	for(unsigned m = _length - 1; m > p; --m)
+	{
+		_nodes       [m] = _nodes       [m-1];
+		_endpoint    [m] = _endpoint    [m-1];
+		_has_endpoint[m] = _has_endpoint[m-1];
+		_distance    [m] = _distance    [m-1];
+		_state       [m] = _state       [m-1];
+		_hop         [m] = _hop         [m-1];
+	}
+
+	// and claim it.
+	_distance[p] = new_distance;
+	_state   [p] = unqueried;
+	return p;
+}
+
+unsigned Lookup::next_hop (
+	unsigned p ) const
+{
+	// Nodes pushed off the shortlist take their hops along; assume the most.
+	return (p < _length ? _hop[p] : _hops) + 1;
+}
+
+void Lookup::resolve (
+	unsigned n )
+{
+	if(!CORBA::is_nil(_nodes[n].ref))
+		return;
+	Id id(_nodes[n].id);
+	_nodes[n].ref = ref_cache().find(id);
+	if(CORBA::is_nil(_nodes[n].ref))
+	{
+		Node_var node = node_at(_endpoint[n]);
+		_nodes[n].ref = ref_cache().intern(id, node);
+	}
+}
+
+void Lookup::failed (
+	const Id &node )
+{
+	complete(node, unreachable);
+}
+
+bool Lookup::finished( ) const
+{
+	if(_in_flight > 0)
+		return false;
+	if(_holders >= value_nodes)
+		return true;
+	for(unsigned n = 0; n < _length; ++n)
+		if(_state[n] == unqueried)
+			return false;
+	return true;
+}
+
+seq_node_ref_t *Lookup::nodes( )
+{
+	seq_node_ref_t_var result = new seq_node_ref_t(_length);
+	unsigned length = 0;
+	for(unsigned n = 0; n < _length; ++n)
+		if(_state[n] != unreachable)
+		{
+			resolve(n);
+			result->length(length + 1);
+			result[length++] = _nodes[n];
+		}
+	return result._retn();
+}
+
+const seq_value_t *Lookup::values( ) const
+{
+	return _values;
+}
+
+bool Lookup::miss (
+	node_ref_t &node,
+	unsigned &closer ) const
+{
+	if(!_missed)
+		return false;
+
+	closer = 0;
+	for(unsigned n = 0; n < _length; ++n)
+		if(_state[n] != unreachable && _distance[n] < _miss_distance)
+			++closer;
+	node = _miss;
+	return true;
+}
+
+unsigned Lookup::find (
+	const Id &node ) const
+{
+	Id distance(node ^ _target);
+	for(unsigned n = 0; n < _length; ++n)
+		if(_distance[n] == distance)
+			return n;
+	return _length;
+}
+
+unsigned Lookup::complete (
+	const Id &node,
+	state_t state )
+{
+	if(_in_flight > 0)
+		--_in_flight;
+
+	// The node may have been pushed off the shortlist by closer ones.
+	unsigned p = find(node);
+	if(p < _length && _state[p] == in_flight)
+	{
+		_state[p] = state;
+		if(state == answered)
+			_hops = std::max(_hops, _hop[p]);
+	}
+	return p;
+}
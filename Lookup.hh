@@ -0,0 +1,151 @@
+#ifndef LOOKUP_HH_INCLUDED
+#define LOOKUP_HH_INCLUDED
+
+#include "kademlia.hh"
+#include "Blob.hh"
+#include "Id.hh"
+
+#include <vector>
+
+/*
+	The state of an iterative lookup for the nodes closest to a target,
+	and optionally for the values stored there. The lookup does no calls
+	itself: the caller asks next() for nodes to query, and reports each
+	reply (or failure) back, in any order. This lets a single thread drive
+	many lookups at once, each costing only its shortlist of nodes.
+
+	At most concurrency_factor queries are handed out at a time. A value
+	lookup merges the values returned by different nodes, and stops issuing
+	queries once value_nodes nodes have returned values, so that a value
+	missing at one replica is still found at others.
+
+	Not synchronized; the owner must serialize calls.
+*/
+class Lookup
+{
+public:
+	// Number of nodes whose values a value lookup merges.
+	static const unsigned value_nodes = kademlia::replication_factor/5;
+
+	// The endpoints, if given, are those known of the initial nodes.
+	Lookup(
+		const Id &target,
+		const kademlia::seq_node_ref_t &initial,
+		bool find_value,
+		const kademlia::seq_compact_node_ref_t *endpoints = 0 );
+	~Lookup( );
+
+	const Id &target( ) const { return _target; }
+	bool find_value( ) const { return _find_value; }
+
+	// Sets node to the closest node not yet queried and returns true, or
+	// returns false if no query should be issued right now.
+	bool next(
+		kademlia::node_ref_t &node );
+
+	// Sets endpoint to the IPv4 endpoint of a node in the shortlist and
+	// returns true, or returns false if it is not known.
+	bool endpoint(
+		const Id &node,
+		kademlia::endpoint_t &endpoint ) const;
+
+	// Reports the reply of a queried node: the nodes it knows closest to
+	// the target and, for a value lookup, the values it has stored there. A
+	// node that has no values is a candidate for caching those found.
+	void replied(
+		const Id &node,
+		const kademlia::seq_node_ref_t &nodes,
+		const kademlia::seq_value_t *values = 0 );
+
+	// Reports a reply with compact node references; the references of these
+	// nodes are only built once they are queried or returned.
+	void replied(
+		const Id &node,
+		const kademlia::seq_compact_node_ref_t &nodes );
+
+	// Reports that a queried node did not reply; it is left out of the result.
+	void failed(
+		const Id &node );
+
+	// True when there is nothing left to query and no replies outstanding.
+	bool finished( ) const;
+
+	// Returns the closest nodes found, leaving out those that failed.
+	kademlia::seq_node_ref_t *nodes( );
+
+	// Returns the number of hops: the length of the longest chain of replies
+	// that led to a node that answered. Nodes in the initial list are one
+	// hop away.
+	unsigned hops( ) const { return _hops; }
+
+	// Returns the values found, without duplicates, if any; 0 otherwise.
+	const kademlia::seq_value_t *values( ) const;
+
+	// Sets node to the closest node that was asked for values but had none,
+	// and closer to the number of nodes in the shortlist closer to the
+	// target than it. Returns false if there is no such node.
+	bool miss(
+		kademlia::node_ref_t &node,
+		unsigned &closer ) const;
+
+private:
+	enum state_t { unqueried, in_flight, answered, unreachable };
+
+	Lookup(const Lookup &);
+	Lookup &operator=(const Lookup &);
+
+	// Returns the shortlist position of the node, or _length if absent.
+	unsigned find(
+		const Id &node ) const;
+
+	// Merges nodes into the shortlist, keeping the closest ones; new nodes
+	// are the given number of hops away.
+	void insert(
+		const kademlia::seq_node_ref_t &nodes,
+		unsigned hop );
+
+	void insert(
+		const kademlia::seq_compact_node_ref_t &nodes,
+		unsigned hop );
+
+	// Makes room in the shortlist for a node not yet in it and returns its
+	// position, or replication_factor if the node does not belong there.
+	unsigned place(
+		const Id &node );
+
+	// Returns the number of hops away the nodes in the reply of the node at
+	// position p are.
+	unsigned next_hop(
+		unsigned p ) const;
+
+	// Builds the reference of the node at position n, if it has none yet.
+	void resolve(
+		unsigned n );
+
+	// Marks an in-flight query as answered with the given state.
+	unsigned complete(
+		const Id &node,
+		state_t state );
+
+	Id                   _target;
+	bool                 _find_value;
+	unsigned             _length, _in_flight, _hops;
+	kademlia::node_ref_t _nodes   [kademlia::replication_factor];
+	kademlia::endpoint_t _endpoint[kademlia::replication_factor];
+	bool                 _has_endpoint[kademlia::replication_factor];
+	Id                   _distance[kademlia::replication_factor];
+	state_t              _state   [kademlia::replication_factor];
+	unsigned             _hop     [kademlia::replication_factor];
+
+	kademlia::seq_value_t *_values;
+	std::vector<Blob>      _blobs;		// encodings of _values, to compare them
+	unsigned               _holders;	// nodes that returned values
+
+	// The closest node that was queried for values that did not have any.
+	kademlia::node_ref_t _miss;
+	Id                   _miss_distance;
+	bool                 _missed;
+
+}; // class Lookup
+
+#endif //ndef LOOKUP_HH_INCLUDED
@@ -0,0 +1,299 @@
+#include "Metrics.hh"
+
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <sstream>
+
+#ifdef __WIN32__
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+static void atomic_add(volatile unsigned long *value, unsigned long n)
+{
+	InterlockedExchangeAdd(reinterpret_cast<volatile LONG*>(value), n);
+}
+
+#else
+
+static void atomic_add(volatile unsigned long *value, unsigned long n)
+{
+	__sync_fetch_and_add(value, n);
+}
+
+#endif
+
+
+void Counter::add(
+	unsigned long n )
+{
+	atomic_add(&_value, n);
+}
+
+
+Histogram::Histogram( ) :
+	_sum(0)
+{
+	for(unsigned n = 0; n < buckets_size; ++n)
+		_counts[n] = 0;
+}
+
+void Histogram::record(
+	unsigned long long value )
+{
+	const unsigned long max_value = 0xffffffffUL;
+	unsigned long v = value < max_value ? static_cast<unsigned long>(value) : max_value;
+	atomic_add(&_counts[bucket(v)], 1);
+	atomic_add(&_sum, v);
+}
+
+unsigned long Histogram::count( ) const
+{
+	unsigned long total = 0;
+	for(unsigned n = 0; n < buckets_size; ++n)
+		total += _counts[n];
+	return total;
+}
+
+unsigned long Histogram::quantile(
+	double fraction ) const
+{
+	// Values may be recorded meanwhile; rank them against the counts seen.
+	unsigned long counts[buckets_size], total = 0;
+	for(unsigned n = 0; n < buckets_size; ++n)
+		total += counts[n] = _counts[n];
+	if(total == 0)
+		return 0;
+
+	unsigned long rank = static_cast<unsigned long>(std::ceil(fraction*total)), seen = 0;
+	for(unsigned n = 0; n < buckets_size; ++n)
+	{
+		seen += counts[n];
+		if(seen >= rank && seen > 0)
+			return highest(n);
+	}
+	return highest(buckets_size - 1);
+}
+
+unsigned Histogram::bucket(
+	unsigned long value )
+{
+	if(value < 2*sub_buckets)
+		return value;
+
+	// The most significant bit selects the power of two, and the bits
+	// below it the bucket within.
+	unsigned bits = 0;
+	while(value >> (bits + 1))
+		++bits;
+	return (bits - sub_bucket_bits + 1)*sub_buckets +
+		((value >> (bits - sub_bucket_bits)) & (sub_buckets - 1));
+}
+
+unsigned long Histogram::highest(
+	unsigned bucket )
+{
+	if(bucket < 2*sub_buckets)
+		return bucket;
+	unsigned shift = bucket/sub_buckets - 1;
+	unsigned long first = (sub_buckets + bucket%sub_buckets) << shift;
+	return first + ((1UL << shift) - 1);
+}
+
+
+struct OpName
+{
+	const char *interface, *op;
+};
+
+static const OpName op_names[Metrics::ops_size] = {
+	{ "Node",   "ping" },
+	{ "Node",   "store" },
+	{ "Node",   "store_batch" },
+	{ "Node",   "retrieve" },
+	{ "Node",   "find_nodes" },
+	{ "Node",   "find_nodes_compact" },
+	{ "Node",   "find_value" },
+	{ "Node",   "cache" },
+	{ "Node",   "contacts_page" },
+	{ "Node",   "data_page" },
+	{ "udp",    "ping" },
+	{ "udp",    "find_nodes" },
+	{ "Broker", "store" },
+	{ "Broker", "erase" },
+	{ "Broker", "retrieve" },
+	{ "Broker", "drain" } };
+
+static std::string op_labels(unsigned op)
+{
+	return std::string("interface=\"") + op_names[op].interface +
+		"\",op=\"" + op_names[op].op + "\"";
+}
+
+struct Quantile
+{
+	double      fraction;
+	const char *label;
+};
+
+static const Quantile quantiles[] = {
+	{ 0.5,   "0.5" },
+	{ 0.9,   "0.9" },
+	{ 0.99,  "0.99" },
+	{ 0.999, "0.999" } };
+
+Metrics::Call::Call(
+	Metrics &metrics,
+	op_t op ) :
+	_metrics(metrics),
+	_op(op),
+	_start(precise_now())
+{
+}
+
+Metrics::Call::~Call( )
+{
+	_metrics.called(_op, precise_now() - _start, std::uncaught_exception());
+}
+
+Metrics::Metrics( ) :
+	_failing(failure_counters)
+{
+}
+
+void Metrics::called(
+	op_t op,
+	ustime_t latency,
+	bool failed )
+{
+	_calls[op].add();
+	if(failed)
+		_failures[op].add();
+	_latency[op].record(latency);
+}
+
+void Metrics::lookup(
+	unsigned hops )
+{
+	_hops.record(hops);
+}
+
+void Metrics::contact_failed(
+	const Id &id,
+	bool shed )
+{
+	if(shed)
+	{
+		_contact_shed.add();
+		return;
+	}
+	_contact_failures.add();
+	omni_mutex_lock l(_mutex);
+	_failing.hit(id);
+}
+
+void Metrics::pinged(
+	ustime_t duration )
+{
+	_ping.record(duration);
+}
+
+void Metrics::purged(
+	ustime_t duration,
+	unsigned entries )
+{
+	_purge.record(duration);
+	_purged.add(entries);
+}
+
+void Metrics::collect(
+	std::vector<Sample> &samples )
+{
+	for(unsigned op = 0; op < ops_size; ++op)
+		add_sample(samples, "kademlia_calls_total", "counter", "", op_labels(op), _calls[op].value());
+	for(unsigned op = 0; op < ops_size; ++op)
+		add_sample(samples, "kademlia_call_failures_total", "counter", "", op_labels(op), _failures[op].value());
+	for(unsigned op = 0; op < ops_size; ++op)
+		add_summary(samples, "kademlia_call_seconds", op_labels(op), _latency[op], 1e-6);
+
+	add_summary(samples, "kademlia_lookup_hops", "", _hops, 1);
+	add_summary(samples, "kademlia_ping_seconds", "", _ping, 1e-6);
+	add_summary(samples, "kademlia_purge_seconds", "", _purge, 1e-6);
+	add_sample(samples, "kademlia_purged_entries_total", "counter", "", "", _purged.value());
+	add_sample(samples, "kademlia_contact_failures_total", "counter", "", "", _contact_failures.value());
+	add_sample(samples, "kademlia_contact_shed_total", "counter", "", "", _contact_shed.value());
+
+	std::vector<HotKeys::Item> failing;
+	{
+		omni_mutex_lock l(_mutex);
+		_failing.top(max_failing_contacts, failing);
+	}
+	for(size_t n = 0; n < failing.size(); ++n)
+		add_sample( samples, "kademlia_failing_contact_calls", "gauge", "",
+			"node=\"" + failing[n].index.str() + "\"", failing[n].count );
+}
+
+void Metrics::add_sample(
+	std::vector<Sample> &samples,
+	const char *family,
+	const char *type,
+	const std::string &suffix,
+	const std::string &labels,
+	double value )
+{
+	Sample sample;
+	sample.family = family;
+	sample.type   = type;
+	sample.name   = family + suffix;
+	if(!labels.empty())
+		sample.name += "{" + labels + "}";
+	sample.value  = value;
+	samples.push_back(sample);
+}
+
+void Metrics::add_summary(
+	std::vector<Sample> &samples,
+	const char *family,
+	const std::string &labels,
+	const Histogram &histogram,
+	double scale )
+{
+	const std::string separator = labels.empty() ? "" : ",";
+	for(size_t n = 0; n < sizeof(quantiles)/sizeof(*quantiles); ++n)
+		add_sample( samples, family, "summary", "",
+			labels + separator + "quantile=\"" + quantiles[n].label + "\"",
+			histogram.quantile(quantiles[n].fraction)*scale );
+	add_sample(samples, family, "summary", "_sum", labels, histogram.sum()*scale);
+	add_sample(samples, family, "summary", "_count", labels, histogram.count());
+}
+
+std::string prometheus_text(
+	const std::vector<Metrics::Sample> &samples )
+{
+	std::ostringstream os;
+	os.precision(15);
+	const char *family = 0;
+	for(size_t n = 0; n < samples.size(); ++n)
+	{
+		if(!family || strcmp(family, samples[n].family) != 0)
+		{
+			family = samples[n].family;
+			os << "# TYPE " << family << ' ' << samples[n].type << '\n';
+		}
+		os << samples[n].name << ' ' << samples[n].value << '\n';
+	}
+	return os.str();
+}
+
+static omni_mutex  metrics_mutex;
+static Metrics    *metrics_instance = 0;
+
+Metrics &metrics( )
+{
+	// Never destroyed, so that it outlives every thread that records metrics.
+	omni_mutex_lock l(metrics_mutex);
+	if(!metrics_instance)
+		metrics_instance = new Metrics();
+	return *metrics_instance;
+}
@@ -0,0 +1,195 @@
+#ifndef METRICS_HH_INCLUDED
+#define METRICS_HH_INCLUDED
+
+#include "HotKeys.hh"
+#include "Id.hh"
+#include "time.hh"
+
+#include <omnithread.h>
+#include <string>
+#include <vector>
+
+/*
+	A counter that can be incremented from any thread without locking.
+*/
+class Counter
+{
+public:
+	Counter( ) : _value(0) { }
+
+	void add(
+		unsigned long n = 1 );
+
+	unsigned long value( ) const { return _value; }
+
+private:
+	volatile unsigned long _value;
+
+}; // class Counter
+
+/*
+	A histogram of values that can be recorded from any thread without
+	locking. Like HdrHistogram, it keeps log-linear buckets: every power of
+	two is split into sub_buckets buckets of equal width, so that a quantile
+	is off by at most 1/sub_buckets (12.5%) of its value, in a fixed amount of
+	memory. Values below 2*sub_buckets are counted exactly; values of 2^32 and
+	up are counted as 2^32 - 1.
+*/
+class Histogram
+{
+public:
+	static const unsigned sub_bucket_bits = 3;
+	static const unsigned sub_buckets     = 1 << sub_bucket_bits;
+	static const unsigned buckets_size    = (32 - sub_bucket_bits + 1)*sub_buckets;
+
+	Histogram( );
+
+	void record(
+		unsigned long long value );
+
+	unsigned long count( ) const;
+
+	// Returns the sum of all values recorded; wraps around when it exceeds
+	// the range of an unsigned long.
+	unsigned long sum( ) const { return _sum; }
+
+	// Returns the value that at least the given fraction of the recorded
+	// values do not exceed, rounded up to the end of its bucket.
+	unsigned long quantile(
+		double fraction ) const;
+
+private:
+	static unsigned bucket(
+		unsigned long value );
+
+	// Returns the largest value counted in the given bucket.
+	static unsigned long highest(
+		unsigned bucket );
+
+	volatile unsigned long _counts[buckets_size];
+	volatile unsigned long _sum;
+
+}; // class Histogram
+
+/*
+	The metrics of the Kademlia service: call counts and latencies of the
+	Node and Broker operations, lookup hop counts, failed calls to contacts,
+	and the durations of pings and purges. Metrics are updated without
+	locking, except for the failures per contact, which are rare.
+
+	Metrics are reported as samples named as in the Prometheus text
+	exposition format; prometheus_text() formats them as such.
+*/
+class Metrics
+{
+public:
+
+	enum op_t
+	{
+		node_ping, node_store, node_store_batch, node_retrieve,
+		node_find_nodes, node_find_nodes_compact, node_find_value,
+		node_cache, node_contacts_page, node_data_page,
+		udp_ping, udp_find_nodes,
+		broker_store, broker_erase, broker_retrieve, broker_drain,
+		ops_size
+	};
+
+	struct Sample
+	{
+		const char  *family;	// metric name without suffix and labels
+		const char  *type;	// counter, gauge or summary
+		std::string  name;	// sample name, including suffix and labels
+		double       value;
+	};
+
+	// Times a call to an operation, from construction to destruction. A
+	// call left by an exception is counted as failed.
+	class Call
+	{
+	public:
+		Call(
+			Metrics &metrics,
+			op_t op );
+
+		~Call( );
+
+	private:
+		Metrics  &_metrics;
+		op_t      _op;
+		ustime_t  _start;
+	};
+
+	// Number of contacts whose failures are reported.
+	static const unsigned max_failing_contacts = 16;
+
+	Metrics( );
+
+	void called(
+		op_t op,
+		ustime_t latency,
+		bool failed );
+
+	// Records the number of hops a finished lookup took.
+	void lookup(
+		unsigned hops );
+
+	// Records a failed call to a contact; calls refused by live nodes (shed
+	// or otherwise) are counted apart.
+	void contact_failed(
+		const Id &id,
+		bool shed );
+
+	void pinged(
+		ustime_t duration );
+
+	void purged(
+		ustime_t duration,
+		unsigned entries );
+
+	// Appends samples of all metrics to the vector.
+	void collect(
+		std::vector<Sample> &samples );
+
+	// Appends a sample; labels, if any, are given as e.g. op="ping".
+	static void add_sample(
+		std::vector<Sample> &samples,
+		const char *family,
+		const char *type,
+		const std::string &suffix,
+		const std::string &labels,
+		double value );
+
+private:
+	static const unsigned failure_counters = 4*max_failing_contacts;
+
+	Metrics(const Metrics &);
+	Metrics &operator=(const Metrics &);
+
+	// Appends the samples of a summary; recorded values are multiplied by
+	// scale, e.g. to report microseconds as seconds.
+	static void add_summary(
+		std::vector<Sample> &samples,
+		const char *family,
+		const std::string &labels,
+		const Histogram &histogram,
+		double scale );
+
+	Counter   _calls[ops_size], _failures[ops_size];
+	Histogram _latency[ops_size];
+	Histogram _hops, _ping, _purge;
+	Counter   _purged, _contact_failures, _contact_shed;
+
+	omni_mutex _mutex;
+	HotKeys    _failing;	// failures per contact
+
+}; // class Metrics
+
+// Returns the process-wide metrics.
+Metrics &metrics();
+
+// Formats samples in the Prometheus text exposition format. The samples of
+// a metric family must be adjacent.
+std::string prometheus_text(
+	const std::vector<Metrics::Sample> &samples );
+
+#endif //ndef METRICS_HH_INCLUDED
@@ -2,20 +2,53 @@
 #include "Broker.hh"
 using namespace kademlia;
 
+#include "RefCache.hh"
+#include "endpoint.hh"
 #include "logging.hh"
+#include "parallel.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
 
 extern CORBA::ORB_var orb;
 
+mstime_t Node_impl::hot_key_task(void *node)
+{
+	static_cast<Node_impl*>(node)->replicate_hot_keys();
+	return now() + hot_key_window;
+}
+
+mstime_t Node_impl::metrics_task(void *node)
+{
+	static_cast<Node_impl*>(node)->write_metrics();
+	return now() + metrics_interval;
+}
+
 Node_impl::Node_impl() :
     _id(Id::random()), 
+    _dt(_id),
     _ct(_id, *this),
-    _startup_time(time(NULL))
+    _startup_time(now()),
+    _durable_lifetime(~mstime_t(0)),
+    _compact_refs(false),
+    _metrics(metrics()),
+    _draining(false),
+    _hot_key_rate(default_hot_key_rate),
+    _metrics_task(0),
+    _broker(0),
+    _udp(0)
 {
 	trace(10) << "Node_impl::Node_impl(): initialized node with ID " << _id << endm;
+	_hot_key_task = scheduler().schedule(now() + hot_key_window, hot_key_task, this);
 }
 
 Node_impl::~Node_impl()
 {
+	delete _udp;
+	scheduler().cancel(_hot_key_task);
+	scheduler().cancel(_metrics_task);
 }
 
 id_t_slice* Node_impl::ping(
@@ -23,6 +56,9 @@ id_t_slice* Node_impl::ping(
 {
 	trace(20) << "Node_impl::ping()" <<
 			     "\n\tCaller=" << Id(caller.id).str() << endm;
+    Metrics::Call timer(_metrics, Metrics::node_ping);
+    AdmissionControl::Call call(_admission, caller.id, AdmissionControl::op_routing);
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::maintenance);
     update(caller);
     return id_t_dup(_id);
 }
@@ -36,8 +72,38 @@ void Node_impl::store(
 			  << "\n\t  Caller=" << Id(caller.id).str()
               << "\n\t   Index=" << Id(index).str()
               << "\n\tLifetime=" << value.lifetime/1000.0 << endm;
+    Metrics::Call timer(_metrics, Metrics::node_store);
+    AdmissionControl::Call call(_admission, caller.id, AdmissionControl::op_write);
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::data);
     update(caller);
-    _dt.store(index, value.contents, value.lifetime);
+    if(draining())
+        throw CORBA::TRANSIENT(AdmissionControl::drain_minor, CORBA::COMPLETED_NO);
+    if(!_dt.store(index, value.contents, value.lifetime, value.lifetime >= _durable_lifetime))
+        throw CORBA::TRANSIENT(AdmissionControl::full_minor, CORBA::COMPLETED_NO);
+}
+
+void Node_impl::store_batch(
+    const node_ref_t& caller,
+    const seq_entry_t& entries )
+{
+	trace(20) << "Node_impl()::store_batch()\n"
+			  << "\n\t  Caller=" << Id(caller.id).str()
+              << "\n\t Entries=" << entries.length() << endm;
+    Metrics::Call timer(_metrics, Metrics::node_store_batch);
+    AdmissionControl::Call call(_admission, caller.id, AdmissionControl::op_write, entries.length());
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::data);
+    update(caller);
+    if(draining())
+        throw CORBA::TRANSIENT(AdmissionControl::drain_minor, CORBA::COMPLETED_NO);
+    bool stored = true;
+    for(unsigned n = 0; n < entries.length(); ++n)
+    {
+        const value_t &value = entries[n].value;
+        if(!_dt.store(entries[n].index, value.contents, value.lifetime, value.lifetime >= _durable_lifetime))
+            stored = false;
+    }
+    if(!stored)
+        throw CORBA::TRANSIENT(AdmissionControl::full_minor, CORBA::COMPLETED_NO);
 }
 
 seq_value_t* Node_impl::retrieve(
@@ -47,6 +113,9 @@ seq_value_t* Node_impl::retrieve(
     trace(20) << "Node_impl()::retrieve()"
 			  << "\n\t  Caller=" << Id(caller.id).str()
               << "\n\t   Index=" << Id(index).str() << endm;
+    Metrics::Call timer(_metrics, Metrics::node_retrieve);
+    AdmissionControl::Call call(_admission, caller.id, AdmissionControl::op_read);
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::data);
     update(caller);
     return _dt.retrieve(index);
 }
@@ -58,60 +127,352 @@ seq_node_ref_t* Node_impl::find_nodes(
     trace(20) << "Node_impl()::find_nodes()"
 			  << "\n\t  Caller=" << Id(caller.id).str()
               << "\n\t  Target=" << Id(target).str() << endm;
+    Metrics::Call timer(_metrics, Metrics::node_find_nodes);
+    AdmissionControl::Call call(_admission, caller.id, AdmissionControl::op_routing);
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::routing);
     update(caller);
     return _ct.retrieve(Id(target));
 }
 
+seq_compact_node_ref_t* Node_impl::find_nodes_compact(
+    const node_ref_t& caller,
+    const kademlia::id_t target )
+{
+    trace(20) << "Node_impl()::find_nodes_compact()"
+			  << "\n\t  Caller=" << Id(caller.id).str()
+              << "\n\t  Target=" << Id(target).str() << endm;
+    Metrics::Call timer(_metrics, Metrics::node_find_nodes_compact);
+    AdmissionControl::Call call(_admission, caller.id, AdmissionControl::op_routing);
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::routing);
+    update(caller);
+    return _ct.retrieve_compact(Id(target));
+}
+
+seq_value_t* Node_impl::find_value(
+    const node_ref_t& caller,
+    const kademlia::id_t index,
+    seq_node_ref_t_out nodes )
+{
+    trace(20) << "Node_impl()::find_value()"
+			  << "\n\t  Caller=" << Id(caller.id).str()
+              << "\n\t   Index=" << Id(index).str() << endm;
+    Metrics::Call timer(_metrics, Metrics::node_find_value);
+    AdmissionControl::Call call(_admission, caller.id, AdmissionControl::op_read);
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::routing);
+    update(caller);
+    // Nodes are returned along with values, for lookups that merge the
+    // values of several nodes.
+    seq_value_t_var values = _dt.retrieve(index);
+    nodes = _ct.retrieve(Id(index));
+    return values._retn();
+}
+
+void Node_impl::cache(
+    const node_ref_t& caller,
+    const kademlia::id_t index,
+    const seq_value_t& values )
+{
+    trace(20) << "Node_impl()::cache()"
+			  << "\n\t  Caller=" << Id(caller.id).str()
+              << "\n\t   Index=" << Id(index).str() << endm;
+    Metrics::Call timer(_metrics, Metrics::node_cache);
+    AdmissionControl::Call call(_admission, caller.id, AdmissionControl::op_write, values.length());
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::data);
+    update(caller);
+    if(draining())
+        return;
+    for(unsigned n = 0; n < values.length(); ++n)
+        _dt.cache(index, values[n].contents, values[n].lifetime);
+}
+
 void Node_impl::update(const node_ref_t &caller)
 {
     _ct.insert(Id(caller.id), caller.ref, true);
 }
 
+// The transport only passes on requests from verified senders, so the
+// endpoint is known to belong to the caller.
+void Node_impl::update(const compact_node_ref_t &caller)
+{
+    Id id(caller.id);
+    Node_var node = ref_cache().find(id);
+    if(CORBA::is_nil(node))
+        node = node_at(caller.endpoint);
+    _ct.insert(id, node, true);
+}
+
+void Node_impl::handle_ping(
+    const compact_node_ref_t& caller )
+{
+	trace(20) << "Node_impl::handle_ping()" <<
+			     "\n\tCaller=" << Id(caller.id).str() << endm;
+    // The receiver thread must not wait for a worker; drop the ping instead.
+    Metrics::Call timer(_metrics, Metrics::udp_ping);
+    AdmissionControl::Call call(_admission, caller.id, AdmissionControl::op_routing);
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::maintenance, false);
+    update(caller);
+}
+
+seq_compact_node_ref_t* Node_impl::handle_find_nodes(
+    const compact_node_ref_t& caller,
+    const Id& target )
+{
+    trace(20) << "Node_impl()::handle_find_nodes()"
+			  << "\n\t  Caller=" << Id(caller.id).str()
+              << "\n\t  Target=" << target.str() << endm;
+    Metrics::Call timer(_metrics, Metrics::udp_find_nodes);
+    AdmissionControl::Call call(_admission, caller.id, AdmissionControl::op_routing);
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::routing, false);
+    update(caller);
+    return _ct.retrieve_compact(target);
+}
+
 seq_node_ref_t* Node_impl::contacts( )
 {
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::maintenance);
     return _ct.contents();
 }
     
 seq_entry_t* Node_impl::data( )
 {
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::maintenance);
     return _dt.contents();
 }    
 
+seq_node_ref_t* Node_impl::contacts_page(
+    const kademlia::id_t cursor,
+    CORBA::ULong max,
+    kademlia::id_t next,
+    CORBA::Boolean& more )
+{
+    Metrics::Call timer(_metrics, Metrics::node_contacts_page);
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::maintenance);
+    Id next_id;
+    bool more_contacts;
+    seq_node_ref_t_var result = _ct.page( Id(cursor),
+        std::max<CORBA::ULong>(1, std::min<CORBA::ULong>(max, replication_factor)),
+        next_id, more_contacts );
+    memcpy(next, next_id, sizeof(kademlia::id_t));
+    more = more_contacts;
+    return result._retn();
+}
+
+seq_entry_t* Node_impl::data_page(
+    const kademlia::id_t cursor,
+    CORBA::ULong max,
+    kademlia::id_t next,
+    CORBA::Boolean& more )
+{
+    Metrics::Call timer(_metrics, Metrics::node_data_page);
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::maintenance);
+    Id next_id;
+    bool more_entries;
+    seq_entry_t_var result = _dt.page( Id(cursor),
+        std::max<CORBA::ULong>(1, std::min<CORBA::ULong>(max, max_data_page)),
+        next_id, more_entries );
+    memcpy(next, next_id, sizeof(kademlia::id_t));
+    more = more_entries;
+    return result._retn();
+}
+
+seq_hot_key_t* Node_impl::hot_keys( )
+{
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::maintenance);
+    std::vector<HotKeys::Item> items;
+    _dt.hot_keys(max_hot_keys, items);
+    seq_hot_key_t_var result = new seq_hot_key_t(items.size());
+    result->length(items.size());
+    for(unsigned n = 0; n < items.size(); ++n)
+    {
+        memcpy(result[n].index, items[n].index, sizeof(result[n].index));
+        result[n].rate = read_rate(items[n].count);
+    }
+    return result._retn();
+}
+
+seq_stat_t* Node_impl::stats( )
+{
+    Dispatcher::Slot slot(_dispatcher, Dispatcher::maintenance);
+    std::vector<Metrics::Sample> samples;
+    collect(samples);
+    seq_stat_t_var result = new seq_stat_t(samples.size());
+    result->length(samples.size());
+    for(unsigned n = 0; n < samples.size(); ++n)
+    {
+        result[n].name  = CORBA::string_dup(samples[n].name.c_str());
+        result[n].value = samples[n].value;
+    }
+    return result._retn();
+}
+
 CORBA::ULong Node_impl::age( )
 {
-    return static_cast<CORBA::ULong>( time(NULL) - _startup_time );
+    return static_cast<CORBA::ULong>( (now() - _startup_time)/1000 );
 }
 
 kademlia::node_ref_t Node_impl::reference( )
 {
 	kademlia::node_ref_t result;
 	memcpy(result.id, _id, sizeof(result.id));
-	result.ref = _this();
+	if(CORBA::is_nil(_advertised))
+		result.ref = _this();
+	else
+		result.ref = kademlia::Node::_duplicate(_advertised);
 	return result;
 }
 
-bool Node_impl::add_initial_contact(const char *ior)
+void Node_impl::advertise( kademlia::Node_ptr ref )
+{
+	_advertised = kademlia::Node::_duplicate(ref);
+}
+
+bool Node_impl::add_initial_contact(kademlia::Node_ptr node)
 {
-	info() << "Initial contact: " << ior << endm;
 	try
 	{
-		CORBA::Object_var  obj  = orb->string_to_object(ior);
-		kademlia::Node_var node = kademlia::Node::_narrow(obj);
-		kademlia::id_t_var id   = node->ping(reference());
-		_ct.insert(Id(id), node, true);
-	    trace(20) << "Node_impl::add_initial_contact(): added contact with IOR\n"
-			<< ior << endm;
+		mstime_t start = now();
+		kademlia::id_t_var id = node->ping(reference());
+		_ct.insert(Id(id), node, true, now() - start);
 		return true;
 	}
 	catch(const CORBA::Exception &)
 	{
-        trace(20) << "Node_impl::add_initial_contact(): failed to add contact with IOR " << ior << endm;
-        return false;
+		return false;
 	}
 }
 
+struct PingWork
+{
+	Node_impl                             *node;
+	const std::vector<kademlia::Node_var> *nodes;
+	omni_mutex                             mutex;
+	unsigned                               responded;
+};
+
+static void ping_task(size_t n, void *arg)
+{
+	PingWork &work = *static_cast<PingWork*>(arg);
+	if(work.node->add_initial_contact((*work.nodes)[n]))
+	{
+		omni_mutex_lock l(work.mutex);
+		++work.responded;
+	}
+}
+
+unsigned Node_impl::add_initial_contacts(const std::vector<kademlia::Node_var> &nodes)
+{
+	PingWork work;
+	work.node      = this;
+	work.nodes     = &nodes;
+	work.responded = 0;
+	run_parallel(nodes.size(), ping_task, &work, max_parallel_calls);
+	return work.responded;
+}
+
+unsigned Node_impl::add_initial_contacts(const std::vector<std::string> &iors)
+{
+	std::vector<kademlia::Node_var> nodes;
+	for(size_t n = 0; n < iors.size(); ++n)
+	{
+		info() << "Initial contact: " << iors[n] << endm;
+		try
+		{
+			CORBA::Object_var obj = orb->string_to_object(iors[n].c_str());
+			nodes.push_back(kademlia::Node::_narrow(obj));
+		}
+		catch(const CORBA::Exception &)
+		{
+			trace(20) << "Node_impl::add_initial_contacts(): invalid IOR " << iors[n] << endm;
+		}
+	}
+	return add_initial_contacts(nodes);
+}
+
+unsigned Node_impl::open_contacts_file(const char *path)
+{
+	_contacts_path = path;
+	_ct.persist(path);
+
+	std::vector<ContactTable::SavedContact> saved;
+	if(!ContactTable::load(path, saved))
+		return 0;
+
+	std::vector<kademlia::Node_var> nodes;
+	for(size_t n = 0; n < saved.size(); ++n)
+	{
+		try
+		{
+			CORBA::Object_var obj = orb->string_to_object(saved[n].ior.c_str());
+			nodes.push_back(kademlia::Node::_narrow(obj));
+		}
+		catch(const CORBA::Exception &)
+		{
+		}
+	}
+	unsigned restored = add_initial_contacts(nodes);
+	info() << "Restored " << restored << " of " << saved.size() <<
+		" contacts saved in " << path << endm;
+	return restored;
+}
+
+void Node_impl::save_contacts( )
+{
+	if(!_contacts_path.empty())
+		_ct.save(_contacts_path);
+}
+
+void Node_impl::collect( std::vector<Metrics::Sample> &samples )
+{
+	_metrics.collect(samples);
+	Metrics::add_sample(samples, "kademlia_age_seconds", "gauge", "", "", (now() - _startup_time)/1000.0);
+	Metrics::add_sample(samples, "kademlia_contacts", "gauge", "", "", _ct.size());
+	Metrics::add_sample(samples, "kademlia_node_refs", "gauge", "", "", ref_cache().size());
+	Metrics::add_sample(samples, "kademlia_data_entries", "gauge", "", "", _dt.size());
+	Metrics::add_sample(samples, "kademlia_data_bytes", "gauge", "", "", _dt.bytes());
+	Metrics::add_sample(samples, "kademlia_evicted_entries_total", "counter", "", "", _dt.evicted());
+
+	std::vector<HotKeys::Item> items;
+	_dt.hot_keys(max_hot_keys, items);
+	for(size_t n = 0; n < items.size(); ++n)
+		Metrics::add_sample( samples, "kademlia_hot_key_reads_per_minute", "gauge", "",
+			"index=\"" + items[n].index.str() + "\"", read_rate(items[n].count) );
+}
+
+bool Node_impl::open_metrics_file(const char *path)
+{
+	_metrics_path = path;
+	if(!write_metrics())
+		return false;
+	_metrics_task = scheduler().schedule(now() + metrics_interval, metrics_task, this);
+	return true;
+}
+
+bool Node_impl::write_metrics( )
+{
+	std::vector<Metrics::Sample> samples;
+	collect(samples);
+
+	// Replace the file as a whole, so that readers never see part of it.
+	const std::string temp_path = _metrics_path + ".tmp";
+	std::ofstream out(temp_path.c_str());
+	out << prometheus_text(samples);
+	out.close();
+
+#ifdef __WIN32__
+	std::remove(_metrics_path.c_str());
+#endif
+	if(!out || std::rename(temp_path.c_str(), _metrics_path.c_str()) != 0)
+	{
+		error() << "Node_impl: failed to write " << _metrics_path << endm;
+		std::remove(temp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
 bool Node_impl::initialize( Broker_impl &broker )
 {
+    _broker = &broker;
     seq_node_ref_t_var nodes = broker.find_nodes(_id);
     if(nodes->length() == 0)
         return false;
@@ -121,5 +482,383 @@ bool Node_impl::initialize( Broker_impl &broker )
         info() << "Added neighbour node ID " << node_id << endm;
 	    _ct.insert(node_id, nodes[n].ref);
     }
+
+    // Refresh the buckets farther away than our closest neighbour, by looking
+    // up a random ID in each of them. If there are many, refresh a spread.
+    unsigned first = (_id ^ Id(nodes[0].id)).bitscan() + 1, count = 0;
+    if(first < ContactTable::buckets_size)
+        count = ContactTable::buckets_size - first;
+    unsigned step = (count + max_refresh_buckets - 1)/max_refresh_buckets;
+    std::vector<Id> targets;
+    for(unsigned b = first; b < ContactTable::buckets_size; b += step)
+        targets.push_back(_ct.random_id(b));
+    broker.find_nodes_parallel(targets);
+    info() << "Refreshed " << targets.size() << " buckets" << endm;
+    return true;
+}
+
+struct HandoffWork
+{
+	Node_impl                                                *node;
+	const std::vector< std::pair<Id, kademlia::Node_var> > *nodes;
+};
+
+static void handoff_task(size_t n, void *arg)
+{
+	HandoffWork &work = *static_cast<HandoffWork*>(arg);
+	work.node->handoff((*work.nodes)[n].first, (*work.nodes)[n].second);
+}
+
+void Node_impl::handoff( const std::vector< std::pair<Id, kademlia::Node_var> > &nodes )
+{
+	HandoffWork work;
+	work.node  = this;
+	work.nodes = &nodes;
+	run_parallel(nodes.size(), handoff_task, &work, max_parallel_calls);
+}
+
+void Node_impl::handoff( const Id &id, kademlia::Node_ptr node )
+{
+	if(id == _id)
+		return;
+
+	// The new node can only be among the closest nodes for indices that share
+	// at least as long a prefix with its ID as the farthest of the nodes
+	// closest to it that we know of. This is a heuristic, since the nodes
+	// closest to an index are not those closest to the new node; entries just
+	// outside the range reach the new node when they are republished.
+	seq_node_ref_t_var closest = _ct.retrieve(id);
+	unsigned bits = Id::bits;
+	if(closest->length() >= replication_factor)
+		bits = (id ^ Id(closest[closest->length() - 1].id)).bitscan();
+	Id low = id, high = id;
+	for(unsigned b = 0; b < bits; ++b)
+	{
+		low.set(b, false);
+		high.set(b, true);
+	}
+
+	// Select the entries for which the new node is now among the closest.
+	seq_entry_t_var candidates = _dt.range(low, high);
+	seq_entry_t_var batch = new seq_entry_t(candidates->length());
+	for(unsigned n = 0; n < candidates->length(); ++n)
+	{
+		Id index(candidates[n].index);
+		if(n == 0 || index != Id(candidates[n - 1].index))
+			closest = _ct.retrieve(index);
+		for(unsigned m = 0; m < closest->length(); ++m)
+			if(Id(closest[m].id) == id)
+			{
+				unsigned len = batch->length();
+				batch->length(len + 1);
+				batch[len] = candidates[n];
+				break;
+			}
+	}
+	if(batch->length() == 0)
+		return;
+
+	// Send the entries in batches, like drain() does, so that a large range
+	// does not make for a single huge call.
+	trace(20) << "Node_impl::handoff(): handing " << batch->length() <<
+		" entries over to node ID " << id << endm;
+	for(unsigned first = 0; first < batch->length(); first += max_drain_batch)
+	{
+		unsigned last = std::min<unsigned>(first + max_drain_batch, batch->length());
+		seq_entry_t part(last - first);
+		part.length(last - first);
+		for(unsigned n = first; n < last; ++n)
+			part[n - first] = batch[n];
+		try
+		{
+			node->store_batch(reference(), part);
+		}
+		catch(const CORBA::Exception &)
+		{
+			trace(20) << "Node_impl::handoff(): failed to hand entries over to node ID " << id << endm;
+			break;
+		}
+	}
+}
+
+struct DrainTarget
+{
+	Id                    id;
+	kademlia::Node_var    ref;
+	std::vector<unsigned> entries;
+};
+
+struct DrainWork
+{
+	Node_impl                                    *node;
+	const seq_entry_t                            *entries;
+	std::vector<DrainTarget>                      targets;
+	std::vector< std::pair<size_t, size_t> >      batches;
+	mstime_t                                      deadline;
+	omni_mutex                                    mutex;
+	unsigned long                                 sent;
+};
+
+// Returns a reference to the same node that is not shared with the contact
+// table, so that settings like a call timeout can be applied to it.
+static kademlia::Node_ptr private_ref(kademlia::Node_ptr node)
+{
+	try
+	{
+		CORBA::String_var ior = orb->object_to_string(node);
+		CORBA::Object_var obj = orb->string_to_object(ior);
+		return kademlia::Node::_unchecked_narrow(obj);
+	}
+	catch(const CORBA::Exception &)
+	{
+		return kademlia::Node::_nil();
+	}
+}
+
+static void drain_task(size_t n, void *arg)
+{
+	DrainWork &work = *static_cast<DrainWork*>(arg);
+	mstime_t t = now();
+	if(t >= work.deadline)
+		return;
+
+	DrainTarget &target = work.targets[work.batches[n].first];
+	size_t first = work.batches[n].second;
+	size_t last  = std::min<size_t>(first + Node_impl::max_drain_batch, target.entries.size());
+	seq_entry_t batch(last - first);
+	batch.length(last - first);
+	for(size_t m = first; m < last; ++m)
+		batch[m - first] = (*work.entries)[target.entries[m]];
+
+	try
+	{
+		// Don't let a slow node hold up the shutdown beyond the budget. The
+		// reference is our own, so the timeout does not affect other calls.
+		if(CORBA::is_nil(target.ref))
+			return;
+		omniORB::setClientCallTimeout(target.ref, static_cast<CORBA::ULong>(work.deadline - t));
+		target.ref->store_batch(work.node->reference(), batch);
+		omni_mutex_lock l(work.mutex);
+		work.sent += batch.length();
+	}
+	catch(const CORBA::Exception &)
+	{
+		trace(20) << "Node_impl::drain(): failed to hand entries over to node ID " << target.id << endm;
+	}
+}
+
+bool Node_impl::drain( mstime_t budget )
+{
+	{
+		omni_mutex_lock l(_mutex);
+		if(_draining)
+			return false;
+		_draining = true;
+	}
+
+	DrainWork work;
+	work.node     = this;
+	work.deadline = now() + budget;
+	work.sent     = 0;
+
+	// Send each entry to the closest nodes we know of, which lookups for it
+	// will reach first now that we are leaving.
+	seq_entry_t_var entries = _dt.contents();
+	work.entries = &entries.in();
+	std::map<Id, size_t> target_index;
+	seq_node_ref_t_var closest;
+	for(unsigned n = 0; n < entries->length(); ++n)
+	{
+		Id index(entries[n].index);
+		if(n == 0 || index != Id(entries[n - 1].index))
+			closest = _ct.retrieve(index);
+		for(unsigned m = 0; m < closest->length() && m < replication_factor/5; ++m)
+		{
+			Id id(closest[m].id);
+			std::map<Id, size_t>::iterator it = target_index.find(id);
+			if(it == target_index.end())
+			{
+				it = target_index.insert(std::make_pair(id, work.targets.size())).first;
+				work.targets.push_back(DrainTarget());
+				work.targets.back().id  = id;
+				work.targets.back().ref = private_ref(closest[m].ref);
+			}
+			work.targets[it->second].entries.push_back(n);
+		}
+	}
+
+	// Interleave the batches for different nodes, so that every node has
+	// received part of its entries if the budget runs out.
+	for(size_t first = 0, more = 1; more; first += max_drain_batch)
+	{
+		more = 0;
+		for(size_t t = 0; t < work.targets.size(); ++t)
+			if(first < work.targets[t].entries.size())
+			{
+				work.batches.push_back(std::make_pair(t, first));
+				more = 1;
+			}
+	}
+
+	info() << "Draining " << entries->length() << " entries to " <<
+		work.targets.size() << " nodes" << endm;
+	run_parallel(work.batches.size(), drain_task, &work, max_parallel_calls);
+	info() << "Drained " << work.sent << " copies of " << entries->length() <<
+		" entries" << (now() >= work.deadline ? "; time budget exhausted" : "") << endm;
+	return true;
+}
+
+void Node_impl::refresh( const std::vector<Id> &targets )
+{
+    if(_broker)
+        _broker->find_nodes_parallel(targets);
+}
+
+// Converts a decayed read count into reads per minute. Counts are halved
+// every window, so a steady rate of r reads per window yields a count of 2r.
+unsigned long Node_impl::read_rate( unsigned long count )
+{
+    return count*(60*1000/hot_key_window)/2;
+}
+
+void Node_impl::use_compact_refs( bool compact )
+{
+    _compact_refs = compact;
+}
+
+bool Node_impl::open_udp( )
+{
+    endpoint_t endpoint;
+    if(!endpoint_of(reference().ref, endpoint))
+    {
+        error() << "Node_impl::open_udp(): node has no IPv4 endpoint to listen at" << endm;
+        return false;
+    }
+    _udp = new UdpTransport(_id, *this);
+    if(!_udp->open(endpoint.port))
+    {
+        delete _udp;
+        _udp = 0;
+        return false;
+    }
     return true;
 }
+
+bool Node_impl::draining( )
+{
+    omni_mutex_lock l(_mutex);
+    return _draining;
+}
+
+void Node_impl::set_hot_key_rate( unsigned long rate )
+{
+    omni_mutex_lock l(_mutex);
+    _hot_key_rate = rate;
+}
+
+void Node_impl::replicate_hot_keys( )
+{
+    std::vector<HotKeys::Item> items;
+    _dt.hot_keys(max_hot_keys, items);
+    _dt.decay_reads();
+
+    unsigned long rate;
+    {
+        omni_mutex_lock l(_mutex);
+        rate = _hot_key_rate;
+    }
+    if(rate == 0 || draining())
+        return;
+
+    // Only count reads that are certain, to avoid pushing cold entries.
+    for(size_t n = 0; n < items.size(); ++n)
+        if(read_rate(items[n].count - items[n].error) >= rate)
+            replicate_hot_key(items[n].index);
+}
+
+seq_node_ref_t *Node_impl::hot_key_targets( const Id &index, ContactTable &ct )
+{
+    // The nodes closest to the index differ from it in the bits below
+    // bitscan() only. Lookups approaching from the sibling subtree, which
+    // differs in bit bitscan() itself, pass through the nodes closest to the
+    // index in there; caching the entry there spreads the load over more nodes.
+    seq_node_ref_t_var targets = new seq_node_ref_t();
+    seq_node_ref_t_var closest = ct.retrieve(index);
+    if(closest->length() == 0)
+        return targets._retn();
+    unsigned bit = (index ^ Id(closest[closest->length() - 1].id)).bitscan();
+    if(bit >= Id::bits)
+        return targets._retn();
+    Id sibling = index;
+    sibling.set(bit, !index[bit]);
+
+    seq_node_ref_t_var nodes = ct.retrieve(sibling);
+    for(unsigned n = 0; n < nodes->length() && targets->length() < hot_key_replicas; ++n)
+    {
+        Id id(nodes[n].id);
+        bool replica = false;
+        for(unsigned m = 0; m < closest->length() && !replica; ++m)
+            replica = (Id(closest[m].id) == id);
+        if(!replica)
+        {
+            unsigned length = targets->length();
+            targets->length(length + 1);
+            targets[length] = nodes[n];
+        }
+    }
+    return targets._retn();
+}
+
+void Node_impl::replicate_hot_key( const Id &index )
+{
+    // Only replicas push copies; nodes that merely cache the entry don't.
+    seq_entry_t_var entries = _dt.range(index, index);
+    if(entries->length() == 0)
+        return;
+    seq_value_t values(entries->length());
+    values.length(entries->length());
+    for(unsigned n = 0; n < entries->length(); ++n)
+    {
+        values[n].contents = entries[n].value.contents;
+        values[n].lifetime = std::min<lifetime_t>(entries[n].value.lifetime, hot_key_lifetime);
+    }
+
+    seq_node_ref_t_var nodes = hot_key_targets(index, _ct);
+    unsigned pushed = 0;
+    for(unsigned n = 0; n < nodes->length(); ++n)
+    {
+        Id id(nodes[n].id);
+        try
+        {
+            nodes[n].ref->cache(reference(), index, values);
+            ++pushed;
+        }
+        catch(const CORBA::Exception &)
+        {
+            trace(20) << "Node_impl::replicate_hot_key(): failed to push entry to node ID " << id << endm;
+        }
+    }
+    trace(20) << "Node_impl::replicate_hot_key(): pushed hot entry at index " << index <<
+        " to " << pushed << " extra nodes" << endm;
+}
+
+void Node_impl::limit_calls( unsigned max_calls )
+{
+    _admission.limit(max_calls);
+}
+
+void Node_impl::limit_workers( Dispatcher::queue_t queue, unsigned workers, unsigned max_queued )
+{
+    _dispatcher.limit(queue, workers, max_queued);
+}
+
+void Node_impl::limit_data( size_t capacity, DataTable::eviction_policy policy )
+{
+    _dt.limit(capacity, policy);
+}
+
+bool Node_impl::open_data_file( const char *path, mstime_t durable_lifetime )
+{
+    _durable_lifetime = durable_lifetime;
+    return _dt.open(path);
+}
@@ -1,17 +1,26 @@
 #ifndef NODE_HH_INCLUDED
 #define NODE_HH_INCLUDED
 
-#include <time.h>
 #include "main.hh"
 
+#include "AdmissionControl.hh"
 #include "ContactTable.hh"
 #include "DataTable.hh"
+#include "Dispatcher.hh"
 #include "Id.hh"
+#include "Metrics.hh"
+#include "Scheduler.hh"
+#include "UdpTransport.hh"
+#include "time.hh"
+
+#include <string>
+#include <vector>
 
 class Broker_impl;
 
 class Node_impl :
-    public POA_kademlia::Node
+    public POA_kademlia::Node,
+    public UdpTransport::Handler
 {
 
 public:
@@ -37,10 +46,41 @@ public:
         const kademlia::node_ref_t& caller,
         const kademlia::id_t target );
 
+    kademlia::seq_compact_node_ref_t* find_nodes_compact (
+        const kademlia::node_ref_t& caller,
+        const kademlia::id_t target );
+
+    void store_batch (
+        const kademlia::node_ref_t& caller,
+        const kademlia::seq_entry_t& entries );
+
+    kademlia::seq_value_t* find_value (
+        const kademlia::node_ref_t& caller,
+        const kademlia::id_t index,
+        kademlia::seq_node_ref_t_out nodes );
+
+    void cache (
+        const kademlia::node_ref_t& caller,
+        const kademlia::id_t index,
+        const kademlia::seq_value_t& values );
+
     const Id& id( ) const;
 
     void update(
         const kademlia::node_ref_t& caller );
+
+    void update(
+        const kademlia::compact_node_ref_t& caller );
+
+
+    // UdpTransport::Handler methods
+
+    void handle_ping(
+        const kademlia::compact_node_ref_t& caller );
+
+    kademlia::seq_compact_node_ref_t* handle_find_nodes(
+        const kademlia::compact_node_ref_t& caller,
+        const Id& target );
 		
 
     // kademlia::Node attributes
@@ -48,24 +88,200 @@ public:
     kademlia::seq_node_ref_t* contacts( );
     
     kademlia::seq_entry_t* data( );
+
+    kademlia::seq_hot_key_t* hot_keys( );
+
+    kademlia::seq_stat_t* stats( );
+
+    kademlia::seq_node_ref_t* contacts_page (
+        const kademlia::id_t cursor,
+        CORBA::ULong max,
+        kademlia::id_t next,
+        CORBA::Boolean& more );
+
+    kademlia::seq_entry_t* data_page (
+        const kademlia::id_t cursor,
+        CORBA::ULong max,
+        kademlia::id_t next,
+        CORBA::Boolean& more );
     
     CORBA::ULong age( );
     
     
 	kademlia::node_ref_t reference( );
 
+	void advertise(
+	    kademlia::Node_ptr ref );
+
 	bool add_initial_contact(
-	    const char *ior );
+	    kademlia::Node_ptr node );
+
+	// Pings the given nodes concurrently and adds those that respond to the
+	// contact table. Returns the number of nodes that responded.
+	unsigned add_initial_contacts(
+	    const std::vector<kademlia::Node_var> &nodes );
+
+	unsigned add_initial_contacts(
+	    const std::vector<std::string> &iors );
+
+	// Loads and revalidates the contacts saved in the given file, and saves
+	// contacts to it periodically. Returns the number of contacts restored.
+	unsigned open_contacts_file(
+	    const char *path );
+
+	void save_contacts( );
+
+	// Appends samples of the process's metrics and of this node's tables.
+	void collect(
+	    std::vector<Metrics::Sample> &samples );
+
+	// Writes the metrics to the given file in the Prometheus text format,
+	// and rewrites it every metrics_interval. Returns false if the file
+	// could not be written.
+	bool open_metrics_file(
+	    const char *path );
 	    
 	bool initialize(
 	    Broker_impl &broker );
 
+	// Hands over stored entries to newly joined nodes that have become one of
+	// the nodes closest to them.
+	void handoff(
+	    const std::vector< std::pair<Id, kademlia::Node_var> > &nodes );
+
+	void handoff(
+	    const Id &id,
+	    kademlia::Node_ptr node );
+
+	// Looks up the given targets concurrently, to refresh the buckets they
+	// fall in. Does nothing before initialize() has been called.
+	void refresh(
+	    const std::vector<Id> &targets );
+
+	// Stops accepting new entries and hands all stored entries over to the
+	// nodes closest to them, giving up on transfers that have not completed
+	// within the budget. Returns false if the node was already draining.
+	bool drain(
+	    mstime_t budget );
+
+	// Sets the read rate, in reads per minute, above which the node pushes
+	// copies of an entry it stores to extra nodes; zero disables this.
+	void set_hot_key_rate(
+	    unsigned long rate );
+
+	// Returns the contacts that copies of a hot entry at the index are pushed
+	// to: the nodes closest to the index in the sibling of the smallest
+	// subtree holding the nodes closest to it, leaving out the latter.
+	static kademlia::seq_node_ref_t *hot_key_targets(
+	    const Id &index,
+	    ContactTable &ct );
+
+	// Makes lookups ask other nodes for compact node references, falling back
+	// to full references for nodes that do not support them. Call this
+	// before the node is activated.
+	void use_compact_refs(
+	    bool compact );
+
+	bool compact_refs( ) const { return _compact_refs; }
+
+	// Starts serving ping and find_nodes over UDP, on the port with the same
+	// number as the node's IIOP port, and makes lookups use UDP too. Call this
+	// once the node is activated, but before it is reachable.
+	bool open_udp( );
+
+	UdpTransport *udp( ) { return _udp; }
+
+	// Limits the number of incoming calls executing at once; see
+	// AdmissionControl::limit().
+	void limit_calls(
+	    unsigned max_calls );
+
+	// Sets the number of workers and the queue length for a class of
+	// incoming calls; see Dispatcher::limit().
+	void limit_workers(
+	    Dispatcher::queue_t queue,
+	    unsigned workers,
+	    unsigned max_queued );
+
+	// Limits the memory used for stored values; see DataTable::limit().
+	void limit_data(
+	    size_t capacity,
+	    DataTable::eviction_policy policy );
+
+	// Opens the data file; stores with a lifetime of at least durable_lifetime
+	// milliseconds are synced to disk before they are acknowledged, and so
+	// are erases of such entries. The lifetime is the only property of a
+	// store that the protocol carries, and long-lived entries are the ones
+	// that republishing would not restore soon after a crash.
+	bool open_data_file(
+	    const char *path,
+	    mstime_t durable_lifetime );
+
+
+	// Maximum number of concurrent remote calls made by a single operation.
+	static const unsigned max_parallel_calls = 16;
+
+	// Maximum number of entries sent to a node in a single call while draining
+	// or handing entries over.
+	static const unsigned max_drain_batch = 256;
+
+	static const unsigned long default_hot_key_rate = 600;
+
+	// Maximum number of entries returned in a page of the data table.
+	static const unsigned max_data_page = 1024;
 
 private:
+	static const unsigned max_refresh_buckets = 20;
+
+	// Read rates are measured over windows of hot_key_window; copies of hot
+	// entries are cached at up to hot_key_replicas extra nodes for
+	// hot_key_lifetime, and renewed as long as the entries stay hot.
+	static const unsigned hot_key_window   = 10*1000;	// 10 seconds
+	static const unsigned hot_key_lifetime = 60*1000;	// 1 minute
+	static const unsigned hot_key_replicas = 8;
+	static const unsigned max_hot_keys     = 16;
+
+	static const unsigned metrics_interval = 10*1000;	// 10 seconds
+
+	static unsigned long read_rate(
+	    unsigned long count );
+
+	static mstime_t hot_key_task(
+	    void *node );
+
+	void replicate_hot_keys( );
+
+	bool draining( );
+
+	static mstime_t metrics_task(
+	    void *node );
+
+	bool write_metrics( );
+
+	void replicate_hot_key(
+	    const Id &index );
+
     Id           _id;
     DataTable    _dt;
     ContactTable _ct;
-    time_t       _startup_time;
+    mstime_t     _startup_time;
+    mstime_t     _durable_lifetime;
+    std::string  _contacts_path;
+    std::string  _metrics_path;
+    bool         _compact_refs;
+
+    AdmissionControl _admission;
+    Dispatcher       _dispatcher;
+    Metrics         &_metrics;
+
+    omni_mutex        _mutex;
+    bool              _draining;
+    unsigned long     _hot_key_rate;
+    Scheduler::task_t _hot_key_task, _metrics_task;
+
+    kademlia::Node_var _advertised;
+    Broker_impl       *_broker;
+    UdpTransport      *_udp;
 
 	friend class Broker_impl;
 
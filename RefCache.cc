@@ -0,0 +1,107 @@
+#include "RefCache.hh"
+
+#include "logging.hh"
+
+using namespace kademlia;
+
+RefCache::RefCache(
+	size_t capacity ) :
+	_capacity(capacity)
+{
+}
+
+Node_ptr RefCache::intern(
+	const Id &id,
+	Node_ptr node,
+	bool replace )
+{
+	if(CORBA::is_nil(node))
+		return Node::_nil();
+
+	omni_mutex_lock l(_mutex);
+	entries_t::iterator i = _entries.find(id);
+	if(i == _entries.end())
+	{
+		i = _entries.insert(std::make_pair(id, Entry())).first;
+		_uses.push_front(id);
+		i->second.use  = _uses.begin();
+		i->second.node = Node::_duplicate(node);
+		evict_unlocked();
+	}
+	else
+	{
+		touch_unlocked(i->second);
+		if( replace && node != i->second.node.in() &&
+			!i->second.node->_is_equivalent(node) )
+		{
+			trace(29) << "RefCache::intern(): reference of node ID " << id <<
+				" has changed" << endm;
+			i->second.node = Node::_duplicate(node);
+		}
+	}
+	return Node::_duplicate(i->second.node);
+}
+
+Node_ptr RefCache::find(
+	const Id &id )
+{
+	omni_mutex_lock l(_mutex);
+	entries_t::iterator i = _entries.find(id);
+	if(i == _entries.end())
+		return Node::_nil();
+	touch_unlocked(i->second);
+	return Node::_duplicate(i->second.node);
+}
+
+void RefCache::erase(
+	const Id &id )
+{
+	omni_mutex_lock l(_mutex);
+	entries_t::iterator i = _entries.find(id);
+	if(i == _entries.end())
+		return;
+	_uses.erase(i->second.use);
+	_entries.erase(i);
+}
+
+void RefCache::limit(
+	size_t capacity )
+{
+	omni_mutex_lock l(_mutex);
+	_capacity = capacity;
+	evict_unlocked();
+}
+
+size_t RefCache::size( )
+{
+	omni_mutex_lock l(_mutex);
+	return _entries.size();
+}
+
+void RefCache::touch_unlocked(
+	Entry &entry )
+{
+	_uses.splice(_uses.begin(), _uses, entry.use);
+}
+
+void RefCache::evict_unlocked( )
+{
+	while(_entries.size() > _capacity)
+	{
+		_entries.erase(_uses.back());
+		_uses.pop_back();
+	}
+}
+
+static omni_mutex  ref_cache_mutex;
+static RefCache   *ref_cache_instance = 0;
+
+RefCache &ref_cache( )
+{
+	// Never destroyed, so that no references are released after the ORB
+	// has been shut down.
+	omni_mutex_lock l(ref_cache_mutex);
+	if(!ref_cache_instance)
+		ref_cache_instance = new RefCache();
+	return *ref_cache_instance;
+}
@@ -0,0 +1,88 @@
+#ifndef REFCACHE_HH_INCLUDED
+#define REFCACHE_HH_INCLUDED
+
+#include "kademlia.hh"
+
+#include "Id.hh"
+
+#include <omnithread.h>
+#include <list>
+#include <map>
+
+/*
+	Interns Node references by node ID, so that the references to a peer
+	held throughout the process share one object, and with it the ORB's
+	connection to the peer. Copies of a reference that arrive in replies
+	are released right away instead of being kept next to the shared one.
+
+	At most capacity references are cached; the least recently used one is
+	dropped to make room. The capacity bounds the references held here, not
+	the connections or file descriptors in use: contacts and lookups hold
+	references of their own, and the ORB closes an idle outgoing connection
+	only when its connection scan (omniORB's outConScanPeriod) finds it
+	idle, whether or not any reference to the peer is left.
+
+	Synchronized.
+*/
+class RefCache
+{
+public:
+	static const size_t default_capacity = 4096;
+
+	RefCache(
+		size_t capacity = default_capacity );
+
+	// Returns a duplicate of the cached reference for the node. The given
+	// reference is cached first if there is none yet. It replaces a cached
+	// one that refers to a different object (i.e. the node has moved) only
+	// if replace is set, which is for references that came from the node
+	// itself or that a call just succeeded through; a reference that another
+	// node claims for it must not displace one that works. Nil references
+	// are returned as is.
+	kademlia::Node_ptr intern(
+		const Id &id,
+		kademlia::Node_ptr node,
+		bool replace = false );
+
+	// Returns a duplicate of the cached reference for the node, or nil.
+	kademlia::Node_ptr find(
+		const Id &id );
+
+	// Drops the reference for a node, e.g. after it failed.
+	void erase(
+		const Id &id );
+
+	void limit(
+		size_t capacity );
+
+	size_t size( );
+
+private:
+	struct Entry
+	{
+		kademlia::Node_var       node;
+		std::list<Id>::iterator  use;
+	};
+
+	typedef std::map<Id, Entry> entries_t;
+
+	RefCache(const RefCache &);
+	RefCache &operator=(const RefCache &);
+
+	// Marks an entry as most recently used.
+	void touch_unlocked(
+		Entry &entry );
+
+	void evict_unlocked( );
+
+	omni_mutex    _mutex;
+	size_t        _capacity;
+	entries_t     _entries;
+	std::list<Id> _uses;	// most recently used first
+
+}; // class RefCache
+
+// Returns the process-wide reference cache.
+RefCache &ref_cache();
+
+#endif //ndef REFCACHE_HH_INCLUDED
@@ -0,0 +1,169 @@
+#include "Scheduler.hh"
+
+#include "logging.hh"
+
+Scheduler::Scheduler(
+	unsigned workers ) :
+	_cond(&_mutex),
+	_done(&_mutex),
+	_next_task(1),
+	_stopping(false)
+{
+	for(unsigned n = 0; n < workers; ++n)
+	{
+		_workers.push_back(new omni_thread(worker, this));
+		_workers.back()->start();
+	}
+}
+
+Scheduler::~Scheduler( )
+{
+	_mutex.lock();
+	_stopping = true;
+	_cond.broadcast();
+	_mutex.unlock();
+	for(size_t n = 0; n < _workers.size(); ++n)
+		_workers[n]->join(0);
+}
+
+void *Scheduler::worker(
+	void *scheduler )
+{
+	trace(10) << "Scheduler::worker(): worker thread started" << endm;
+	static_cast<Scheduler*>(scheduler)->run();
+	trace(10) << "Scheduler::worker(): worker thread exiting" << endm;
+	return 0;
+}
+
+void Scheduler::run( )
+{
+	omni_mutex_lock l(_mutex);
+	while(!_stopping)
+	{
+		if(_heap.empty() || _heap.begin()->first == never)
+		{
+			_cond.wait();
+			continue;
+		}
+		if(now() < _heap.begin()->first)
+		{
+			wait_until(_cond, _heap.begin()->first);
+			continue;
+		}
+
+		task_t id = _heap.begin()->second;
+		_heap.erase(_heap.begin());
+		Task &task = _tasks[id];
+		task.running = omni_thread::self();
+		task.woken   = never;
+
+		_mutex.unlock();
+		mstime_t next = task.function(task.arg);
+		_mutex.lock();
+
+		// The task is not erased while it runs, so the reference is valid.
+		task.running = 0;
+		if(next && task.woken < next)
+			next = task.woken;
+		if(task.cancelled || !next)
+			_tasks.erase(id);
+		else
+		{
+			task.deadline = next;
+			_heap.insert(std::make_pair(next, id));
+		}
+		_done.broadcast();
+	}
+}
+
+Scheduler::task_t Scheduler::schedule(
+	mstime_t deadline,
+	function_t function,
+	void *arg )
+{
+	omni_mutex_lock l(_mutex);
+	task_t id = _next_task++;
+	Task task;
+	task.function  = function;
+	task.arg       = arg;
+	task.deadline  = deadline;
+	task.woken     = never;
+	task.running   = 0;
+	task.cancelled = false;
+	_tasks.insert(std::make_pair(id, task));
+	if(_heap.empty() || deadline < _heap.begin()->first)
+		_cond.signal();
+	_heap.insert(std::make_pair(deadline, id));
+	return id;
+}
+
+// Removes a task's entry from the heap.
+void Scheduler::unqueue_unlocked(
+	task_t task,
+	mstime_t deadline )
+{
+	for(heap_t::iterator i = _heap.lower_bound(deadline);
+		i != _heap.end() && i->first == deadline; ++i)
+		if(i->second == task)
+		{
+			_heap.erase(i);
+			return;
+		}
+}
+
+void Scheduler::wake(
+	task_t id,
+	mstime_t deadline )
+{
+	omni_mutex_lock l(_mutex);
+	tasks_t::iterator i = _tasks.find(id);
+	if(i == _tasks.end())
+		return;
+	Task &task = i->second;
+	if(task.running)
+	{
+		if(deadline < task.woken)
+			task.woken = deadline;
+		return;
+	}
+	if(deadline >= task.deadline)
+		return;
+	unqueue_unlocked(id, task.deadline);
+	task.deadline = deadline;
+	if(_heap.empty() || deadline < _heap.begin()->first)
+		_cond.signal();
+	_heap.insert(std::make_pair(deadline, id));
+}
+
+void Scheduler::cancel(
+	task_t id )
+{
+	omni_mutex_lock l(_mutex);
+	tasks_t::iterator i = _tasks.find(id);
+	if(i == _tasks.end())
+		return;
+	if(!i->second.running)
+	{
+		unqueue_unlocked(id, i->second.deadline);
+		_tasks.erase(i);
+		return;
+	}
+	i->second.cancelled = true;
+	if(i->second.running == omni_thread::self())
+		return;
+	while(_tasks.find(id) != _tasks.end())
+		_done.wait();
+}
+
+static omni_mutex  scheduler_mutex;
+static Scheduler  *scheduler_instance = 0;
+
+Scheduler &scheduler( )
+{
+	// Created on first use and never destroyed, like the coarse clock
+	// thread; whoever schedules tasks must cancel them before exiting.
+	omni_mutex_lock l(scheduler_mutex);
+	if(!scheduler_instance)
+		scheduler_instance = new Scheduler();
+	return *scheduler_instance;
+}
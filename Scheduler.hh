@@ -0,0 +1,95 @@
+#ifndef SCHEDULER_HH_INCLUDED
+#define SCHEDULER_HH_INCLUDED
+
+#include "time.hh"
+
+#include <omnithread.h>
+#include <map>
+#include <vector>
+
+/*
+	Runs maintenance tasks at given deadlines on a small pool of worker
+	threads. Pending tasks are kept in a timer heap ordered by deadline, so
+	idle workers sleep until the first deadline instead of polling. A task
+	function returns the time at which it wants to run again (measured by
+	now()), or zero when it is done, so periodic tasks keep their identity
+	and can be cancelled at any time.
+
+	Tables and nodes schedule their tasks on the process-wide scheduler
+	returned by scheduler(), and cancel them before they are destroyed.
+*/
+class Scheduler
+{
+public:
+
+	typedef unsigned long task_t;
+	typedef mstime_t (*function_t)(void *arg);
+
+	// Deadline of tasks that only run when woken.
+	static const mstime_t never = ~mstime_t(0);
+
+	static const unsigned default_workers = 4;
+
+	Scheduler(
+		unsigned workers = default_workers );
+
+	// Stops the workers, after waiting for running tasks to return; pending
+	// tasks are dropped.
+	~Scheduler( );
+
+	// Schedules function(arg) to run at the given deadline, and returns an
+	// identifier for the task (which is never zero).
+	task_t schedule(
+		mstime_t deadline,
+		function_t function,
+		void *arg );
+
+	// Moves the deadline of a task forward to the given time, if it was
+	// later. If the task is running, it runs again at that time at the latest.
+	void wake(
+		task_t task,
+		mstime_t deadline );
+
+	// Removes a task. If it is running, this waits until it returns, unless
+	// called by the task itself.
+	void cancel(
+		task_t task );
+
+private:
+
+	struct Task
+	{
+		function_t   function;
+		void        *arg;
+		mstime_t     deadline, woken;
+		omni_thread *running;	// worker running the task, if any
+		bool         cancelled;
+	};
+
+	typedef std::map<task_t, Task> tasks_t;
+	typedef std::multimap<mstime_t, task_t> heap_t;
+
+	static void *worker(
+		void *scheduler );
+
+	void run( );
+
+	void unqueue_unlocked(
+		task_t task,
+		mstime_t deadline );
+
+	omni_mutex                _mutex;
+	omni_condition            _cond,	// signalled when a deadline moves earlier
+	                          _done;	// signalled when a task returns
+	tasks_t                   _tasks;
+	heap_t                    _heap;
+	task_t                    _next_task;
+	bool                      _stopping;
+	std::vector<omni_thread*> _workers;
+
+}; // class Scheduler
+
+// Returns the process-wide scheduler, starting it on first use.
+Scheduler &scheduler();
+
+#endif //ndef SCHEDULER_HH_INCLUDED
@@ -0,0 +1,329 @@
+#include "Segment.hh"
+#include "DataFile.hh"
+
+#include <algorithm>
+#include <cstring>
+
+#include "logging.hh"
+
+/*
+	File layout (host byte order):
+
+		records       index[20] expiration[8] size[4] data[size], sorted by index
+		sparse index  index[20] offset[8] for the first record of every block
+		Bloom filter  bytes
+		footer        index offset[8] bloom offset[8] count[4] index count[4]
+		              bloom size[4] magic[4]
+*/
+
+static const size_t record_header_size = sizeof(kademlia::id_t) + 8 + 4;
+static const size_t index_entry_size   = sizeof(kademlia::id_t) + 8;
+static const size_t footer_size        = 8 + 8 + 4 + 4 + 4 + 4;
+
+template<class T>
+static bool write_field(std::FILE *file, const T &value)
+{
+	return std::fwrite(&value, sizeof(value), 1, file) == 1;
+}
+
+template<class T>
+static bool read_field(std::FILE *file, T &value)
+{
+	return std::fread(&value, sizeof(value), 1, file) == 1;
+}
+
+static bool write_id(std::FILE *file, const Id &id)
+{
+	const kademlia::id_t &bytes = id;
+	return std::fwrite(bytes, sizeof(bytes), 1, file) == 1;
+}
+
+static bool read_id(std::FILE *file, Id &id)
+{
+	kademlia::id_t &bytes = id;
+	return std::fread(bytes, sizeof(bytes), 1, file) == 1;
+}
+
+static bool index_less(const std::pair<Id, Segment::offset_t> &entry, const Id &index)
+{
+	return entry.first < index;
+}
+
+void Segment::bloom_positions(
+	const Id &index,
+	size_t bits,
+	size_t positions[] )
+{
+	// Indices are uniformly distributed hashes already, so their bytes can be
+	// used directly for double hashing.
+	const kademlia::id_t &bytes = index;
+	CORBA::ULong h1, h2;
+	std::memcpy(&h1, bytes, sizeof(h1));
+	std::memcpy(&h2, bytes + sizeof(h1), sizeof(h2));
+	h2 |= 1;
+	for(unsigned k = 0; k < bloom_hashes; ++k)
+		positions[k] = static_cast<size_t>((h1 + (unsigned long long)k*h2) % bits);
+}
+
+
+/*
+	Segment::Writer
+*/
+
+Segment::Writer::Writer(
+	const std::string &path,
+	size_t capacity ) :
+	_path(path),
+	_temp_path(path + ".tmp"),
+	_file(std::fopen(_temp_path.c_str(), "wb")),
+	_ok(_file != 0),
+	_offset(0),
+	_count(0),
+	_bloom((std::max<size_t>(capacity, 1)*bloom_bits + 7)/8)
+{
+	if(!_ok)
+		error() << "Segment: could not create " << _temp_path << endm;
+}
+
+Segment::Writer::~Writer( )
+{
+	if(_file)
+	{
+		std::fclose(_file);
+		std::remove(_temp_path.c_str());
+	}
+}
+
+bool Segment::Writer::add(
+	const Entry &entry )
+{
+	if(!_ok)
+		return false;
+
+	if(_count % block_records == 0)
+		_index.push_back(std::make_pair(entry.index, _offset));
+
+	size_t positions[bloom_hashes];
+	bloom_positions(entry.index, _bloom.size()*8, positions);
+	for(unsigned k = 0; k < bloom_hashes; ++k)
+		_bloom[positions[k]/8] |= 1 << (positions[k]%8);
+
+	CORBA::ULong size = entry.value.size();
+	_ok = write_id(_file, entry.index) &&
+	      write_field(_file, entry.expiration) &&
+	      write_field(_file, size) &&
+	      std::fwrite(entry.value.data(), 1, size, _file) == size;
+	_offset += record_header_size + size;
+	++_count;
+	return _ok;
+}
+
+bool Segment::Writer::finish( )
+{
+	if(!_file)
+		return false;
+
+	offset_t index_offset = _offset;
+	for(size_t n = 0; _ok && n < _index.size(); ++n)
+		_ok = write_id(_file, _index[n].first) && write_field(_file, _index[n].second);
+
+	offset_t bloom_offset = index_offset + _index.size()*index_entry_size;
+	CORBA::ULong index_count = _index.size(), bloom_size = _bloom.size();
+	_ok = _ok &&
+	      std::fwrite(&_bloom[0], 1, bloom_size, _file) == bloom_size &&
+	      write_field(_file, index_offset) &&
+	      write_field(_file, bloom_offset) &&
+	      write_field(_file, _count) &&
+	      write_field(_file, index_count) &&
+	      write_field(_file, bloom_size) &&
+	      write_field(_file, segment_magic) &&
+	      DataFile::sync_file(_file);
+	_ok = (std::fclose(_file) == 0) && _ok;
+	_file = 0;
+
+	if(_ok)
+	{
+#ifdef __WIN32__
+		std::remove(_path.c_str());
+#endif
+		_ok = (std::rename(_temp_path.c_str(), _path.c_str()) == 0);
+		DataFile::sync_directory(_path);
+	}
+	if(!_ok)
+	{
+		error() << "Segment: failed to write " << _path << endm;
+		std::remove(_temp_path.c_str());
+	}
+	return _ok;
+}
+
+
+/*
+	Segment
+*/
+
+Segment::Segment(
+	const std::string &path,
+	std::FILE *file ) :
+	_path(path),
+	_file(file),
+	_count(0),
+	_data_end(0)
+{
+}
+
+Segment::~Segment( )
+{
+	std::fclose(_file);
+}
+
+Segment *Segment::open(
+	const std::string &path )
+{
+	std::FILE *file = std::fopen(path.c_str(), "rb");
+	if(!file)
+	{
+		error() << "Segment: could not open " << path << endm;
+		return 0;
+	}
+
+	Segment *segment = new Segment(path, file);
+	offset_t index_offset, bloom_offset;
+	CORBA::ULong index_count, bloom_size, magic;
+	bool ok = std::fseek(file, -long(footer_size), SEEK_END) == 0 &&
+	          read_field(file, index_offset) &&
+	          read_field(file, bloom_offset) &&
+	          read_field(file, segment->_count) &&
+	          read_field(file, index_count) &&
+	          read_field(file, bloom_size) &&
+	          read_field(file, magic) &&
+	          magic == segment_magic && bloom_size > 0;
+
+	if(ok)
+	{
+		segment->_data_end = index_offset;
+		segment->_index.resize(index_count);
+		ok = std::fseek(file, long(index_offset), SEEK_SET) == 0;
+		for(CORBA::ULong n = 0; ok && n < index_count; ++n)
+			ok = read_id(file, segment->_index[n].first) &&
+			     read_field(file, segment->_index[n].second);
+	}
+	if(ok)
+	{
+		segment->_bloom.resize(bloom_size);
+		ok = std::fseek(file, long(bloom_offset), SEEK_SET) == 0 &&
+		     std::fread(&segment->_bloom[0], 1, bloom_size, file) == bloom_size;
+	}
+
+	if(!ok)
+	{
+		error() << "Segment: " << path << " is damaged" << endm;
+		delete segment;
+		return 0;
+	}
+	return segment;
+}
+
+bool Segment::may_contain(
+	const Id &index ) const
+{
+	size_t positions[bloom_hashes];
+	bloom_positions(index, _bloom.size()*8, positions);
+	for(unsigned k = 0; k < bloom_hashes; ++k)
+		if(!(_bloom[positions[k]/8] & (1 << (positions[k]%8))))
+			return false;
+	return true;
+}
+
+bool Segment::find(
+	const Id &index,
+	std::vector<Entry> &entries )
+{
+	if(!may_contain(index))
+		return true;
+	return scan(index, index, entries);
+}
+
+bool Segment::scan(
+	const Id &low,
+	const Id &high,
+	std::vector<Entry> &entries,
+	size_t max )
+{
+	if(_index.empty())
+		return true;
+
+	// Entries at the low end of the range may start in the block before the
+	// first block that starts at or after it.
+	std::vector< std::pair<Id, offset_t> >::const_iterator block =
+		std::lower_bound(_index.begin(), _index.end(), low, index_less);
+	if(block != _index.begin())
+		--block;
+
+	omni_mutex_lock l(_mutex);
+	offset_t position = block->second;
+	Entry entry;
+	size_t count = 0;
+	while(read_unlocked(position, entry))
+	{
+		if(high < entry.index)
+			break;
+		if(low <= entry.index)
+		{
+			if(max > 0 && count >= max && entries.back().index != entry.index)
+				break;
+			entries.push_back(entry);
+			++count;
+		}
+	}
+	return position <= _data_end;
+}
+
+bool Segment::read(
+	offset_t &position,
+	Entry &entry )
+{
+	omni_mutex_lock l(_mutex);
+	return read_unlocked(position, entry);
+}
+
+bool Segment::read_unlocked(
+	offset_t &position,
+	Entry &entry )
+{
+	if(position >= _data_end)
+		return false;
+
+	CORBA::ULong size;
+	if( std::fseek(_file, long(position), SEEK_SET) != 0 ||
+	    !read_id(_file, entry.index) ||
+	    !read_field(_file, entry.expiration) ||
+	    !read_field(_file, size) ||
+	    position + record_header_size + size > _data_end )
+	{
+		error() << "Segment: failed to read from " << _path << endm;
+		position = _data_end + 1;
+		return false;
+	}
+
+	std::vector<unsigned char> data(size);
+	if(size && std::fread(&data[0], 1, size, _file) != size)
+	{
+		error() << "Segment: failed to read from " << _path << endm;
+		position = _data_end + 1;
+		return false;
+	}
+	entry.value = size ? Blob(&data[0], size) : Blob();
+	position += record_header_size + size;
+	return true;
+}
+
+size_t Segment::count( ) const
+{
+	return _count;
+}
+
+const std::string &Segment::path( ) const
+{
+	return _path;
+}
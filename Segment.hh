@@ -0,0 +1,140 @@
+#ifndef SEGMENT_HH_INCLUDED
+#define SEGMENT_HH_INCLUDED
+
+#include "Blob.hh"
+#include "Id.hh"
+#include "time.hh"
+
+#include <omnithread.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/*
+	An immutable on-disk file of data table entries, sorted by index. Only a
+	sparse index (one key per block of records) and a Bloom filter are kept
+	in memory, so looking up an index that is not in the segment usually
+	requires no disk access at all, and other lookups read a single block.
+
+	Expiration times are wall clock milliseconds since the epoch, as in the
+	data file, so segments remain valid across restarts.
+*/
+class Segment
+{
+public:
+
+	typedef unsigned long long offset_t;
+
+	struct Entry
+	{
+		Id       index;
+		Blob     value;
+		mstime_t expiration;
+	};
+
+	/*
+		Writes a new segment. Entries must be added in order of their index;
+		the file only becomes visible under its final name once finish() has
+		synced it to disk.
+	*/
+	class Writer
+	{
+	public:
+		// Capacity is the (maximum) number of entries that will be added,
+		// used to size the Bloom filter.
+		Writer(
+			const std::string &path,
+			size_t capacity );
+
+		~Writer( );
+
+		bool add(
+			const Entry &entry );
+
+		bool finish( );
+
+	private:
+		std::string                 _path, _temp_path;
+		std::FILE                  *_file;
+		bool                        _ok;
+		offset_t                    _offset;
+		CORBA::ULong                _count;
+		std::vector<unsigned char>  _bloom;
+		std::vector< std::pair<Id, offset_t> > _index;
+
+	}; // class Segment::Writer
+
+	// Opens an existing segment, or returns 0 if it is missing or damaged.
+	static Segment *open(
+		const std::string &path );
+
+	~Segment( );
+
+	// Returns whether the segment may contain entries at the given index.
+	bool may_contain(
+		const Id &index ) const;
+
+	// Appends all entries at the given index to the vector.
+	bool find(
+		const Id &index,
+		std::vector<Entry> &entries );
+
+	// Appends all entries with indices between low and high (inclusive) to
+	// the vector, in order. If max is nonzero, stops after max entries, but
+	// not before all entries at the index of the last one are appended.
+	bool scan(
+		const Id &low,
+		const Id &high,
+		std::vector<Entry> &entries,
+		size_t max = 0 );
+
+	// Reads the entry at the given position and advances the position to the
+	// next entry. Start at position zero to read all entries in order; returns
+	// false at the end of the segment.
+	bool read(
+		offset_t &position,
+		Entry &entry );
+
+	size_t count( ) const;
+
+	const std::string &path( ) const;
+
+private:
+
+	// Number of records per block of the sparse index.
+	static const unsigned block_records = 32;
+
+	// Number of Bloom filter bits per entry and hash functions per key,
+	// giving a false positive rate of about 1%.
+	static const unsigned bloom_bits   = 10;
+	static const unsigned bloom_hashes = 7;
+
+	static const CORBA::ULong segment_magic = 0x4B445331;	// "KDS1"
+
+	Segment(
+		const std::string &path,
+		std::FILE *file );
+
+	static void bloom_positions(
+		const Id &index,
+		size_t bits,
+		size_t positions[] );
+
+	bool read_unlocked(
+		offset_t &position,
+		Entry &entry );
+
+	omni_mutex    _mutex;
+	std::string   _path;
+	std::FILE    *_file;
+	CORBA::ULong  _count;
+	offset_t      _data_end;
+
+	std::vector<unsigned char>             _bloom;
+	std::vector< std::pair<Id, offset_t> > _index;
+
+	friend class Writer;
+
+}; // class Segment
+
+#endif //ndef SEGMENT_HH_INCLUDED
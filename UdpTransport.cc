@@ -0,0 +1,657 @@
+#ifdef __WIN32__
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>	// before windows.h, which omnithread includes
+#endif
+
+#include "UdpTransport.hh"
+
+#include "logging.hh"
+#include "random.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#ifdef __WIN32__
+
+typedef int socklen_t;
+
+// Recvfrom() has no non-blocking flag; see receiver().
+static const int dont_wait = 0;
+
+// Every open socket holds a reference to Winsock.
+static bool start_sockets( )
+{
+	WSADATA data;
+	return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+}
+
+static void stop_sockets( )
+{
+	WSACleanup();
+}
+
+static std::string socket_error( )
+{
+	std::ostringstream text;
+	text << "Winsock error " << WSAGetLastError();
+	return text.str();
+}
+
+#else
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+static const int INVALID_SOCKET = -1;
+static const int dont_wait      = MSG_DONTWAIT;
+
+static bool start_sockets( )
+{
+	return true;
+}
+
+static void stop_sockets( )
+{
+}
+
+static int closesocket(int fd)
+{
+	return ::close(fd);
+}
+
+static std::string socket_error( )
+{
+	return strerror(errno);
+}
+
+#endif
+
+using namespace kademlia;
+
+// Sizes of the parts of a message, in octets.
+static const size_t header_size  = 1 + 4 + 20;
+static const size_t id_size      = 20;
+static const size_t contact_size = 20 + 4 + 2;
+
+// Appends an unsigned integer of the given size in big-endian order.
+static void put_number(std::string &out, unsigned long value, size_t size)
+{
+	for(size_t n = size; n > 0; --n)
+		out += char((value >> 8*(n - 1)) & 255);
+}
+
+static void put_id(std::string &out, const Id &id)
+{
+	const kademlia::id_t &octets = id;
+	out.append(reinterpret_cast<const char*>(octets), id_size);
+}
+
+namespace {
+
+// Reads the fields of the messages in a datagram.
+class Reader
+{
+public:
+	Reader(const std::string &data, size_t pos) :
+		_data(data), _pos(pos), _ok(pos <= data.size())
+	{
+	}
+
+	bool ok() const { return _ok; }
+	bool at_end() const { return !_ok || _pos == _data.size(); }
+
+	unsigned long number(size_t size)
+	{
+		const unsigned char *p = octets(size);
+		unsigned long value = 0;
+		for(size_t n = 0; p && n < size; ++n)
+			value = (value << 8) | p[n];
+		return value;
+	}
+
+	Id id()
+	{
+		const unsigned char *p = octets(id_size);
+		return p ? Id(p) : Id();
+	}
+
+	// Returns the next size octets and skips them; 0 if there are too few.
+	const unsigned char *octets(size_t size)
+	{
+		if(!_ok || size > _data.size() - _pos)
+		{
+			_ok = false;
+			return 0;
+		}
+		_pos += size;
+		return reinterpret_cast<const unsigned char*>(_data.data()) + _pos - size;
+	}
+
+private:
+	const std::string &_data;
+	size_t             _pos;
+	bool               _ok;
+};
+
+}
+
+UdpTransport::Handler::~Handler( )
+{
+}
+
+UdpTransport::UdpTransport(
+	const Id &id,
+	Handler &handler ) :
+	_id(id),
+	_handler(handler),
+	_socket(INVALID_SOCKET),
+	_cond(&_mutex),
+	_closing(false),
+	_thread(0)
+{
+}
+
+UdpTransport::~UdpTransport( )
+{
+	if(_thread)
+	{
+		_mutex.lock();
+		_closing = true;
+		_mutex.unlock();
+		_thread->join(0);
+	}
+	if(_socket != INVALID_SOCKET)
+	{
+		closesocket(_socket);
+		stop_sockets();
+	}
+
+	omni_mutex_lock l(_mutex);
+	for(pending_t::iterator i = _pending.begin(); i != _pending.end(); ++i)
+		i->second.done = true;
+	_cond.broadcast();
+}
+
+bool UdpTransport::open(
+	unsigned short port )
+{
+	if(!start_sockets())
+	{
+		error() << "UdpTransport::open(): could not initialize sockets: " << socket_error() << endm;
+		return false;
+	}
+	_socket = socket(AF_INET, SOCK_DGRAM, 0);
+	if(_socket == INVALID_SOCKET)
+	{
+		error() << "UdpTransport::open(): could not create socket: " << socket_error() << endm;
+		stop_sockets();
+		return false;
+	}
+
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family      = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port        = htons(port);
+
+#ifdef __WIN32__
+	DWORD timeout = poll_interval;
+#else
+	timeval timeout;
+	timeout.tv_sec  = 0;
+	timeout.tv_usec = poll_interval*1000;
+#endif
+
+	if( bind(_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+		setsockopt( _socket, SOL_SOCKET, SO_RCVTIMEO,
+			reinterpret_cast<const char*>(&timeout), sizeof(timeout) ) != 0 )
+	{
+		error() << "UdpTransport::open(): could not bind to UDP port " << port <<
+			": " << socket_error() << endm;
+		closesocket(_socket);
+		stop_sockets();
+		_socket = INVALID_SOCKET;
+		return false;
+	}
+
+	info() << "UdpTransport::open(): listening on UDP port " << port << endm;
+	_thread = new omni_thread(receiver, this);
+	_thread->start();
+	return true;
+}
+
+UdpTransport::request_t UdpTransport::ping(
+	const endpoint_t &to )
+{
+	return send(to, ping_request, std::string());
+}
+
+UdpTransport::request_t UdpTransport::find_nodes(
+	const endpoint_t &to,
+	const Id &target )
+{
+	std::string body;
+	put_id(body, target);
+	return send(to, find_nodes_request, body);
+}
+
+bool UdpTransport::poll(
+	request_t request,
+	bool &ok,
+	Id &id,
+	seq_compact_node_ref_t_var &nodes )
+{
+	omni_mutex_lock l(_mutex);
+	pending_t::iterator i = _pending.find(request);
+	if(i != _pending.end() && !i->second.done)
+		return false;
+	collect_unlocked(i, ok, id, nodes);
+	return true;
+}
+
+bool UdpTransport::wait(
+	request_t request,
+	Id &id,
+	seq_compact_node_ref_t_var &nodes )
+{
+	omni_mutex_lock l(_mutex);
+	pending_t::iterator i;
+	while((i = _pending.find(request)) != _pending.end() && !i->second.done)
+		_cond.wait();
+	bool ok;
+	collect_unlocked(i, ok, id, nodes);
+	return ok;
+}
+
+void UdpTransport::collect_unlocked(
+	pending_t::iterator i,
+	bool &ok,
+	Id &id,
+	seq_compact_node_ref_t_var &nodes )
+{
+	ok = false;
+	if(i == _pending.end())
+		return;
+	ok = i->second.ok;
+	if(ok)
+	{
+		id    = i->second.id;
+		nodes = new seq_compact_node_ref_t(i->second.nodes);
+	}
+	_pending.erase(i);
+}
+
+void *UdpTransport::receiver(
+	void *transport )
+{
+	trace(10) << "UdpTransport::receiver(): receiver thread started" << endm;
+	static_cast<UdpTransport*>(transport)->run();
+	trace(10) << "UdpTransport::receiver(): receiver thread exiting" << endm;
+	return 0;
+}
+
+void UdpTransport::run( )
+{
+	char buffer[max_datagram];
+	while(true)
+	{
+		{
+			omni_mutex_lock l(_mutex);
+			if(_closing)
+				break;
+		}
+
+		// Wait for a datagram, then take others that have arrived too, so
+		// that the replies to them can be batched, but not so many that
+		// replies and retransmissions are held up under load.
+		batch_t replies;
+		int flags = 0;
+		for(unsigned n = 0; n < max_batch; ++n, flags = dont_wait)
+		{
+#ifdef __WIN32__
+			u_long available = 0;
+			if(n > 0 && (ioctlsocket(_socket, FIONREAD, &available) != 0 || available == 0))
+				break;
+#endif
+			sockaddr_in address;
+			socklen_t   address_size = sizeof(address);
+			int size = recvfrom( _socket, buffer, sizeof(buffer), flags,
+				reinterpret_cast<sockaddr*>(&address), &address_size );
+			if(size < 0)
+				break;	// timed out, nothing left, or failed
+
+			endpoint_t from;
+			from.address = ntohl(address.sin_addr.s_addr);
+			from.port    = ntohs(address.sin_port);
+			receive(from, std::string(buffer, size), replies);
+		}
+
+		for(batch_t::const_iterator i = replies.begin(); i != replies.end(); ++i)
+		{
+			endpoint_t to;
+			to.address = i->first.first;
+			to.port    = i->first.second;
+			send_datagram(to, i->second);
+		}
+
+		retransmit();
+	}
+}
+
+std::string UdpTransport::message(
+	message_t type,
+	request_t request,
+	const std::string &body ) const
+{
+	std::string result;
+	result.reserve(header_size + body.size());
+	put_number(result, type, 1);
+	put_number(result, request, 4);
+	put_id(result, _id);
+	result += body;
+	return result;
+}
+
+UdpTransport::request_t UdpTransport::send(
+	const endpoint_t &to,
+	message_t type,
+	const std::string &body )
+{
+	omni_mutex_lock l(_mutex);
+	return send_unlocked(to, type, body);
+}
+
+UdpTransport::request_t UdpTransport::send_unlocked(
+	const endpoint_t &to,
+	message_t type,
+	const std::string &body )
+{
+	// Request numbers are random, so that a reply shows that the sender
+	// received the request.
+	request_t request;
+	do
+		request = randInt();
+	while(_pending.count(request));
+
+	Pending &pending = _pending[request];
+	pending.reply    = message_t(type + 1);
+	pending.to       = to;
+	pending.message  = char(version) + message(type, request, body);
+	pending.deadline = now() + retransmit_interval;
+	pending.attempts = 1;
+	pending.done     = _socket == INVALID_SOCKET || _closing;
+	pending.ok       = false;
+	pending.verify   = false;
+	if(!pending.done)
+		send_datagram(to, pending.message);
+	return request;
+}
+
+void UdpTransport::send_datagram(
+	const endpoint_t &to,
+	const std::string &datagram )
+{
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family      = AF_INET;
+	address.sin_addr.s_addr = htonl(to.address);
+	address.sin_port        = htons(to.port);
+	if(sendto( _socket, datagram.data(), int(datagram.size()), 0,
+			   reinterpret_cast<const sockaddr*>(&address), sizeof(address) ) < 0)
+		trace(29) << "UdpTransport::send_datagram(): failed to send datagram: " <<
+			socket_error() << endm;
+}
+
+void UdpTransport::receive(
+	const endpoint_t &from,
+	const std::string &datagram,
+	batch_t &replies )
+{
+	if(datagram.empty() || (unsigned char)datagram[0] != version)
+	{
+		trace(29) << "UdpTransport::receive(): ignoring datagram of unknown version" << endm;
+		return;
+	}
+
+	Reader reader(datagram, 1);
+	while(!reader.at_end())
+	{
+		message_t type    = message_t(reader.number(1));
+		request_t request = reader.number(4);
+		Id        sender  = reader.id();
+
+		compact_node_ref_t caller;
+		memcpy(caller.id, sender, sizeof(caller.id));
+		caller.endpoint = from;
+
+		switch(type)
+		{
+		case ping_request:
+			if(!reader.ok())
+				break;
+			if(!verified(caller))
+			{
+				queue(replies, from, message(ping_reply, request, std::string()));
+				break;
+			}
+			try
+			{
+				_handler.handle_ping(caller);
+				queue(replies, from, message(ping_reply, request, std::string()));
+			}
+			catch(const CORBA::Exception &)
+			{
+				trace(29) << "UdpTransport::receive(): ping request dropped" << endm;
+			}
+			break;
+
+		case find_nodes_request:
+		{
+			Id target = reader.id();
+			if(!reader.ok())
+				break;
+			if(!verified(caller))
+			{
+				trace(29) << "UdpTransport::receive(): find_nodes request from unverified sender dropped" << endm;
+				break;
+			}
+			try
+			{
+				seq_compact_node_ref_t_var nodes = _handler.handle_find_nodes(caller, target);
+				std::string body;
+				put_number(body, nodes->length(), 1);
+				for(unsigned n = 0; n < nodes->length(); ++n)
+				{
+					put_id(body, Id(nodes[n].id));
+					put_number(body, nodes[n].endpoint.address, 4);
+					put_number(body, nodes[n].endpoint.port, 2);
+				}
+				queue(replies, from, message(find_nodes_reply, request, body));
+			}
+			catch(const CORBA::Exception &)
+			{
+				trace(29) << "UdpTransport::receive(): find_nodes request dropped" << endm;
+			}
+			break;
+		}
+
+		case ping_reply:
+		case find_nodes_reply:
+		{
+			seq_compact_node_ref_t nodes;
+			if(type == find_nodes_reply)
+			{
+				unsigned count = reader.number(1);
+				if(count > replication_factor)
+					return;
+				nodes.length(count);
+				for(unsigned n = 0; n < count; ++n)
+				{
+					memcpy(nodes[n].id, reader.id(), sizeof(nodes[n].id));
+					nodes[n].endpoint.address = reader.number(4);
+					nodes[n].endpoint.port    = reader.number(2);
+				}
+			}
+			if(reader.ok())
+				complete(request, from, type, sender, nodes);
+			break;
+		}
+
+		default:
+			reader.octets(datagram.size());	// the rest cannot be parsed
+		}
+	}
+
+	if(!reader.ok())
+		trace(29) << "UdpTransport::receive(): ignoring malformed message" << endm;
+}
+
+void UdpTransport::queue(
+	batch_t &batch,
+	const endpoint_t &to,
+	const std::string &message )
+{
+	std::string &datagram = batch[std::make_pair(to.address, to.port)];
+	if(!datagram.empty() && datagram.size() + message.size() > max_datagram)
+	{
+		send_datagram(to, datagram);
+		datagram.clear();
+	}
+	if(datagram.empty())
+		datagram += char(version);
+	datagram += message;
+}
+
+void UdpTransport::complete(
+	request_t request,
+	const endpoint_t &from,
+	message_t reply,
+	const Id &id,
+	const seq_compact_node_ref_t &nodes )
+{
+	bool verified_ping = false;
+	{
+		omni_mutex_lock l(_mutex);
+		pending_t::iterator i = _pending.find(request);
+		if( i == _pending.end() || i->second.done || i->second.reply != reply ||
+			i->second.to.address != from.address || i->second.to.port != from.port )
+			return;	// duplicate, late or unexpected reply
+
+		add_peer_unlocked(from, id, true);
+		if(i->second.verify)
+		{
+			verified_ping = (i->second.id == id);
+			_pending.erase(i);
+		}
+		else
+		{
+			i->second.done  = true;
+			i->second.ok    = true;
+			i->second.id    = id;
+			i->second.nodes = nodes;
+			_cond.broadcast();
+		}
+	}
+
+	// The sender pinged us before it was verified; let the handler see it.
+	if(verified_ping)
+	{
+		compact_node_ref_t caller;
+		memcpy(caller.id, id, sizeof(caller.id));
+		caller.endpoint = from;
+		try
+		{
+			_handler.handle_ping(caller);
+		}
+		catch(const CORBA::Exception &)
+		{
+			trace(29) << "UdpTransport::complete(): ping of verified sender dropped" << endm;
+		}
+	}
+}
+
+bool UdpTransport::verified(
+	const compact_node_ref_t &caller )
+{
+	omni_mutex_lock l(_mutex);
+	Id id(caller.id);
+	peers_t::const_iterator i = _peers.find(std::make_pair(caller.endpoint.address, caller.endpoint.port));
+	if(i != _peers.end() && i->second.expiration > now())
+	{
+		if(i->second.verified && i->second.id == id)
+			return true;
+		if(!i->second.verified)
+			return false;	// being verified already
+	}
+
+	// Ping the sender. It is remembered meanwhile, so that a flood of
+	// requests from it costs a single ping.
+	add_peer_unlocked(caller.endpoint, id, false);
+	request_t request = send_unlocked(caller.endpoint, ping_request, std::string());
+	_pending[request].verify = true;
+	_pending[request].id     = id;
+	return false;
+}
+
+void UdpTransport::add_peer_unlocked(
+	const endpoint_t &endpoint,
+	const Id &id,
+	bool verified )
+{
+	const mstime_t t = now();
+	std::pair<unsigned long, unsigned short> key(endpoint.address, endpoint.port);
+	if(_peers.size() >= max_peers && !_peers.count(key))
+	{
+		for(peers_t::iterator i = _peers.begin(); i != _peers.end(); )
+			if(i->second.expiration <= t)
+				_peers.erase(i++);
+			else
+				++i;
+		if(_peers.size() >= max_peers)
+			_peers.erase(_peers.begin());
+	}
+
+	Peer &peer = _peers[key];
+	peer.id         = id;
+	peer.verified   = verified;
+	peer.expiration = t + (verified ? peer_lifetime : max_attempts*retransmit_interval);
+}
+
+void UdpTransport::retransmit( )
+{
+	omni_mutex_lock l(_mutex);
+	const mstime_t t = now();
+	bool failed = false;
+	for(pending_t::iterator i = _pending.begin(); i != _pending.end(); )
+	{
+		Pending &pending = i->second;
+		if(pending.done || pending.deadline > t)
+		{
+			++i;
+			continue;
+		}
+		if(pending.attempts == max_attempts)
+		{
+			// Nobody collects the pings sent to verify senders.
+			if(pending.verify)
+			{
+				_pending.erase(i++);
+				continue;
+			}
+			pending.done = true;
+			failed = true;
+			++i;
+			continue;
+		}
+		++pending.attempts;
+		pending.deadline = t + retransmit_interval;
+		send_datagram(pending.to, pending.message);
+		++i;
+	}
+	if(failed)
+		_cond.broadcast();
+}
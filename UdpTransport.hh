@@ -0,0 +1,237 @@
+#ifndef UDPTRANSPORT_HH_INCLUDED
+#define UDPTRANSPORT_HH_INCLUDED
+
+#include "kademlia.hh"
+
+#include "Id.hh"
+#include "time.hh"
+
+#include <omnithread.h>
+#include <map>
+#include <string>
+
+/*
+	A compact binary datagram protocol for the small, latency-sensitive Node
+	operations ping and find_nodes, running alongside CORBA. A node listens
+	for datagrams on the UDP port with the same number as its IIOP port, so
+	the endpoint in a compact node reference identifies both.
+
+	Every datagram starts with a protocol version octet, followed by one or
+	more messages; replies to requests that arrive together are batched into
+	as few datagrams as possible. A message consists of a type octet, a
+	32-bit request number, the 20-byte sender ID and a body:
+
+	    ping request / reply     (empty)
+	    find_nodes request       target ID (20 octets)
+	    find_nodes reply         count (1 octet), then per node its ID (20
+	                             octets), IPv4 address (4) and port (2)
+
+	All integers are big-endian. Requests are retransmitted until a reply
+	arrives, up to max_attempts times; lost replies are not otherwise
+	detected, which is fine because both requests are idempotent.
+
+	The source of a datagram is easily forged, so requests are only passed
+	to the handler once the sender is verified: it must have answered a
+	request sent to its endpoint, whose number is random. Pings from other
+	senders are answered, as the reply is no larger than the request, and
+	make the transport ping the sender in turn; once that is answered, the
+	handler sees the ping. Their find_nodes requests are dropped, lest the
+	transport reflect large replies at a forged source, and are answered
+	when retransmitted after verification. Handlers run on the receiver
+	thread and must not block.
+*/
+class UdpTransport
+{
+public:
+
+	// Serves the requests received by a transport.
+	class Handler
+	{
+	public:
+		virtual ~Handler( );
+
+		virtual void handle_ping(
+			const kademlia::compact_node_ref_t &caller ) = 0;
+
+		virtual kademlia::seq_compact_node_ref_t *handle_find_nodes(
+			const kademlia::compact_node_ref_t &caller,
+			const Id &target ) = 0;
+	};
+
+	typedef unsigned long request_t;
+
+	static const unsigned version             = 1;
+	static const unsigned max_datagram        = 1400;	// octets
+	static const unsigned max_attempts        = 3;
+	static const unsigned retransmit_interval = 250;	// milliseconds
+
+	// Maximum number of datagrams handled before the replies to them are
+	// sent and timed out requests retransmitted.
+	static const unsigned max_batch = 64;
+
+	// Number of senders remembered, and how long they stay verified.
+	static const unsigned max_peers     = 4096;
+	static const unsigned peer_lifetime = 10*60*1000;	// 10 minutes
+
+	UdpTransport(
+		const Id &id,
+		Handler &handler );
+
+	// Closes the transport, failing the requests still outstanding.
+	~UdpTransport( );
+
+	// Binds to the given UDP port on all interfaces and starts serving.
+	bool open(
+		unsigned short port );
+
+	// Sends a request and returns its number; the reply is collected with
+	// poll() or wait(). Requests sent before open() fail immediately.
+	request_t ping(
+		const kademlia::endpoint_t &to );
+
+	request_t find_nodes(
+		const kademlia::endpoint_t &to,
+		const Id &target );
+
+	// Returns false if the request has not completed yet. Otherwise, returns
+	// true and sets ok to whether a reply arrived, in which case id is set to
+	// the ID of the node that replied and nodes to the nodes it returned (for
+	// find_nodes). Every request must be collected once, after which it is
+	// forgotten.
+	bool poll(
+		request_t request,
+		bool &ok,
+		Id &id,
+		kademlia::seq_compact_node_ref_t_var &nodes );
+
+	// Like poll(), but waits for the request to complete; returns ok.
+	bool wait(
+		request_t request,
+		Id &id,
+		kademlia::seq_compact_node_ref_t_var &nodes );
+
+private:
+
+	enum message_t { ping_request = 1, ping_reply, find_nodes_request, find_nodes_reply };
+
+	// Time the receiver waits for datagrams before checking for timeouts.
+	static const unsigned poll_interval = 50;	// milliseconds
+
+	struct Pending
+	{
+		message_t            reply;	// type of the expected reply
+		kademlia::endpoint_t to;
+		std::string          message;	// encoded, for retransmission
+		mstime_t             deadline;	// of the current attempt
+		unsigned             attempts;
+		bool                 done, ok;
+		bool                 verify;	// sent to verify a sender; not collected
+		Id                   id;
+		kademlia::seq_compact_node_ref_t nodes;
+	};
+
+	typedef std::map<request_t, Pending> pending_t;
+
+	// A sender known by its endpoint, verified or being verified.
+	struct Peer
+	{
+		Id       id;
+		mstime_t expiration;
+		bool     verified;
+	};
+
+	typedef std::map< std::pair<unsigned long, unsigned short>, Peer > peers_t;
+
+	// Outgoing messages per destination, as (address, port).
+	typedef std::map< std::pair<unsigned long, unsigned short>, std::string > batch_t;
+
+	UdpTransport(const UdpTransport &);
+	UdpTransport &operator=(const UdpTransport &);
+
+	static void *receiver(
+		void *transport );
+
+	void run( );
+
+	// Encodes a message sent by this node.
+	std::string message(
+		message_t type,
+		request_t request,
+		const std::string &body ) const;
+
+	request_t send(
+		const kademlia::endpoint_t &to,
+		message_t type,
+		const std::string &body );
+
+	// Like send(); the mutex must be held.
+	request_t send_unlocked(
+		const kademlia::endpoint_t &to,
+		message_t type,
+		const std::string &body );
+
+	// Returns whether the caller has answered a request sent to its endpoint
+	// recently; if not, pings it to find out.
+	bool verified(
+		const kademlia::compact_node_ref_t &caller );
+
+	// Remembers a sender; the mutex must be held.
+	void add_peer_unlocked(
+		const kademlia::endpoint_t &endpoint,
+		const Id &id,
+		bool verified );
+
+	void send_datagram(
+		const kademlia::endpoint_t &to,
+		const std::string &datagram );
+
+	// Handles the messages in a datagram; replies are added to the batch.
+	void receive(
+		const kademlia::endpoint_t &from,
+		const std::string &datagram,
+		batch_t &replies );
+
+	// Adds a message to the batch for the destination, sending the datagram
+	// built so far first if the message does not fit in it.
+	void queue(
+		batch_t &batch,
+		const kademlia::endpoint_t &to,
+		const std::string &message );
+
+	void complete(
+		request_t request,
+		const kademlia::endpoint_t &from,
+		message_t reply,
+		const Id &id,
+		const kademlia::seq_compact_node_ref_t &nodes );
+
+	// Collects a completed request; see poll(). The mutex must be held.
+	void collect_unlocked(
+		pending_t::iterator i,
+		bool &ok,
+		Id &id,
+		kademlia::seq_compact_node_ref_t_var &nodes );
+
+	// Retransmits or fails requests whose attempt has timed out.
+	void retransmit( );
+
+#ifdef __WIN32__
+	typedef UINT_PTR socket_t;	// a SOCKET
+#else
+	typedef int      socket_t;
+#endif
+
+	const Id  _id;
+	Handler  &_handler;
+	socket_t  _socket;
+
+	omni_mutex     _mutex;
+	omni_condition _cond;	// signalled when requests complete
+	pending_t      _pending;
+	peers_t        _peers;
+	bool           _closing;
+	omni_thread   *_thread;
+
+}; // class UdpTransport
+
+#endif //ndef UDPTRANSPORT_HH_INCLUDED
@@ -0,0 +1,538 @@
+/*
+	Micro-benchmarks for the core data structures.
+
+	Every benchmark is run with 1, 2, 4, ... threads (up to the maximum given
+	on the command line), all operating on the same shared data structure.
+	Results are written to standard output as one JSON object per line:
+
+	{"benchmark":"id_xor","threads":2,"operations":1000000,"ns_per_op":3.1,
+	 "ops_per_sec":6.4e+08,"allocs_per_op":0}
+
+	ns_per_op is the average time an operation takes on one thread; allocs_per_op
+	counts calls to operator new (allocations made by C code are not counted).
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <omnithread.h>
+
+#include "kademlia.hh"
+#include "ContactTable.hh"
+#include "DataTable.hh"
+#include "Id.hh"
+#include "compare_any.hh"
+#include "logging.hh"
+#include "random.hh"
+#include "time.hh"
+
+using namespace std;
+using namespace kademlia;
+
+CORBA::ORB_var orb;
+
+
+/*
+	Allocation counting.
+*/
+
+static volatile unsigned long allocations = 0;
+
+void *operator new(size_t size) throw(std::bad_alloc)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	void *ptr = malloc(size ? size : 1);
+	if(!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new[](size_t size) throw(std::bad_alloc)
+{
+	return operator new(size);
+}
+
+void operator delete(void *ptr) throw()
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) throw()
+{
+	free(ptr);
+}
+
+
+/*
+	Benchmark framework.
+*/
+
+static unsigned long iterations  = 1000000;
+static unsigned long entries     = 1000000;
+static unsigned      max_threads = 4;
+
+// Returns the current (real) time in nanoseconds.
+static double precise_time()
+{
+	unsigned long s, ns;
+	omni_thread::get_time(&s, &ns);
+	return s*1e9 + ns;
+}
+
+class Benchmark
+{
+public:
+	Benchmark(const char *name, unsigned long operations, bool threaded = true) :
+		name(name), operations(operations), threaded(threaded)
+	{
+	}
+
+	virtual ~Benchmark() { }
+
+	// Prepares the benchmark for the given number of threads (not measured).
+	virtual void setup(unsigned threads) { }
+
+	// Executes the given number of operations on a thread (measured).
+	virtual void run(unsigned thread, unsigned long count) = 0;
+
+	// Cleans up after a run (not measured).
+	virtual void teardown() { }
+
+	const char    *name;
+	unsigned long operations;
+	bool          threaded;
+};
+
+struct Worker
+{
+	Benchmark     *benchmark;
+	unsigned      thread;
+	unsigned long count;
+};
+
+static omni_mutex     start_mutex;
+static omni_condition start_cond(&start_mutex);
+static bool           started;
+
+static void *worker_thread(void *arg)
+{
+	Worker &worker = *static_cast<Worker*>(arg);
+	{
+		omni_mutex_lock l(start_mutex);
+		while(!started)
+			start_cond.wait();
+	}
+	worker.benchmark->run(worker.thread, worker.count);
+	return 0;
+}
+
+static void measure(Benchmark &benchmark)
+{
+	for(unsigned threads = 1; threads <= max_threads; threads *= 2)
+	{
+		if(threads > 1 && !benchmark.threaded)
+			break;
+
+		benchmark.setup(threads);
+
+		vector<Worker>       workers(threads);
+		vector<omni_thread*> handles(threads);
+		started = false;
+		for(unsigned n = 0; n < threads; ++n)
+		{
+			workers[n].benchmark = &benchmark;
+			workers[n].thread    = n;
+			workers[n].count     = benchmark.operations/threads;
+			handles[n] = new omni_thread(worker_thread, &workers[n]);
+			handles[n]->start();
+		}
+
+		unsigned long allocs = allocations;
+		double t = precise_time();
+		{
+			omni_mutex_lock l(start_mutex);
+			started = true;
+			start_cond.broadcast();
+		}
+		for(unsigned n = 0; n < threads; ++n)
+			handles[n]->join(0);
+		t = precise_time() - t;
+		allocs = allocations - allocs;
+
+		unsigned long ops = (benchmark.operations/threads)*threads;
+		cout << "{\"benchmark\":\"" << benchmark.name << "\""
+			 << ",\"threads\":" << threads
+			 << ",\"operations\":" << ops
+			 << ",\"ns_per_op\":" << t*threads/ops
+			 << ",\"ops_per_sec\":" << ops/(t/1e9)
+			 << ",\"allocs_per_op\":" << double(allocs)/ops
+			 << "}" << endl;
+
+		benchmark.teardown();
+	}
+}
+
+// Returns a vector of random identifiers.
+static vector<Id> random_ids(unsigned long count)
+{
+	vector<Id> ids(count);
+	for(unsigned long n = 0; n < count; ++n)
+		ids[n] = Id::random();
+	return ids;
+}
+
+
+/*
+	Id benchmarks.
+*/
+
+static const unsigned long id_pool_size = 4096;
+
+class IdBenchmark : public Benchmark
+{
+public:
+	IdBenchmark(const char *name, unsigned long operations) :
+		Benchmark(name, operations), ids(random_ids(id_pool_size))
+	{
+	}
+
+protected:
+	vector<Id> ids;
+	volatile unsigned long sink;
+};
+
+struct IdXor : public IdBenchmark
+{
+	IdXor() : IdBenchmark("id_xor", iterations) { }
+
+	void run(unsigned thread, unsigned long count)
+	{
+		unsigned long result = 0;
+		for(unsigned long n = 0; n < count; ++n)
+		{
+			Id d = ids[n%id_pool_size] ^ ids[(n + 1)%id_pool_size];
+			result += static_cast<const kademlia::id_t&>(d)[0];
+		}
+		sink = result;
+	}
+};
+
+struct IdCompare : public IdBenchmark
+{
+	IdCompare() : IdBenchmark("id_compare", iterations) { }
+
+	void run(unsigned thread, unsigned long count)
+	{
+		unsigned long result = 0;
+		for(unsigned long n = 0; n < count; ++n)
+			result += ids[n%id_pool_size] < ids[(n + 1)%id_pool_size];
+		sink = result;
+	}
+};
+
+struct IdBitscan : public IdBenchmark
+{
+	IdBitscan() : IdBenchmark("id_bitscan", iterations) { }
+
+	void run(unsigned thread, unsigned long count)
+	{
+		unsigned long result = 0;
+		for(unsigned long n = 0; n < count; ++n)
+			result += (ids[n%id_pool_size] ^ ids[(n + 1)%id_pool_size]).bitscan();
+		sink = result;
+	}
+};
+
+struct IdHash : public IdBenchmark
+{
+	IdHash() : IdBenchmark("id_hash", iterations/10) { }
+
+	void run(unsigned thread, unsigned long count)
+	{
+		unsigned long result = 0;
+		for(unsigned long n = 0; n < count; ++n)
+		{
+			const kademlia::id_t &id = ids[n%id_pool_size];
+			result += static_cast<const kademlia::id_t&>(Id::hash(id, sizeof(id)))[0];
+		}
+		sink = result;
+	}
+};
+
+struct IdStr : public IdBenchmark
+{
+	IdStr() : IdBenchmark("id_str", iterations/10) { }
+
+	void run(unsigned thread, unsigned long count)
+	{
+		unsigned long result = 0;
+		for(unsigned long n = 0; n < count; ++n)
+			result += ids[n%id_pool_size].str().size();
+		sink = result;
+	}
+};
+
+
+/*
+	ContactTable benchmarks.
+*/
+
+// Number of random identifiers offered to a contact table to fill it to a
+// realistic size (about 20 contacts for every doubling of the network size).
+static const unsigned long contact_pool_size = 100000;
+
+class ContactTableBenchmark : public Benchmark
+{
+public:
+	ContactTableBenchmark(const char *name, unsigned long operations) :
+		Benchmark(name, operations), ids(random_ids(contact_pool_size)), table(0)
+	{
+	}
+
+	void teardown()
+	{
+		delete table;
+		table = 0;
+	}
+
+protected:
+	vector<Id>    ids;
+	ContactTable *table;
+};
+
+struct ContactTableInsert : public ContactTableBenchmark
+{
+	ContactTableInsert() : ContactTableBenchmark("contacttable_insert", iterations/10) { }
+
+	void setup(unsigned threads)
+	{
+		table = new ContactTable(Id::random());
+	}
+
+	void run(unsigned thread, unsigned long count)
+	{
+		for(unsigned long n = 0; n < count; ++n)
+			table->insert(ids[(thread*count + n)%contact_pool_size], Node::_nil(), true);
+	}
+};
+
+struct ContactTableRetrieve : public ContactTableBenchmark
+{
+	ContactTableRetrieve() : ContactTableBenchmark("contacttable_retrieve", iterations/100) { }
+
+	void setup(unsigned threads)
+	{
+		table = new ContactTable(Id::random());
+		for(unsigned long n = 0; n < contact_pool_size; ++n)
+			table->insert(ids[n], Node::_nil(), true);
+	}
+
+	void run(unsigned thread, unsigned long count)
+	{
+		for(unsigned long n = 0; n < count; ++n)
+		{
+			seq_node_ref_t_var nodes = table->retrieve(ids[(thread*count + n)%contact_pool_size]);
+		}
+	}
+};
+
+
+/*
+	DataTable benchmarks. These use a virtual clock, so entries never expire
+	unless the clock is advanced explicitly.
+*/
+
+static VirtualClock virtual_clock;
+
+// Returns the (shared) keys of the data table entries.
+static const vector<Id> &entry_ids()
+{
+	static vector<Id> ids = random_ids(entries);
+	return ids;
+}
+
+class DataTableBenchmark : public Benchmark
+{
+public:
+	DataTableBenchmark(const char *name, unsigned long operations, bool threaded = true) :
+		Benchmark(name, operations, threaded), ids(entry_ids()), table(0)
+	{
+		value <<= static_cast<CORBA::ULong>(12345);
+	}
+
+	void fill(mstime_t lifetime)
+	{
+		for(unsigned long n = 0; n < entries; ++n)
+			table->store(ids[n], value, lifetime);
+	}
+
+	void teardown()
+	{
+		delete table;
+		table = 0;
+	}
+
+protected:
+	const vector<Id> &ids;
+	CORBA::Any        value;
+	DataTable        *table;
+};
+
+struct DataTableStore : public DataTableBenchmark
+{
+	DataTableStore() : DataTableBenchmark("datatable_store", entries) { }
+
+	void setup(unsigned threads)
+	{
+		table = new DataTable();
+	}
+
+	void run(unsigned thread, unsigned long count)
+	{
+		for(unsigned long n = 0; n < count; ++n)
+			table->store(ids[thread*count + n], value, 60*60*1000);
+	}
+};
+
+struct DataTableRetrieve : public DataTableBenchmark
+{
+	DataTableRetrieve() : DataTableBenchmark("datatable_retrieve", iterations) { }
+
+	void setup(unsigned threads)
+	{
+		table = new DataTable();
+		fill(60*60*1000);
+	}
+
+	void run(unsigned thread, unsigned long count)
+	{
+		for(unsigned long n = 0; n < count; ++n)
+		{
+			seq_value_t_var values = table->retrieve(ids[(thread*count + n)%entries]);
+		}
+	}
+};
+
+struct DataTablePurge : public DataTableBenchmark
+{
+	DataTablePurge() : DataTableBenchmark("datatable_purge", entries, false) { }
+
+	void setup(unsigned threads)
+	{
+		table = new DataTable();
+		fill(1000);
+		virtual_clock.advance(2000);
+	}
+
+	void run(unsigned thread, unsigned long count)
+	{
+		table->purge();
+	}
+};
+
+
+/*
+	CORBA::Any comparison benchmarks.
+*/
+
+struct AnyEqual : public Benchmark
+{
+	AnyEqual(const char *name, const CORBA::Any &a, const CORBA::Any &b) :
+		Benchmark(name, iterations/100), a(a), b(b)
+	{
+	}
+
+	void run(unsigned thread, unsigned long count)
+	{
+		unsigned long result = 0;
+		for(unsigned long n = 0; n < count; ++n)
+			result += (a == b);
+		sink = result;
+	}
+
+	const CORBA::Any a, b;
+	volatile unsigned long sink;
+};
+
+
+static void usage(const char *prog)
+{
+	cerr << "Usage: " << prog << " [options] [benchmark name prefix...]\n"
+		 << "\t-iterations N  base number of operations per benchmark (default " << iterations << ")\n"
+		 << "\t-entries N     number of entries in data table benchmarks (default " << entries << ")\n"
+		 << "\t-threads N     maximum number of threads (default " << max_threads << ")" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+	orb = CORBA::ORB_init(argc, argv);
+	trace_level(0);
+
+	vector<string> filters;
+	for(int n = 1; n < argc; ++n)
+	{
+		string arg = argv[n];
+		if(arg == "-iterations" && n + 1 < argc)
+			iterations = strtoul(argv[++n], 0, 10);
+		else
+		if(arg == "-entries" && n + 1 < argc)
+			entries = strtoul(argv[++n], 0, 10);
+		else
+		if(arg == "-threads" && n + 1 < argc)
+			max_threads = atoi(argv[++n]);
+		else
+		if(arg[0] != '-')
+			filters.push_back(arg);
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(iterations < 100 || entries < 1 || max_threads < 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	use_clock(&virtual_clock);
+
+	CORBA::Any long_a, long_b, long_c, string_a, string_b;
+	long_a   <<= static_cast<CORBA::Long>(123);
+	long_b   <<= static_cast<CORBA::Long>(123);
+	long_c   <<= static_cast<CORBA::Long>(456);
+	string_a <<= "The quick brown fox jumps over the lazy dog";
+	string_b <<= "The quick brown fox jumps over the lazy dog";
+
+	vector<Benchmark*> benchmarks;
+	benchmarks.push_back(new IdXor());
+	benchmarks.push_back(new IdCompare());
+	benchmarks.push_back(new IdBitscan());
+	benchmarks.push_back(new IdHash());
+	benchmarks.push_back(new IdStr());
+	benchmarks.push_back(new ContactTableInsert());
+	benchmarks.push_back(new ContactTableRetrieve());
+	benchmarks.push_back(new DataTableStore());
+	benchmarks.push_back(new DataTableRetrieve());
+	benchmarks.push_back(new DataTablePurge());
+	benchmarks.push_back(new AnyEqual("any_equal_long",     long_a,   long_b));
+	benchmarks.push_back(new AnyEqual("any_unequal_long",   long_a,   long_c));
+	benchmarks.push_back(new AnyEqual("any_equal_string",   string_a, string_b));
+
+	for(unsigned n = 0; n < benchmarks.size(); ++n)
+	{
+		bool selected = filters.empty();
+		for(unsigned m = 0; m < filters.size() && !selected; ++m)
+			selected = strncmp(benchmarks[n]->name, filters[m].c_str(), filters[m].size()) == 0;
+		if(selected)
+			measure(*benchmarks[n]);
+		delete benchmarks[n];
+	}
+
+	use_clock(0);
+	return 0;
+}
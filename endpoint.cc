@@ -0,0 +1,194 @@
+#include "endpoint.hh"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <omnithread.h>
+
+using namespace kademlia;
+
+extern CORBA::ORB_var orb;
+
+// Profile tag of IIOP profiles in an IOR.
+static const unsigned long tag_internet_iop = 0;
+
+namespace {
+
+// Reads CDR encoded data from an encapsulation, whose first octet gives its
+// byte order. Alignment is relative to the start of the encapsulation.
+class CdrReader
+{
+public:
+	CdrReader(const unsigned char *data, size_t size) :
+		_data(data), _size(size), _pos(1), _ok(size > 0),
+		_little(size > 0 && data[0] != 0)
+	{
+	}
+
+	bool ok() const { return _ok; }
+
+	// Reads an unsigned integer of the given size (2 or 4 octets).
+	unsigned long number(size_t size)
+	{
+		_pos = (_pos + size - 1)/size*size;
+		const unsigned char *p = octets(size);
+		unsigned long value = 0;
+		for(size_t n = 0; p && n < size; ++n)
+			value |= (unsigned long)p[_little ? n : size - 1 - n] << 8*n;
+		return value;
+	}
+
+	// Returns the next size octets and skips them; 0 if there are too few.
+	const unsigned char *octets(size_t size)
+	{
+		if(!_ok || size > _size - _pos)
+		{
+			_ok = false;
+			return 0;
+		}
+		_pos += size;
+		return _data + _pos - size;
+	}
+
+private:
+	const unsigned char *_data;
+	size_t               _size, _pos;
+	bool                 _ok, _little;
+};
+
+}
+
+// Finds the first IIOP profile with an IPv4 address in an object reference,
+// and returns the IIOP version and object key along with the endpoint.
+static bool profile_of(
+	CORBA::Object_ptr obj,
+	endpoint_t &endpoint,
+	unsigned &major,
+	unsigned &minor,
+	std::string &key )
+{
+	if(CORBA::is_nil(obj))
+		return false;
+
+	// The stringified IOR is the hex encoding of an encapsulated IOR.
+	CORBA::String_var ior = orb->object_to_string(obj);
+	const char *hex = ior;
+	if(strncmp(hex, "IOR:", 4) != 0)
+		return false;
+	hex += 4;
+	std::vector<unsigned char> data(strlen(hex)/2);
+	if(data.empty())
+		return false;
+	for(size_t n = 0; n < data.size(); ++n)
+	{
+		unsigned octet;
+		if(sscanf(hex + 2*n, "%2x", &octet) != 1)
+			return false;
+		data[n] = octet;
+	}
+
+	CdrReader reader(&data[0], data.size());
+	reader.octets(reader.number(4));	// repository id
+	unsigned long profiles = reader.number(4);
+	for(unsigned long p = 0; p < profiles && reader.ok(); ++p)
+	{
+		unsigned long tag = reader.number(4), size = reader.number(4);
+		const unsigned char *body = reader.octets(size);
+		if(!body || tag != tag_internet_iop)
+			continue;
+
+		// The profile body holds the IIOP version, host, port and object key.
+		CdrReader profile(body, size);
+		const unsigned char *version = profile.octets(2);
+		unsigned long length = profile.number(4);
+		const char *host = (const char*)profile.octets(length);
+		unsigned short port = profile.number(2);
+		unsigned long key_length = profile.number(4);
+		const unsigned char *key_data = profile.octets(key_length);
+		if(!profile.ok() || length == 0 || host[length - 1] != '\0')
+			continue;
+
+		unsigned a, b, c, d;
+		char rest;
+		if( sscanf(host, "%u.%u.%u.%u%c", &a, &b, &c, &d, &rest) != 4 ||
+			a > 255 || b > 255 || c > 255 || d > 255 )
+			continue;
+		endpoint.address = (a << 24) | (b << 16) | (c << 8) | d;
+		endpoint.port    = port;
+		major = version[0];
+		minor = version[1];
+		key.assign((const char*)key_data, key_length);
+		return true;
+	}
+	return false;
+}
+
+bool endpoint_of(CORBA::Object_ptr obj, endpoint_t &endpoint)
+{
+	unsigned major, minor;
+	std::string key;
+	return profile_of(obj, endpoint, major, minor, key);
+}
+
+// The IIOP version and escaped object key of references built by node_at();
+// by default those of the node activated by the kademlia server.
+static omni_mutex  template_mutex;
+static std::string template_version = "1.2";
+static std::string template_key     = "%ffKademlia%00Node";
+
+bool use_node_template(CORBA::Object_ptr obj)
+{
+	endpoint_t endpoint;
+	unsigned major, minor;
+	std::string key;
+	if(!profile_of(obj, endpoint, major, minor, key))
+		return false;
+
+	// Escape all but the characters that may appear unescaped in a corbaloc.
+	char version[16];
+	sprintf(version, "%u.%u", major, minor);
+	std::string escaped;
+	for(size_t n = 0; n < key.size(); ++n)
+	{
+		unsigned char c = key[n];
+		if(isalnum(c) || strchr(";/:?@&=+$,-_.!~*'()", c))
+			escaped += c;
+		else
+		{
+			char hex[4];
+			sprintf(hex, "%%%02x", c);
+			escaped += hex;
+		}
+	}
+
+	omni_mutex_lock l(template_mutex);
+	template_version = version;
+	template_key     = escaped;
+	return true;
+}
+
+Node_ptr node_at(const endpoint_t &endpoint)
+{
+	std::string version, key;
+	{
+		omni_mutex_lock l(template_mutex);
+		version = template_version;
+		key     = template_key;
+	}
+
+	char address[32];
+	sprintf( address, "%lu.%lu.%lu.%lu:%u",
+		(unsigned long)(endpoint.address >> 24) & 255,
+		(unsigned long)(endpoint.address >> 16) & 255,
+		(unsigned long)(endpoint.address >>  8) & 255,
+		(unsigned long) endpoint.address        & 255,
+		(unsigned)endpoint.port );
+	std::string url = "corbaloc::" + version + "@" + address + "/" + key;
+
+	// An unchecked narrow avoids asking the node for its type.
+	CORBA::Object_var obj = orb->string_to_object(url.c_str());
+	return Node::_unchecked_narrow(obj);
+}
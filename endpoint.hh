@@ -0,0 +1,19 @@
+#ifndef ENDPOINT_HH
+#define ENDPOINT_HH
+
+#include "kademlia.hh"
+
+// Finds the IPv4 endpoint in the IIOP profile of an object reference; returns
+// false if the reference is nil or has no such profile.
+bool endpoint_of(CORBA::Object_ptr obj, kademlia::endpoint_t &endpoint);
+
+// Returns a reference to the Node object served at the endpoint, as activated
+// by the kademlia server. The reference is built locally; nothing is sent.
+kademlia::Node_ptr node_at(const kademlia::endpoint_t &endpoint);
+
+// Makes node_at() build references with the IIOP version and object key of
+// the given reference, normally that of the local node, since all nodes
+// activate theirs alike. Returns false if it has no IIOP profile.
+bool use_node_template(CORBA::Object_ptr obj);
+
+#endif //ndef ENDPOINT_HH
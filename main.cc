@@ -1,6 +1,8 @@
 #include "main.hh"
 
 #include <ctime>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <utility>
 #include <string>
@@ -11,13 +13,69 @@
 #include "kademlia.hh"
 #include "Node.hh"
 #include "Broker.hh"
+#include "RefCache.hh"
+#include "endpoint.hh"
 #include "logging.hh"
+#include "time.hh"
 
 CORBA::ORB_var orb;
 
 Node_impl   *node_servant;
 Broker_impl *broker_servant;
 
+static const char *data_file_path = 0;
+static const char *contacts_file_path = 0;
+static const char *metrics_file_path = 0;
+static mstime_t durable_lifetime = ~mstime_t(0);
+static size_t data_capacity = 0;
+static DataTable::eviction_policy eviction_policy = DataTable::evict_nearest_expiration;
+static mstime_t drain_budget = 10000;
+static unsigned long hot_key_rate = Node_impl::default_hot_key_rate;
+static unsigned max_calls = AdmissionControl::default_max_calls;
+static bool compact_refs = false;
+static bool use_udp = false;
+static std::vector< std::pair<Dispatcher::queue_t, std::pair<unsigned, unsigned> > > worker_limits;
+
+// ORB threads beyond the calls the dispatcher admits, for calls that are not
+// dispatched and for those that are about to be rejected.
+static const unsigned spare_server_threads = 16;
+
+// Reads the -workers options, which are needed before the ORB is initialized
+// to size its thread pool, and returns the number of calls they admit. Also
+// returns the thread pool size given with -ORBmaxServerThreadPoolSize, if any.
+static unsigned parse_worker_limits(int argc, char *argv[], unsigned &orb_threads)
+{
+    for(int n = 1; n < argc; ++n)
+        if(strcmp(argv[n], "-ORBmaxServerThreadPoolSize") == 0 && n + 1 < argc)
+            orb_threads = std::strtoul(argv[++n], 0, 10);
+        else
+        if(strcmp(argv[n], "-workers") == 0 && n + 3 < argc)
+        {
+            const char *name = argv[++n];
+            unsigned workers = std::strtoul(argv[++n], 0, 10),
+                     queued  = std::strtoul(argv[++n], 0, 10);
+            if(strcmp(name, "maintenance") == 0)
+                worker_limits.push_back(std::make_pair(Dispatcher::maintenance, std::make_pair(workers, queued)));
+            else
+            if(strcmp(name, "routing") == 0)
+                worker_limits.push_back(std::make_pair(Dispatcher::routing, std::make_pair(workers, queued)));
+            else
+            if(strcmp(name, "data") == 0)
+                worker_limits.push_back(std::make_pair(Dispatcher::data, std::make_pair(workers, queued)));
+            else
+            if(strcmp(name, "client") == 0)
+                worker_limits.push_back(std::make_pair(Dispatcher::client, std::make_pair(workers, queued)));
+            else
+                error() << "Unknown call class \"" << name << "\"" << endm;
+        }
+
+    Dispatcher limits;
+    for(size_t n = 0; n < worker_limits.size(); ++n)
+        limits.limit( worker_limits[n].first,
+            worker_limits[n].second.first, worker_limits[n].second.second );
+    return limits.capacity();
+}
+
 PortableServer::ObjectId objectid(const char *str)
 {
 	unsigned len = strlen(str);
@@ -29,17 +87,13 @@ static void run_bootstrap_thread(void *contacts_ptr)
 {
     const std::vector<std::string> &contacts =
         *static_cast<const std::vector<std::string>*>(contacts_ptr);
-        
-	// FIXME: Wait 3 secs so the ORB has time to start up. This is a dirty hack!
-	omni_thread::self()->sleep(3);
 
-	// Bootstrap node
+	// Bootstrap node; the POA manager is already active at this point, so
+	// we can accept the incoming calls this triggers.
     info() << "Bootstrapping local node ID " << node_servant->id() << endm;
-    for(std::vector<std::string>::const_iterator i = contacts.begin();
-        i != contacts.end(); ++i)
-    {
-    	node_servant->add_initial_contact(i->c_str());
-    }
+    if(contacts_file_path)
+        node_servant->open_contacts_file(contacts_file_path);
+    node_servant->add_initial_contacts(contacts);
 
     if(!node_servant->initialize(*broker_servant))
 	{
@@ -48,7 +102,35 @@ static void run_bootstrap_thread(void *contacts_ptr)
 	}
 }
 
-static void initialize_servants()
+// Hands the stored entries over to other nodes and shuts down.
+static void run_drain_thread(void *unused)
+{
+    if(node_servant->drain(drain_budget))
+        orb->shutdown(true);
+}
+
+#ifndef __WIN32__
+
+#include <signal.h>
+
+static sigset_t drain_signals;
+
+// Waits for a termination signal and drains the node. The signals must be
+// blocked in all threads, so that they are only received here.
+static void run_signal_thread(void *unused)
+{
+    int sig;
+    if(sigwait(&drain_signals, &sig) != 0)
+        return;
+    info() << "Received signal " << sig << "; draining before shutdown" << endm;
+    run_drain_thread(0);
+}
+
+#endif //ndef __WIN32__
+
+// Creates and activates the servants; returns true once they are ready to
+// accept requests.
+static bool initialize_servants()
 {
     try {
     
@@ -76,6 +158,19 @@ static void initialize_servants()
 		// Create and activate servant objects
 		node_servant   = new Node_impl();
 		broker_servant = new Broker_impl(*node_servant);
+
+		node_servant->limit_data(data_capacity, eviction_policy);
+		node_servant->set_hot_key_rate(hot_key_rate);
+		node_servant->use_compact_refs(compact_refs);
+		node_servant->limit_calls(max_calls);
+		for(size_t n = 0; n < worker_limits.size(); ++n)
+			node_servant->limit_workers( worker_limits[n].first,
+				worker_limits[n].second.first, worker_limits[n].second.second );
+
+		// Load persisted data before we start serving requests.
+		if(data_file_path && !node_servant->open_data_file(data_file_path, durable_lifetime))
+			error() << "Could not open data file " << data_file_path <<
+				"; data will not be persisted" << endm;
 		
 		child_poa->activate_object_with_id(objectid("Node"),   node_servant),
         child_poa->activate_object_with_id(objectid("Broker"), broker_servant);
@@ -89,14 +184,24 @@ static void initialize_servants()
 			ior = orb->object_to_string(obj); 
 			info() << "Node servant can be reached at \n" << (const char*)ior << endm;
 
+			// References to other nodes are built after our own.
+			if(!use_node_template(obj))
+				error() << "Node reference has no IIOP profile" << endm;
+
 			obj = broker_servant->_this();
             ior = orb->object_to_string(obj);
 			info() << "Broker servant can be reached at \n" << (const char*)ior << endm;
         }
 
+		if(use_udp && !node_servant->open_udp())
+			error() << "Could not open UDP transport; using CORBA only" << endm;
+
+		if(metrics_file_path && !node_servant->open_metrics_file(metrics_file_path))
+			error() << "Could not write metrics file " << metrics_file_path << endm;
+
 		// Tell the POA manager to start accepting requests on its objects.
         poa_manager->activate();
-       
+        return true;
     }
     catch(CORBA::SystemException &) {
 		error(true) << "Caught CORBA::SystemException while initializing servants" << std::endl;
@@ -107,6 +212,7 @@ static void initialize_servants()
     catch(...) {
         error(true) << "Caught unknown exception while initializing servants" << std::endl;
     }
+    return false;
 }
 
 #ifdef __WIN32__
@@ -161,9 +267,10 @@ static void WINAPI service_control_handler(DWORD opcode)
 	switch(opcode)
 	{
 	case SERVICE_CONTROL_STOP: 
-		service_status.dwCurrentState = SERVICE_STOPPED;
+		service_status.dwCurrentState = SERVICE_STOP_PENDING;
+		service_status.dwWaitHint     = static_cast<DWORD>(drain_budget) + 5000;
 		SetServiceStatus(h_server_status, &service_status);
-		orb->shutdown(true);
+		(new omni_thread(run_drain_thread))->start();
 	break;
 	}
 }
@@ -191,8 +298,37 @@ static void run_service_thread(void *unused)
 
 int main(int argc, char* argv[])
 {
-	// Initialise the ORB
-    orb = CORBA::ORB_init(argc, argv);
+#	ifndef __WIN32__
+	// Block termination signals before any threads are started, so that they
+	// are all left to the signal thread.
+	sigemptyset(&drain_signals);
+	sigaddset(&drain_signals, SIGINT);
+	sigaddset(&drain_signals, SIGTERM);
+	sigprocmask(SIG_BLOCK, &drain_signals, 0);
+#	endif
+
+	// Initialise the ORB. Calls are dispatched from a bounded pool of threads
+	// rather than by a thread per connection, which would give a thread to
+	// every node talking to us. The pool is sized after the worker limits:
+	// calls waiting in a dispatcher queue hold their thread, so a smaller
+	// pool would run out before the queues reject any calls. Concurrent calls
+	// to a peer share a single connection, and outgoing connections idle for
+	// a minute or so are closed; -ORB arguments override these defaults.
+	unsigned orb_threads = 0;
+	unsigned admitted = parse_worker_limits(argc, argv, orb_threads);
+	if(orb_threads && orb_threads <= admitted)
+		error() << "-ORBmaxServerThreadPoolSize " << orb_threads << " does not exceed the " <<
+			admitted << " calls the -workers limits admit; calls may wait for an ORB "
+			"thread before any queue is full" << endm;
+	char pool_size[16];
+	std::sprintf(pool_size, "%u", admitted + spare_server_threads);
+	const char *orb_options[][2] = {
+		{ "threadPerConnectionPolicy", "0" },
+		{ "maxServerThreadPoolSize",   pool_size },
+		{ "oneCallPerConnection",      "0" },
+		{ "outConScanPeriod",          "30" },
+		{ 0, 0 } };
+    orb = CORBA::ORB_init(argc, argv, "omniORB4", orb_options);
 	trace_level(1000); // display all messages.
 
     std::vector<std::string> contacts;
@@ -202,6 +338,54 @@ int main(int argc, char* argv[])
     for(int n = 1; n < argc; ++n)
         if(argv[n][0] == '-')
         {
+            if(strcmp(argv[n], "-datafile") == 0 && n + 1 < argc)
+                data_file_path = argv[++n];
+            else
+            if(strcmp(argv[n], "-contacts") == 0 && n + 1 < argc)
+                contacts_file_path = argv[++n];
+            else
+            if(strcmp(argv[n], "-metrics") == 0 && n + 1 < argc)
+                metrics_file_path = argv[++n];
+            else
+            if(strcmp(argv[n], "-durable") == 0 && n + 1 < argc)
+                durable_lifetime = std::strtoul(argv[++n], 0, 10);
+            else
+            if(strcmp(argv[n], "-capacity") == 0 && n + 1 < argc)
+                data_capacity = std::strtoul(argv[++n], 0, 10)*1024*1024;
+            else
+            if(strcmp(argv[n], "-workers") == 0 && n + 3 < argc)
+                n += 3;	// read by parse_worker_limits()
+            else
+            if(strcmp(argv[n], "-maxcalls") == 0 && n + 1 < argc)
+                max_calls = std::strtoul(argv[++n], 0, 10);
+            else
+            if(strcmp(argv[n], "-compact") == 0)
+                compact_refs = true;
+            else
+            if(strcmp(argv[n], "-udp") == 0)
+                use_udp = true;
+            else
+            if(strcmp(argv[n], "-refs") == 0 && n + 1 < argc)
+                ref_cache().limit(std::strtoul(argv[++n], 0, 10));
+            else
+            if(strcmp(argv[n], "-hotrate") == 0 && n + 1 < argc)
+                hot_key_rate = std::strtoul(argv[++n], 0, 10);
+            else
+            if(strcmp(argv[n], "-drain") == 0 && n + 1 < argc)
+                drain_budget = std::strtoul(argv[++n], 0, 10);
+            else
+            if(strcmp(argv[n], "-eviction") == 0 && n + 1 < argc)
+            {
+                ++n;
+                if(strcmp(argv[n], "expiration") == 0)
+                    eviction_policy = DataTable::evict_nearest_expiration;
+                else
+                if(strcmp(argv[n], "distance") == 0)
+                    eviction_policy = DataTable::evict_farthest;
+                else
+                    error() << "Unknown eviction policy \"" << argv[n] << "\"" << endm;
+            }
+            else
 #ifdef __WIN32__
             if(strcmp(argv[n], "-install") == 0)
             {
@@ -226,26 +410,39 @@ int main(int argc, char* argv[])
             contacts.push_back(argv[n]);
     
 	info() << "Kademlia service starting" << endm;
+	start_coarse_clock();
 
 #	ifdef __WIN32__
 	omni_thread *service_thread = new omni_thread(run_service_thread);
 	service_thread->start();
 #	endif
 
-    // Initialize Broker and Node servants
-    initialize_servants();
-
-	// Start the bootstrapping thread.
+    // Initialize Broker and Node servants, and start bootstrapping as soon
+    // as they are ready.
+    if(!initialize_servants())
+    {
+        orb->destroy();
+        return 1;
+    }
 	omni_thread *bootstrap_thread = new omni_thread(run_bootstrap_thread, &contacts);
 	bootstrap_thread->start();
+#	ifndef __WIN32__
+	omni_thread *signal_thread = new omni_thread(run_signal_thread);
+	signal_thread->start();
+#	endif
 
     // Start running; only returns after ORB has been shut down.
     orb->run();
     
     // Exit cleanly.
 	info() << "Kademlia service exiting" << endm;
+	node_servant->save_contacts();
+#	ifdef __WIN32__
+	service_status.dwCurrentState = SERVICE_STOPPED;
+	SetServiceStatus(h_server_status, &service_status);
+#	endif
 	orb->destroy();
 	delete node_servant;
 	delete broker_servant;
-	
+	return 0;
 }
@@ -0,0 +1,60 @@
+#include "parallel.hh"
+
+#include <vector>
+
+#include <omnithread.h>
+
+struct ParallelWork
+{
+	void       (*task)(size_t n, void *arg);
+	void        *arg;
+	size_t       count;
+	omni_mutex   mutex;
+	size_t       next;
+};
+
+static void *parallel_worker(void *arg)
+{
+	ParallelWork &work = *static_cast<ParallelWork*>(arg);
+	for(;;)
+	{
+		size_t n;
+		{
+			omni_mutex_lock l(work.mutex);
+			if(work.next == work.count)
+				break;
+			n = work.next++;
+		}
+		work.task(n, work.arg);
+	}
+	return 0;
+}
+
+void run_parallel(
+	size_t count,
+	void (*task)(size_t n, void *arg),
+	void *arg,
+	size_t max_threads )
+{
+	if(count == 1 || max_threads <= 1)
+	{
+		for(size_t n = 0; n < count; ++n)
+			task(n, arg);
+		return;
+	}
+
+	ParallelWork work;
+	work.task  = task;
+	work.arg   = arg;
+	work.count = count;
+	work.next  = 0;
+
+	std::vector<omni_thread*> threads;
+	for(size_t n = 0; n < count && n < max_threads; ++n)
+	{
+		threads.push_back(new omni_thread(parallel_worker, &work));
+		threads.back()->start();
+	}
+	for(size_t n = 0; n < threads.size(); ++n)
+		threads[n]->join(0);
+}
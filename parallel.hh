@@ -0,0 +1,18 @@
+#ifndef PARALLEL_HH_INCLUDED
+#define PARALLEL_HH_INCLUDED
+
+#include <cstddef>
+
+/*
+	Calls task(n, arg) for every n from 0 to count (exclusive), using up to
+	max_threads threads at a time, and returns when all calls have finished.
+	Used to issue independent remote calls concurrently, so that a batch of
+	them takes about as long as the slowest call instead of their sum.
+*/
+void run_parallel(
+	size_t count,
+	void (*task)(size_t n, void *arg),
+	void *arg,
+	size_t max_threads );
+
+#endif //ndef PARALLEL_HH_INCLUDED
@@ -0,0 +1,522 @@
+/*
+	In-process Kademlia network simulator.
+
+	Starts a (large) number of nodes in a single process. Each node is hidden
+	behind a proxy servant that models the network link between the caller
+	and the node: calls are delayed by a per-link latency derived from random
+	network coordinates, may be lost with a configurable probability, and fail
+	when either end has left the network. All calls between nodes are made
+	through ordinary (colocated) CORBA object references.
+
+	After bootstrapping the network, a series of store, retrieve and
+	find_nodes operations is executed from randomly chosen nodes, optionally
+	while nodes are continuously replaced (churn). For each operation type,
+	the number of lookup hops (the longest chain of replies that led to the
+	result), the number of messages the operation sent and the latency
+	distribution are reported. Messages are counted only when they are sent
+	by the origin of the operation and concern its key, so maintenance
+	traffic running meanwhile is left out.
+
+	Latencies are modelled in milliseconds; the simulator sleeps for the
+	modelled latency multiplied by the time scale, and scales measured
+	durations back accordingly.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <omnithread.h>
+
+#include "kademlia.hh"
+#include "Broker.hh"
+#include "Node.hh"
+#include "logging.hh"
+#include "random.hh"
+#include "time.hh"
+
+using namespace std;
+using namespace kademlia;
+
+CORBA::ORB_var orb;
+
+
+/*
+	Simulation parameters (modifiable from the command line).
+*/
+
+static unsigned num_nodes      = 1000;
+static unsigned num_operations = 300;
+static double   min_latency    = 5;      // one-way latency between closest nodes (ms)
+static double   max_latency    = 100;    // one-way latency between farthest nodes (ms)
+static double   loss_rate      = 0;      // probability that a call is lost
+static double   call_timeout   = 1000;   // time after which a lost call fails (ms)
+static double   churn_rate     = 0;      // nodes replaced per (modelled) second
+static double   time_scale     = 0.05;   // real time slept per modelled millisecond
+
+
+/*
+	Simulated network.
+*/
+
+class SimNode;
+
+static omni_mutex             network_mutex;
+static vector<SimNode*>       network_nodes;
+static map<Id, SimNode*>      network_index;
+static volatile bool          network_delays = false;
+
+// Operation being measured: messages from its origin about its key are counted.
+static SimNode               *measured_origin   = 0;
+static Id                     measured_key;
+static unsigned long          measured_messages = 0;
+
+// Returns the current (real) time in milliseconds, with sub-millisecond precision.
+static double precise_time()
+{
+	unsigned long s, ns;
+	omni_thread::get_time(&s, &ns);
+	return s*1000.0 + ns/1000000.0;
+}
+
+// Sleeps for the given modelled number of milliseconds.
+static void delay(double ms)
+{
+	if(!network_delays || ms <= 0)
+		return;
+	unsigned long ns = static_cast<unsigned long>(ms*time_scale*1000000.0);
+	omni_thread::sleep(ns/1000000000, ns%1000000000);
+}
+
+class SimNode :
+	public POA_kademlia::Node
+{
+public:
+	SimNode( );
+
+	id_t_slice* ping (
+		const node_ref_t& caller );
+
+	void store (
+		const node_ref_t& caller,
+		const kademlia::id_t index,
+		const value_t& value );
+
+	seq_value_t* retrieve (
+		const node_ref_t& caller,
+		const kademlia::id_t index );
+
+	seq_node_ref_t* find_nodes (
+		const node_ref_t& caller,
+		const kademlia::id_t target );
+
+	seq_compact_node_ref_t* find_nodes_compact (
+		const node_ref_t& caller,
+		const kademlia::id_t target );
+
+	void store_batch (
+		const node_ref_t& caller,
+		const seq_entry_t& entries );
+
+	seq_value_t* find_value (
+		const node_ref_t& caller,
+		const kademlia::id_t index,
+		seq_node_ref_t_out nodes );
+
+	void cache (
+		const node_ref_t& caller,
+		const kademlia::id_t index,
+		const seq_value_t& values );
+
+	CORBA::ULong age( );
+
+	seq_node_ref_t* contacts( );
+
+	seq_entry_t* data( );
+
+	seq_hot_key_t* hot_keys( );
+
+	seq_stat_t* stats( );
+
+	seq_node_ref_t* contacts_page (
+		const kademlia::id_t cursor,
+		CORBA::ULong max,
+		kademlia::id_t next,
+		CORBA::Boolean& more );
+
+	seq_entry_t* data_page (
+		const kademlia::id_t cursor,
+		CORBA::ULong max,
+		kademlia::id_t next,
+		CORBA::Boolean& more );
+
+	Node_impl     node;
+	Broker_impl   broker;
+	Node_var      ref;
+	volatile bool alive;
+
+private:
+	// Models the transmission of a call from the caller to this node. Key
+	// is the index or target of the call, or 0 if it has none.
+	void transmit(
+		const node_ref_t& caller,
+		const CORBA::Octet *key );
+
+	double        _x, _y;          // network coordinates
+};
+
+SimNode::SimNode( ) :
+	broker(node),
+	alive(true),
+	_x(randDouble()),
+	_y(randDouble())
+{
+}
+
+void SimNode::transmit(const node_ref_t& caller, const CORBA::Octet *key)
+{
+	SimNode *from;
+	{
+		omni_mutex_lock l(network_mutex);
+		map<Id, SimNode*>::iterator i = network_index.find(Id(caller.id));
+		from = (i == network_index.end()) ? 0 : i->second;
+		if(from && from == measured_origin && key && Id(key) == measured_key)
+			++measured_messages;
+	}
+
+	if(!alive || (from && !from->alive) || (loss_rate > 0 && randDouble() < loss_rate))
+	{
+		delay(call_timeout);
+		throw CORBA::TRANSIENT();
+	}
+
+	double distance = 0;
+	if(from)
+	{
+		double dx = _x - from->_x, dy = _y - from->_y;
+		distance = sqrt((dx*dx + dy*dy)/2);
+	}
+	delay(2*(min_latency + (max_latency - min_latency)*distance));
+}
+
+id_t_slice* SimNode::ping(const node_ref_t& caller)
+{
+	transmit(caller, 0);
+	return node.ping(caller);
+}
+
+void SimNode::store(const node_ref_t& caller, const kademlia::id_t index, const value_t& value)
+{
+	transmit(caller, index);
+	node.store(caller, index, value);
+}
+
+seq_value_t* SimNode::retrieve(const node_ref_t& caller, const kademlia::id_t index)
+{
+	transmit(caller, index);
+	return node.retrieve(caller, index);
+}
+
+seq_node_ref_t* SimNode::find_nodes(const node_ref_t& caller, const kademlia::id_t target)
+{
+	transmit(caller, target);
+	return node.find_nodes(caller, target);
+}
+
+// Simulated nodes share one process and have no endpoint of their own, so
+// they act like nodes that predate compact references.
+seq_compact_node_ref_t* SimNode::find_nodes_compact(const node_ref_t&, const kademlia::id_t)
+{
+	throw CORBA::BAD_OPERATION(0, CORBA::COMPLETED_NO);
+}
+
+void SimNode::store_batch(const node_ref_t& caller, const seq_entry_t& entries)
+{
+	transmit(caller, 0);
+	node.store_batch(caller, entries);
+}
+
+seq_value_t* SimNode::find_value(const node_ref_t& caller, const kademlia::id_t index, seq_node_ref_t_out nodes)
+{
+	transmit(caller, index);
+	return node.find_value(caller, index, nodes);
+}
+
+void SimNode::cache(const node_ref_t& caller, const kademlia::id_t index, const seq_value_t& values)
+{
+	transmit(caller, index);
+	node.cache(caller, index, values);
+}
+
+CORBA::ULong SimNode::age( )
+{
+	return node.age();
+}
+
+seq_node_ref_t* SimNode::contacts( )
+{
+	return node.contacts();
+}
+
+seq_entry_t* SimNode::data( )
+{
+	return node.data();
+}
+
+seq_hot_key_t* SimNode::hot_keys( )
+{
+	return node.hot_keys();
+}
+
+seq_stat_t* SimNode::stats( )
+{
+	return node.stats();
+}
+
+seq_node_ref_t* SimNode::contacts_page(const kademlia::id_t cursor, CORBA::ULong max, kademlia::id_t next, CORBA::Boolean& more)
+{
+	return node.contacts_page(cursor, max, next, more);
+}
+
+seq_entry_t* SimNode::data_page(const kademlia::id_t cursor, CORBA::ULong max, kademlia::id_t next, CORBA::Boolean& more)
+{
+	return node.data_page(cursor, max, next, more);
+}
+
+// Returns a randomly selected node that is still part of the network.
+static SimNode *random_node()
+{
+	omni_mutex_lock l(network_mutex);
+	while(true)
+	{
+		SimNode *node = network_nodes[randInt(network_nodes.size() - 1)];
+		if(node->alive)
+			return node;
+	}
+}
+
+// Creates a new node and has it join the network.
+static SimNode *join_node()
+{
+	SimNode *node = new SimNode();
+	node->ref = node->_this();
+	node->node.advertise(node->ref);
+
+	SimNode *contact = 0;
+	{
+		omni_mutex_lock l(network_mutex);
+		if(!network_nodes.empty())
+			contact = network_nodes[randInt(network_nodes.size() - 1)];
+		network_nodes.push_back(node);
+		network_index[node->node.id()] = node;
+	}
+	while(contact && !contact->alive)
+		contact = random_node();
+
+	if(contact)
+	{
+		if(!node->node.add_initial_contact(contact->ref))
+			error() << "sim: node " << node->node.id() << " could not contact its initial contact" << endm;
+		else
+		if(!node->node.initialize(node->broker))
+			error() << "sim: node " << node->node.id() << " failed to initialize" << endm;
+	}
+	return node;
+}
+
+static volatile bool churning = false;
+
+static void churn_thread(void *unused)
+{
+	while(churning)
+	{
+		delay(1000.0/churn_rate);
+		random_node()->alive = false;
+		join_node();
+	}
+}
+
+
+/*
+	Statistics.
+*/
+
+struct OperationStats
+{
+	OperationStats() : hops(0), messages(0), failures(0) { }
+
+	vector<double> latencies;
+	unsigned long  hops, messages, failures;
+};
+
+static double percentile(vector<double> values, double p)
+{
+	if(values.empty())
+		return 0;
+	sort(values.begin(), values.end());
+	return values[static_cast<size_t>(p*(values.size() - 1) + 0.5)];
+}
+
+static void report(const char *name, const OperationStats &stats)
+{
+	unsigned count = stats.latencies.size();
+	if(count == 0)
+		return;
+	cout << setw(12) << name
+		 << setw(8)  << count
+		 << setw(10) << stats.failures
+		 << setw(10) << double(stats.hops)/count
+		 << setw(10) << double(stats.messages)/count
+		 << setw(10) << percentile(stats.latencies, 0.50)
+		 << setw(10) << percentile(stats.latencies, 0.90)
+		 << setw(10) << percentile(stats.latencies, 0.99)
+		 << setw(10) << percentile(stats.latencies, 1.00) << endl;
+}
+
+static void usage(const char *prog)
+{
+	cerr << "Usage: " << prog << " [options]\n"
+		 << "\t-nodes N          number of nodes (default " << num_nodes << ")\n"
+		 << "\t-ops N            number of operations (default " << num_operations << ")\n"
+		 << "\t-latency MIN MAX  one-way link latency range in ms (default " << min_latency << " " << max_latency << ")\n"
+		 << "\t-loss P           probability that a call is lost (default " << loss_rate << ")\n"
+		 << "\t-timeout MS       time after which lost calls fail (default " << call_timeout << ")\n"
+		 << "\t-churn R          nodes replaced per second (default " << churn_rate << ")\n"
+		 << "\t-timescale S      real time per modelled ms (default " << time_scale << ")" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+	orb = CORBA::ORB_init(argc, argv);
+	trace_level(0);
+
+	for(int n = 1; n < argc; ++n)
+	{
+		string arg = argv[n];
+		if(arg == "-nodes" && n + 1 < argc)
+			num_nodes = atoi(argv[++n]);
+		else
+		if(arg == "-ops" && n + 1 < argc)
+			num_operations = atoi(argv[++n]);
+		else
+		if(arg == "-latency" && n + 2 < argc)
+		{
+			min_latency = atof(argv[++n]);
+			max_latency = atof(argv[++n]);
+		}
+		else
+		if(arg == "-loss" && n + 1 < argc)
+			loss_rate = atof(argv[++n]);
+		else
+		if(arg == "-timeout" && n + 1 < argc)
+			call_timeout = atof(argv[++n]);
+		else
+		if(arg == "-churn" && n + 1 < argc)
+			churn_rate = atof(argv[++n]);
+		else
+		if(arg == "-timescale" && n + 1 < argc)
+			time_scale = atof(argv[++n]);
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(num_nodes < 2)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Activate the root POA, in which all proxy servants are activated implicitly.
+	{
+		CORBA::Object_var obj = orb->resolve_initial_references("RootPOA");
+		PortableServer::POA_var root_poa = PortableServer::POA::_narrow(obj);
+		PortableServer::POAManager_var poa_manager = root_poa->the_POAManager();
+		poa_manager->activate();
+	}
+
+	// Bootstrap the network, without link delays.
+	cout << "Starting " << num_nodes << " nodes..." << flush;
+	double started = precise_time();
+	for(unsigned n = 0; n < num_nodes; ++n)
+		join_node();
+	cout << " done in " << (precise_time() - started)/1000 << " s." << endl;
+
+	network_delays = true;
+	if(churn_rate > 0)
+	{
+		churning = true;
+		omni_thread::create(churn_thread);
+	}
+
+	// Run operations.
+	OperationStats stats[3];
+	vector<Id> stored_keys;
+	for(unsigned op = 0; op < num_operations; ++op)
+	{
+		SimNode *origin = random_node();
+		unsigned type = (stored_keys.empty() ? 0 : op%3);
+		Id key = (type == 1) ? stored_keys[randInt(stored_keys.size() - 1)] : Id::random();
+		{
+			omni_mutex_lock l(network_mutex);
+			measured_origin   = origin;
+			measured_key      = key;
+			measured_messages = 0;
+		}
+		origin->broker.watch(key);
+		bool success = true;
+		double t = precise_time();
+		try
+		{
+			if(type == 0)
+			{
+				CORBA::Any value;
+				value <<= static_cast<CORBA::ULong>(op);
+				origin->broker.store(key, value, 24*60*60*1000);
+				stored_keys.push_back(key);
+			}
+			else
+			if(type == 1)
+			{
+				seq_any_t_var values = origin->broker.retrieve(key);
+				success = values->length() > 0;
+			}
+			else
+			{
+				seq_node_ref_t_var nodes = origin->broker.find_nodes(key);
+				success = nodes->length() > 0;
+			}
+		}
+		catch(const CORBA::Exception &)
+		{
+			success = false;
+		}
+		OperationStats &s = stats[type];
+		s.latencies.push_back((precise_time() - t)/time_scale);
+		s.hops += origin->broker.watched_hops();
+		{
+			omni_mutex_lock l(network_mutex);
+			s.messages     += measured_messages;
+			measured_origin = 0;
+		}
+		if(!success)
+			++s.failures;
+	}
+	churning = false;
+
+	cout << setw(12) << "operation" << setw(8) << "count" << setw(10) << "failures"
+		 << setw(10) << "hops" << setw(10) << "messages" << setw(10) << "p50 ms"
+		 << setw(10) << "p90 ms" << setw(10) << "p99 ms" << setw(10) << "max ms" << endl;
+	report("store",      stats[0]);
+	report("retrieve",   stats[1]);
+	report("find_nodes", stats[2]);
+
+	orb->shutdown(true);
+	return 0;
+}
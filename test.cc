@@ -1,5 +1,6 @@
 #include <omniORB4/CORBA.h>
 #include <iostream>
+#include <cstdio>
 #include <cstring>
 #include "logging.hh"
 using namespace std;
@@ -67,13 +68,17 @@ void test_Id()
 
 void test_time()
 {
-    string line;
     cout << "Testing time functions..." << endl;
-    cout << "Current time in seconds: " << now()/1000.0 << " (press enter) " << flush;
-    getline(cin, line);
-    cout << "Current time in seconds: " << now()/1000.0 << " (press enter) " << flush;
-    getline(cin, line);
     cout << "Current time in seconds: " << now()/1000.0 << endl;
+    omni_thread::sleep(0, 250*1000000);
+    cout << "Current time in seconds: " << now()/1000.0 << " (after sleeping 0.25 s)" << endl;
+
+    VirtualClock clock;
+    use_clock(&clock);
+    cout << "Virtual time in seconds: " << now()/1000.0 << endl;
+    clock.advance(60*60*1000);
+    cout << "Virtual time in seconds: " << now()/1000.0 << " (after advancing 1 hour)" << endl;
+    use_clock(0);
     cout << endl;
 }
 
@@ -84,6 +89,8 @@ using namespace kademlia;
 
 void test_DataTable()
 {
+    VirtualClock clock;
+    use_clock(&clock);
     DataTable dt;
     
     Id index;
@@ -105,9 +112,9 @@ void test_DataTable()
     index = Id::hash("barKey", strlen("barKey")); value <<= (long)666;
     dt.store(index, value, 5*1000);
    
-    cout << "Delaying... " << " (press enter) " << flush;
-    string line; getline(cin, line);
-    cout << dt.purge() << " entries purged!" << endl;
+    cout << "Advancing clock by 6 seconds..." << endl;
+    clock.advance(6*1000);
+    cout << dt.purge() << " entries purged! (expected: 2)" << endl;
     
     for(int n = 0; n < 3; ++n)
     {
@@ -127,7 +134,191 @@ void test_DataTable()
             cout << " (lifetime: " << values[n].lifetime << ")" << endl;
         }
     }
-    
+
+    use_clock(0);
+}
+
+void test_DataTable_eviction()
+{
+    DataTable dt;
+    Id index = Id::hash("fooKey", strlen("fooKey"));
+    CORBA::Any value;
+
+    cout << "Testing eviction by nearest expiration..." << endl;
+    value <<= (long)1;
+    dt.store(index, value, 10*1000);
+    dt.limit(3*dt.bytes(), DataTable::evict_nearest_expiration);
+    value <<= (long)2;
+    dt.store(index, value, 20*1000);
+    value <<= (long)3;
+    dt.store(index, value, 30*1000);
+    value <<= (long)4;
+    cout << "Storing a fourth value: " << (dt.store(index, value, 40*1000) ? "stored" : "rejected") <<
+        " (expected: stored)" << endl;
+    value <<= (long)5;
+    cout << "Storing a value that expires first: " << (dt.store(index, value, 5*1000) ? "stored" : "rejected") <<
+        " (expected: rejected)" << endl;
+    kademlia::seq_value_t_var values = dt.retrieve(index);
+    cout << values->length() << " values kept, " << dt.evicted() << " evicted (expected: 3, 1)" << endl;
+    cout << endl;
+}
+
+void test_DataTable_cache()
+{
+    DataTable dt;
+    Id index = Id::hash("fooKey", strlen("fooKey"));
+    CORBA::Any value;
+
+    cout << "Testing cached values..." << endl;
+    value <<= (long)1;
+    dt.cache(index, value, 10*1000);
+    kademlia::seq_value_t_var values = dt.retrieve(index);
+    kademlia::seq_entry_t_var entries = dt.contents();
+    cout << values->length() << " values retrieved, " << entries->length() <<
+        " entries stored (expected: 1, 0)" << endl;
+    value <<= (long)2;
+    dt.store(index, value, 10*1000);
+    values = dt.retrieve(index);
+    long result = 0;
+    values[0].contents >>= result;
+    cout << values->length() << " values retrieved: " << result << " (expected: 1 values retrieved: 2)" << endl;
+    cout << endl;
+}
+
+void test_DataTable_page()
+{
+    DataTable dt;
+    CORBA::Any value;
+
+    cout << "Testing paginated contents..." << endl;
+    value <<= (long)1;
+    for(int n = 0; n < 5; ++n)
+    {
+        char key[] = "key0";
+        key[3] += n;
+        dt.store(Id::hash(key, strlen(key)), value, 10*1000);
+    }
+    Id cursor, next;
+    cursor.str(std::string(2*sizeof(kademlia::id_t), '0'));
+    bool more = true;
+    while(more)
+    {
+        kademlia::seq_entry_t_var entries = dt.page(cursor, 2, next, more);
+        cout << entries->length() << " entries, " << (more ? "more" : "no more") << endl;
+        cursor = next;
+    }
+    cout << "(expected: 2 entries, more; 2 entries, more; 1 entries, no more)" << endl;
+    cout << endl;
+}
+
+
+void test_DataFile()
+{
+    const char *path = "test_datafile.dat", *log_path = "test_datafile.dat.log";
+    std::remove(path);
+    std::remove(log_path);
+    Id index = Id::hash("fooKey", strlen("fooKey"));
+    CORBA::Any value;
+
+    cout << "Testing data file persistence..." << endl;
+    {
+        DataTable dt;
+        if(!dt.open(path))
+            cout << "Could not open " << path << "!" << endl;
+        cout << "Storing 'fooKey' ==> 123 (expires in 10 seconds)" << endl;
+        value <<= (long)123;
+        dt.store(index, value, 10*1000);
+        cout << "Storing 'fooKey' ==> 456 (expires immediately)" << endl;
+        value <<= (long)456;
+        dt.store(index, value, 0);
+    }
+    {
+        DataTable dt;
+        dt.open(path);
+        kademlia::seq_value_t_var values = dt.retrieve(index);
+        cout << "Reloaded " << values->length() << " value(s) for 'fooKey' (expected: 1)" << endl;
+        long number;
+        if(values->length() == 1 && (values[0].contents >>= number))
+            cout << "\t" << number << " (expected: 123)" << endl;
+        cout << "Erasing 'fooKey' ==> 123 (synced to disk)" << endl;
+        value <<= (long)123;
+        dt.store(index, value, 0, true);
+    }
+    {
+        DataTable dt;
+        dt.open(path);
+        kademlia::seq_value_t_var values = dt.retrieve(index);
+        cout << "Reloaded " << values->length() << " value(s) for 'fooKey' (expected: 0)" << endl;
+    }
+    std::remove(path);
+    std::remove(log_path);
+    cout << endl;
+}
+
+#include "Segment.hh"
+#include <algorithm>
+
+static bool entry_less(const Segment::Entry &a, const Segment::Entry &b)
+{
+    return a.index < b.index;
+}
+
+void test_DataTable_segment_eviction()
+{
+    const char *path = "test_segments.dat", *log_path = "test_segments.dat.log",
+               *manifest_path = "test_segments.dat.segments", *segment_path = "test_segments.dat.seg.0";
+    std::remove(path);
+    std::remove(log_path);
+    Id indices[6];
+    CORBA::Any value;
+
+    cout << "Testing eviction from a table with a segment..." << endl;
+    {
+        // Put a copy of every value on disk, so evicted entries must be hidden.
+        std::vector<Segment::Entry> entries(6);
+        for(int n = 0; n < 6; ++n)
+        {
+            char key[] = "key0";
+            key[3] += n;
+            indices[n] = Id::hash(key, strlen(key));
+            value <<= (long)n;
+            entries[n].index      = indices[n];
+            entries[n].value      = Blob(value);
+            entries[n].expiration = wall_now() + 60*60*1000;
+        }
+        std::sort(entries.begin(), entries.end(), entry_less);
+        Segment::Writer writer(segment_path, entries.size());
+        for(size_t n = 0; n < entries.size(); ++n)
+            writer.add(entries[n]);
+        writer.finish();
+        std::FILE *manifest = std::fopen(manifest_path, "w");
+        std::fputs("0\n", manifest);
+        std::fclose(manifest);
+    }
+    {
+        DataTable dt;
+        if(!dt.open(path))
+            cout << "Could not open " << path << "!" << endl;
+        value <<= (long)0;
+        dt.store(indices[0], value, 10*1000);
+        size_t capacity = 3*dt.bytes();
+        dt.limit(capacity, DataTable::evict_nearest_expiration);
+        int stored = 0;
+        for(int n = 1; n < 6; ++n)
+        {
+            value <<= (long)n;
+            stored += dt.store(indices[n], value, (n + 1)*10*1000);
+        }
+        cout << stored << " of 5 values stored, " << dt.evicted() << " evicted, within budget: " <<
+            (dt.bytes() <= capacity ? "yes" : "no") << " (expected: 5, 3, yes)" << endl;
+        kademlia::seq_value_t_var values = dt.retrieve(indices[0]);
+        cout << values->length() << " values of an evicted entry found on disk (expected: 0)" << endl;
+    }
+    std::remove(path);
+    std::remove(log_path);
+    std::remove(manifest_path);
+    std::remove(segment_path);
+    cout << endl;
 }
 
 
@@ -158,6 +349,381 @@ void test_ContactTable()
     cout << endl;
 }
 
+
+#include "Node.hh"
+
+// Returns a random ID equal to the given one in all bits from bit up, with
+// that bit flipped if flip is set.
+static Id id_below(const Id &id, unsigned bit, bool flip)
+{
+    Id result = Id::random();
+    for(unsigned b = bit; b < Id::bits; ++b)
+        result.set(b, id[b]);
+    if(flip)
+        result.set(bit, !id[bit]);
+    return result;
+}
+
+void test_hot_key_targets()
+{
+    // The replicas differ from the index below bit 10 only; copies belong in
+    // the subtree that differs in bit 10, not in the one beyond it.
+    Id index = Id::random();
+    ContactTable ct(index);
+    for(unsigned n = 0; n < kademlia::replication_factor; ++n)
+        ct.insert(n == 0 ? id_below(index, 9, true) : id_below(index, 10, false), Node::_nil());
+    for(unsigned n = 0; n < 10; ++n)
+    {
+        ct.insert(id_below(index, 10, true), Node::_nil());
+        ct.insert(id_below(index, 11, true), Node::_nil());
+    }
+
+    cout << "Testing hot key targets..." << endl;
+    seq_node_ref_t_var targets = Node_impl::hot_key_targets(index, ct);
+    unsigned sibling = 0, beyond = 0;
+    for(unsigned n = 0; n < targets->length(); ++n)
+    {
+        Id distance = index ^ Id(targets[n].id);
+        if(distance.bitscan() == 11)
+            ++sibling;
+        else
+            ++beyond;
+    }
+    cout << "Copies pushed to sibling subtree: " << sibling << ", elsewhere: " <<
+        beyond << " (expected: 8, 0)" << endl;
+    cout << endl;
+}
+
+
+#include "HotKeys.hh"
+
+void test_HotKeys()
+{
+    HotKeys hot(2);
+    Id a = Id::hash("a", 1), b = Id::hash("b", 1), c = Id::hash("c", 1);
+
+    cout << "Testing hot key tracking..." << endl;
+    for(unsigned n = 0; n < 5; ++n)
+        hot.hit(a);
+    for(unsigned n = 0; n < 3; ++n)
+        hot.hit(b);
+    hot.hit(c);
+    std::vector<HotKeys::Item> items;
+    hot.top(2, items);
+    cout << "Hottest key is " << (items[0].index == a ? "a" : "not a") << " with count " <<
+        items[0].count << "; runner-up count " << items[1].count << " with error " <<
+        items[1].error << " (expected: a, 5, 4, 3)" << endl;
+    hot.decay();
+    hot.top(2, items);
+    cout << "After decay: " << items[0].count << ", " << items[1].count << " (expected: 2, 2)" << endl;
+    cout << endl;
+}
+
+
+#include "AdmissionControl.hh"
+
+void test_AdmissionControl()
+{
+    AdmissionControl ac;
+    Id caller = Id::random(), other = Id::random();
+
+    cout << "Testing admission control..." << endl;
+    bool first  = ac.enter(caller, AdmissionControl::op_write, 2000);
+    bool second = ac.enter(caller, AdmissionControl::op_write);
+    bool third  = ac.enter(other, AdmissionControl::op_write);
+    cout << "Large batch " << (first ? "admitted" : "shed") << ", next store " <<
+        (second ? "admitted" : "shed") << ", store by other caller " <<
+        (third ? "admitted" : "shed") << " (expected: admitted, shed, admitted)" << endl;
+    if(first)
+        ac.leave();
+    if(third)
+        ac.leave();
+
+    ac.limit(AdmissionControl::default_max_calls);
+    unsigned admitted = 0;
+    for(unsigned n = 0; n < AdmissionControl::default_max_calls; ++n)
+        if(ac.enter(Id::random(), AdmissionControl::op_read))
+            ++admitted;
+    bool routing = ac.enter(Id::random(), AdmissionControl::op_routing);
+    cout << admitted << " concurrent reads admitted, routing call " <<
+        (routing ? "admitted" : "shed") << " (expected: 48, admitted)" << endl;
+
+    bool full   = AdmissionControl::is_dead(CORBA::TRANSIENT(AdmissionControl::full_minor, CORBA::COMPLETED_NO));
+    bool failed = AdmissionControl::is_dead(CORBA::COMM_FAILURE());
+    cout << "Full node " << (full ? "dropped" : "kept") << ", unreachable node " <<
+        (failed ? "dropped" : "kept") << " (expected: kept, dropped)" << endl;
+    cout << endl;
+}
+
+
+#include "Dispatcher.hh"
+
+void test_Dispatcher()
+{
+    Dispatcher dispatcher;
+    dispatcher.limit(Dispatcher::data, 1, 0);
+
+    cout << "Testing dispatch queues..." << endl;
+    Dispatcher::Slot slot(dispatcher, Dispatcher::data);
+    bool rejected = false;
+    try
+    {
+        Dispatcher::Slot second(dispatcher, Dispatcher::data);
+    }
+    catch(const CORBA::TRANSIENT &)
+    {
+        rejected = true;
+    }
+    Dispatcher::Slot routing(dispatcher, Dispatcher::routing);
+    cout << "Second data call " << (rejected ? "rejected" : "admitted") <<
+        ", routing call admitted (expected: rejected)" << endl;
+    cout << endl;
+}
+
+
+#include "Scheduler.hh"
+
+static mstime_t count_task(void *counter)
+{
+    ++*static_cast<unsigned*>(counter);
+    return now() + 10;
+}
+
+void test_Scheduler()
+{
+    Scheduler scheduler(2);
+    unsigned counter = 0, cancelled = 0;
+
+    cout << "Testing scheduler..." << endl;
+    Scheduler::task_t task = scheduler.schedule(now() + 10, count_task, &counter);
+    Scheduler::task_t never = scheduler.schedule(Scheduler::never, count_task, &cancelled);
+    sleep_until(now() + 100);
+    scheduler.cancel(task);
+    unsigned runs = counter;
+    scheduler.cancel(never);
+    sleep_until(now() + 50);
+    cout << "Periodic task ran " << (runs > 0 ? "repeatedly" : "never") << ", " <<
+        (counter == runs ? "not after" : "even after") << " cancellation; unwoken task ran " <<
+        cancelled << " times (expected: repeatedly, not after, 0)" << endl;
+    cout << endl;
+}
+
+#include "Lookup.hh"
+
+void test_Lookup()
+{
+    Id target = Id::random();
+    kademlia::seq_node_ref_t initial;
+    initial.length(8);
+    for(unsigned n = 0; n < 8; ++n)
+    {
+        Id id = Id::random();
+        memcpy(initial[n].id, id, sizeof(kademlia::id_t));
+    }
+
+    cout << "Testing lookup state machine..." << endl;
+    kademlia::seq_compact_node_ref_t endpoints;
+    endpoints.length(1);
+    memcpy(endpoints[0].id, initial[0].id, sizeof(kademlia::id_t));
+    endpoints[0].endpoint.address = 0x7f000001;
+    endpoints[0].endpoint.port    = 4000;
+    Lookup lookup(target, initial, true, &endpoints);
+    kademlia::endpoint_t endpoint;
+    bool known   = lookup.endpoint(Id(initial[0].id), endpoint) && endpoint.port == 4000,
+         unknown = !lookup.endpoint(Id(initial[1].id), endpoint);
+    cout << "Endpoints known: " << (known ? "yes" : "no") << ", unknown: " <<
+        (unknown ? "yes" : "no") << " (expected: yes, yes)" << endl;
+    kademlia::node_ref_t node[3];
+    unsigned issued = 0;
+    while(issued < 3 && lookup.next(node[issued]))
+        ++issued;
+    kademlia::node_ref_t extra;
+    cout << "Queries issued at once: " << issued << ", more: " <<
+        (lookup.next(extra) ? "yes" : "no") << " (expected: 3, no)" << endl;
+
+    kademlia::seq_node_ref_t none;
+    kademlia::seq_value_t values;
+    lookup.replied(Id(node[0].id), none, &values);
+    lookup.failed(Id(node[1].id));
+    values.length(1);
+    values[0].lifetime = 1000;
+    values[0].contents <<= CORBA::ULong(1);
+    lookup.replied(Id(node[2].id), none, &values);
+
+    // Other replicas return the same value, with a longer lifetime, and
+    // another one; the lookup stops once enough nodes returned values.
+    values.length(2);
+    values[0].lifetime = 2000;
+    values[1].lifetime = 1000;
+    values[1].contents <<= CORBA::ULong(2);
+    unsigned holders = 1;
+    kademlia::node_ref_t next;
+    while(lookup.next(next))
+    {
+        lookup.replied(Id(next.id), none, &values);
+        ++holders;
+        ++issued;
+    }
+
+    kademlia::node_ref_t miss;
+    unsigned closer;
+    kademlia::seq_node_ref_t_var nodes = lookup.nodes();
+    cout << "Queries issued: " << issued << ", nodes with values: " << holders <<
+        ", finished: " << (lookup.finished() ? "yes" : "no") <<
+        ", nodes: " << nodes->length() << ", values: " << lookup.values()->length() <<
+        ", lifetime: " << (*lookup.values())[0].lifetime <<
+        ", miss: " << (lookup.miss(miss, closer) ? "yes" : "no") <<
+        " (expected: 6, " << Lookup::value_nodes << ", yes, 7, 2, 2000, yes)" << endl;
+    cout << endl;
+}
+
+
+#include "endpoint.hh"
+
+void test_endpoint()
+{
+    kademlia::endpoint_t endpoint = { (10UL << 24) | (1 << 16) | (2 << 8) | 3, 4200 }, parsed;
+
+    cout << "Testing endpoints..." << endl;
+    kademlia::Node_var node = node_at(endpoint);
+    bool found = endpoint_of(node, parsed);
+    cout << "Endpoint found in reference: " << (found ? "yes" : "no") << ", same address and port: " <<
+        (found && parsed.address == endpoint.address && parsed.port == endpoint.port ? "yes" : "no") <<
+        " (expected: yes, yes)" << endl;
+
+    // References follow the version and key of the template.
+    CORBA::Object_var other = orb->string_to_object("corbaloc::1.1@10.1.2.3:4200/Other%20Node");
+    bool used = use_node_template(other);
+    kademlia::Node_var built = node_at(endpoint);
+    CORBA::String_var expected = orb->object_to_string(other), actual = orb->object_to_string(built);
+    use_node_template(node);
+    cout << "Template used: " << (used ? "yes" : "no") << ", same reference: " <<
+        (strcmp(expected, actual) == 0 ? "yes" : "no") << " (expected: yes, yes)" << endl;
+    cout << endl;
+}
+
+
+#include "UdpTransport.hh"
+
+// Answers find_nodes with the caller itself, as seen by the transport.
+class EchoHandler : public UdpTransport::Handler
+{
+public:
+    EchoHandler() : pings(0) { }
+
+    void handle_ping(const kademlia::compact_node_ref_t &)
+    {
+        ++pings;
+    }
+
+    kademlia::seq_compact_node_ref_t *handle_find_nodes(
+        const kademlia::compact_node_ref_t &caller, const Id &)
+    {
+        kademlia::seq_compact_node_ref_t_var nodes = new kademlia::seq_compact_node_ref_t();
+        nodes->length(1);
+        nodes[0] = caller;
+        return nodes._retn();
+    }
+
+    unsigned pings;
+};
+
+void test_UdpTransport()
+{
+    const unsigned short port_a = 14201, port_b = 14202, port_none = 14203;
+    const unsigned long loopback = 0x7f000001;
+    EchoHandler handler_a, handler_b;
+    Id a = Id::random(), b = Id::random(), id;
+    UdpTransport transport_a(a, handler_a), transport_b(b, handler_b);
+
+    cout << "Testing UDP transport on loopback..." << endl;
+    bool opened = transport_a.open(port_a) && transport_b.open(port_b);
+    kademlia::endpoint_t to_b = { loopback, port_b }, to_none = { loopback, port_none };
+    kademlia::seq_compact_node_ref_t_var nodes;
+    bool pinged = transport_a.wait(transport_a.ping(to_b), id, nodes) && id == b;
+    bool found = transport_a.wait(transport_a.find_nodes(to_b, Id::random()), id, nodes) &&
+        nodes->length() == 1 && Id(nodes[0].id) == a && nodes[0].endpoint.port == port_a;
+    mstime_t start = now();
+    bool lost = !transport_a.wait(transport_a.ping(to_none), id, nodes);
+    // The first ping is answered at once, but only reaches the handler once
+    // the transport has verified the sender.
+    cout << "Opened: " << (opened ? "yes" : "no") << ", ping answered: " << (pinged ? "yes" : "no") <<
+        " (" << (handler_b.pings > 0 ? "verified" : "unverified") << "), caller found: " << (found ? "yes" : "no") <<
+        ", unanswered ping failed: " << (lost ? "yes" : "no") << " after " << now() - start <<
+        " ms (expected: yes, yes (verified), yes, yes after about " <<
+        UdpTransport::max_attempts*UdpTransport::retransmit_interval << " ms)" << endl;
+    cout << endl;
+}
+
+
+#include "RefCache.hh"
+
+void test_RefCache()
+{
+    RefCache cache(2);
+    Id a = Id::random(), b = Id::random(), c = Id::random();
+    kademlia::endpoint_t endpoint = { 0x7f000001, 4200 };
+    kademlia::Node_var first = node_at(endpoint), second = node_at(endpoint);
+
+    cout << "Testing reference cache..." << endl;
+    kademlia::Node_var shared = cache.intern(a, first), copy = cache.intern(a, second);
+    bool same = shared.in() == first.in() && copy.in() == first.in();
+    kademlia::Node_var other = cache.intern(b, second);
+    kademlia::Node_var used = cache.find(a);    // b is now least recently used
+    kademlia::Node_var third = cache.intern(c, first);
+    kademlia::Node_var evicted = cache.find(b), kept = cache.find(a);
+    cout << "Copies share the first reference: " << (same ? "yes" : "no") << ", size: " <<
+        cache.size() << ", least recently used evicted: " << (CORBA::is_nil(evicted) ? "yes" : "no") <<
+        ", recently used kept: " << (CORBA::is_nil(kept) ? "no" : "yes") <<
+        " (expected: yes, 2, yes, yes)" << endl;
+
+    kademlia::endpoint_t moved_endpoint = { 0x7f000001, 4201 };
+    kademlia::Node_var moved = node_at(moved_endpoint);
+    kademlia::Node_var claimed = cache.intern(a, moved), proved = cache.intern(a, moved, true);
+    cout << "Claimed reference kept the cached one: " << (claimed.in() == first.in() ? "yes" : "no") <<
+        ", proved reference replaced it: " << (proved.in() == moved.in() ? "yes" : "no") <<
+        " (expected: yes, yes)" << endl;
+    cout << endl;
+}
+
+
+#include "Metrics.hh"
+
+void test_Metrics()
+{
+    Histogram histogram;
+    for(unsigned long v = 1; v <= 1000; ++v)
+        histogram.record(v);
+
+    cout << "Testing latency histograms..." << endl;
+    cout << histogram.count() << " values, median " << histogram.quantile(0.5) <<
+        ", 99th percentile " << histogram.quantile(0.99) << " (expected: 1000, 511, 1023)" << endl;
+
+    Metrics metrics;
+    {
+        Metrics::Call call(metrics, Metrics::node_ping);
+    }
+    try
+    {
+        Metrics::Call call(metrics, Metrics::node_ping);
+        throw CORBA::TRANSIENT();
+    }
+    catch(const CORBA::Exception &)
+    {
+    }
+    std::vector<Metrics::Sample> samples;
+    metrics.collect(samples);
+    std::string text = prometheus_text(samples);
+    bool calls    = text.find("kademlia_calls_total{interface=\"Node\",op=\"ping\"} 2\n") != std::string::npos,
+         failures = text.find("kademlia_call_failures_total{interface=\"Node\",op=\"ping\"} 1\n") != std::string::npos,
+         type     = text.find("# TYPE kademlia_call_seconds summary\n") != std::string::npos;
+    cout << "Calls counted: " << (calls ? "yes" : "no") << ", failures counted: " <<
+        (failures ? "yes" : "no") << ", summary typed: " << (type ? "yes" : "no") <<
+        " (expected: yes, yes, yes)" << endl;
+    cout << endl;
+}
+
+
 int main(int argc, char *argv[])
 {
 	orb = CORBA::ORB_init(argc, argv);
@@ -166,5 +732,20 @@ int main(int argc, char *argv[])
 	test_Id();
     test_time();
     test_DataTable();
+    test_DataTable_eviction();
+    test_DataTable_cache();
+    test_DataTable_page();
+    test_DataFile();
+    test_DataTable_segment_eviction();
     test_ContactTable();
+    test_hot_key_targets();
+    test_HotKeys();
+    test_AdmissionControl();
+    test_Dispatcher();
+    test_Scheduler();
+    test_Lookup();
+    test_endpoint();
+    test_RefCache();
+    test_UdpTransport();
+    test_Metrics();
 }
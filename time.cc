@@ -1,32 +1,227 @@
 #include "time.hh"
 
+#include <omnithread.h>
+
 #ifdef __WIN32__
 
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
 #include <sys/types.h>
 #include <sys/timeb.h>
 
-static mstime_t global_now()
+static mstime_t global_wall_now()
 {
     struct _timeb timebuffer;
     _ftime(&timebuffer);
-    return timebuffer.time*1000 + timebuffer.millitm;
+    return static_cast<mstime_t>(timebuffer.time)*1000 + timebuffer.millitm;
+}
+
+static mstime_t atomic_load(volatile mstime_t *value)
+{
+    return InterlockedCompareExchange64(reinterpret_cast<volatile LONGLONG*>(value), 0, 0);
+}
+
+static void atomic_store(volatile mstime_t *value, mstime_t t)
+{
+    InterlockedExchange64(reinterpret_cast<volatile LONGLONG*>(value), t);
+}
+
+static mstime_t global_now()
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if(frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return static_cast<mstime_t>(counter.QuadPart)*1000 / frequency.QuadPart;
+}
+
+static ustime_t global_precise_now()
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if(frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return static_cast<ustime_t>(counter.QuadPart)*1000000 / frequency.QuadPart;
 }
 #else
 
 // UNIX-specific code
 #include <sys/time.h>
-static mstime_t global_now()
+#include <time.h>
+
+static mstime_t global_wall_now()
 {
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    return tv.tv_sec*1000 + tv.tv_usec/1000;
+    return static_cast<mstime_t>(tv.tv_sec)*1000 + tv.tv_usec/1000;
+}
+
+static mstime_t atomic_load(volatile mstime_t *value)
+{
+    return __sync_fetch_and_add(value, 0);
+}
+
+static void atomic_store(volatile mstime_t *value, mstime_t t)
+{
+    mstime_t old = *value;
+    while(!__sync_bool_compare_and_swap(value, old, t))
+        old = *value;
+}
+
+static mstime_t global_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<mstime_t>(ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+static ustime_t global_precise_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<ustime_t>(ts.tv_sec)*1000000 + ts.tv_nsec/1000;
 }
 
 #endif
 
-static mstime_t started_at = global_now();
+static mstime_t started_at         = global_now();
+static mstime_t wall_started_at    = global_wall_now();
+static ustime_t precise_started_at = global_precise_now();
+
+// Clock installed by use_clock(), or 0 if the system clock is used.
+static Clock *volatile current_clock = 0;
 
 mstime_t now()
 {
+    Clock *clock = current_clock;
+    if(clock)
+        return clock->now();
     return global_now() - started_at;
 };
+
+ustime_t precise_now()
+{
+    return global_precise_now() - precise_started_at;
+}
+
+mstime_t wall_now()
+{
+    return wall_started_at + now();
+}
+
+
+/*
+    Coarse clock, sampled periodically by a dedicated thread. A 64-bit value
+    is not read or written atomically on every platform, so both go through
+    atomic operations.
+*/
+
+static volatile mstime_t coarse_time    = 0;
+static volatile bool     coarse_running = false;
+static omni_mutex        coarse_mutex;
+
+static void coarse_clock_thread(void *unused)
+{
+    while(true)
+    {
+        atomic_store(&coarse_time, global_now() - started_at);
+        omni_thread::sleep(0, coarse_clock_resolution*1000000);
+    }
+}
+
+mstime_t coarse_now()
+{
+    if(!coarse_running || current_clock)
+        return now();
+    return atomic_load(&coarse_time);
+}
+
+void start_coarse_clock()
+{
+    omni_mutex_lock l(coarse_mutex);
+    if(coarse_running)
+        return;
+    atomic_store(&coarse_time, global_now() - started_at);
+    omni_thread::create(coarse_clock_thread);
+    coarse_running = true;
+}
+
+
+/*
+    Waiting and clock selection.
+*/
+
+void wait_until(
+    omni_condition &cond,
+    mstime_t deadline )
+{
+    Clock *clock = current_clock;
+    if(clock)
+    {
+        clock->wait(cond, deadline);
+        return;
+    }
+
+    mstime_t t = now();
+    if(t >= deadline)
+        return;
+    unsigned long s, ns, delay = static_cast<unsigned long>(deadline - t);
+    omni_thread::get_time(&s, &ns, delay/1000, (delay%1000)*1000000);
+    cond.timedwait(s, ns);
+}
+
+void sleep_until(
+    mstime_t deadline )
+{
+    omni_mutex     mutex;
+    omni_condition cond(&mutex);
+    omni_mutex_lock l(mutex);
+    while(now() < deadline)
+        wait_until(cond, deadline);
+}
+
+void use_clock(
+    Clock *clock )
+{
+    current_clock = clock;
+}
+
+Clock::~Clock( )
+{
+}
+
+// Interval (in real milliseconds) at which threads waiting on a virtual clock
+// check whether their deadline has passed.
+static const unsigned long virtual_poll_interval = 10;
+
+VirtualClock::VirtualClock(
+    mstime_t start ) :
+    _now(start)
+{
+}
+
+mstime_t VirtualClock::now( )
+{
+    omni_mutex_lock l(_mutex);
+    return _now;
+}
+
+void VirtualClock::wait(
+    omni_condition &cond,
+    mstime_t deadline )
+{
+    if(now() >= deadline)
+        return;
+    unsigned long s, ns;
+    omni_thread::get_time(&s, &ns, 0, virtual_poll_interval*1000000);
+    cond.timedwait(s, ns);
+}
+
+void VirtualClock::advance(
+    mstime_t duration )
+{
+    omni_mutex_lock l(_mutex);
+    _now += duration;
+}
@@ -1,10 +1,105 @@
 #ifndef TIME_HH_INCLUDED
 #define TIME_HH_INCLUDED
 
+#include <omnithread.h>
+
 // Type is measured in milliseconds.
 typedef unsigned long long mstime_t;
 
-// Returns the real (wall clock) time elapsed since startup.
+// Type is measured in microseconds.
+typedef unsigned long long ustime_t;
+
+// Resolution of the coarse clock, in milliseconds.
+const mstime_t coarse_clock_resolution = 10;
+
+// Returns the time elapsed since startup, measured by a monotonic clock
+// (i.e. it is unaffected by changes to the system's wall clock time).
 mstime_t now();
 
+// Returns the time elapsed since startup, as last sampled by the coarse clock
+// thread. This is much cheaper than now() and suitable for hot code paths
+// that can lag by up to coarse_clock_resolution. If the coarse clock thread
+// has not been started, this is equivalent to now().
+mstime_t coarse_now();
+
+// Returns the time elapsed since startup in microseconds, as measured by the
+// system's monotonic clock, even if another clock has been installed. Use it
+// to measure how long operations take, not to schedule them.
+ustime_t precise_now();
+
+// Returns the wall clock time in milliseconds since the UNIX epoch. This is
+// derived from now() and the wall clock time at startup, so it advances with
+// now() (and with an installed virtual clock). Use it only for timestamps that
+// must remain meaningful across restarts.
+mstime_t wall_now();
+
+// Starts the thread that updates the coarse clock. Calling this function
+// more than once has no effect.
+void start_coarse_clock();
+
+// Waits on a condition variable, whose mutex must be held by the caller,
+// until it is signalled or until now() reaches the given deadline. Like any
+// condition variable wait, this may return early; callers should check their
+// predicate and the current time again after it returns.
+void wait_until(
+    omni_condition &cond,
+    mstime_t deadline );
+
+// Blocks the calling thread until now() reaches the given deadline.
+void sleep_until(
+    mstime_t deadline );
+
+
+/*
+    Clocks determine the time returned by now() and coarse_now() and the time
+    at which waiting threads are woken up. By default, the system's monotonic
+    clock is used; an alternative clock can be installed with use_clock().
+*/
+class Clock
+{
+public:
+    virtual ~Clock( );
+
+    virtual mstime_t now( ) = 0;
+
+    virtual void wait(
+        omni_condition &cond,
+        mstime_t deadline ) = 0;
+
+}; // class Clock
+
+/*
+    A clock that only advances when told to. Installing a virtual clock lets
+    tests and simulations run through hours of expiration, republishing and
+    maintenance cycles in milliseconds of real time.
+*/
+class VirtualClock : public Clock
+{
+public:
+    VirtualClock(
+        mstime_t start = 0 );
+
+    mstime_t now( );
+
+    void wait(
+        omni_condition &cond,
+        mstime_t deadline );
+
+    // Moves the clock forward; threads waiting for a deadline that has now
+    // passed are woken up shortly afterwards.
+    void advance(
+        mstime_t duration );
+
+private:
+    omni_mutex _mutex;
+    mstime_t   _now;
+
+}; // class VirtualClock
+
+// Installs the clock used by now(), coarse_now() and the wait functions; pass
+// 0 to restore the system clock. Install a clock before starting any threads
+// that read the time, and keep it alive until they have finished.
+void use_clock(
+    Clock *clock );
+
 #endif //ndef TIME_HH_INCLUDED